@@ -9,6 +9,26 @@
 #include <vector>
 #include <random>
 #include <ctime>
+#include <cmath>
+#include <array>
+#include <chrono>
+#include <iterator>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <queue>
+#include <optional>
+
+// build DP cell[] and artifact catalog at compile time and embed them in
+// binary. set to 0 if compiler hits constexpr limits, then they are built
+// at runtime on first use.
+#ifndef EMBED_TABLES
+#define EMBED_TABLES 1
+#endif
+
+#include <charconv>
+#include <string_view>
 
 #ifdef __clang__
 #include <emscripten/bind.h>
@@ -17,6 +37,14 @@ using namespace emscripten;
 #include <omp.h>
 #endif
 
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #ifdef _WIN32
 #include <format>
 using std::format;
@@ -28,9 +56,38 @@ using fmt::format;
 
 namespace DATA {
 
-    const int AFFIX_NUM = 4; // max affix number
-    const int AFFIX_UPDATE_MIN = 7, AFFIX_UPDATE_MAX = 10; // update weight range
-    const int AFFIX_MAX_UPGRADE_TIME = 5;
+    // rules of one artifact rarity. DP and catalog generation are templated on
+    // it, so every rarity gets its own compile time specialized instantiation.
+    struct RULES_5STAR {
+        static constexpr int AFFIX_NUM = 4; // max affix number
+        static constexpr int AFFIX_UPDATE_MIN = 7, AFFIX_UPDATE_MAX = 10; // update weight range
+        static constexpr int AFFIX_MAX_UPGRADE_TIME = 5;
+        // source https://genshin-impact.fandom.com/wiki/Artifacts/Distribution
+        static constexpr std::pair<int, int> INITIAL_AFFIX_NUM_WEIGHT_TABLE[] = { {3, 4}, {4, 1} };
+        inline static const std::vector<std::pair<int, int>> INITIAL_AFFIX_NUM_WEIGHT = std::vector<std::pair<int, int>>(
+            std::begin(INITIAL_AFFIX_NUM_WEIGHT_TABLE), std::end(INITIAL_AFFIX_NUM_WEIGHT_TABLE));
+        // dogfood needed by every upgrade (4 levels), and dogfood of feeding a +0
+        static constexpr int DOGFOOD_COST[AFFIX_MAX_UPGRADE_TIME] = { 16300, 28425, 42425, 66150, 117175 };
+        static constexpr int FEED_DOGFOOD = 3780;
+    };
+
+    // synthetic rule, NOT game data. it only exercises rule templating with a
+    // different sub number range, upgrade number and costs than 5-star, so
+    // its numbers are arbitrary and results of it mean nothing for the game.
+    struct RULES_SYNTHETIC {
+        static constexpr int AFFIX_NUM = 4;
+        static constexpr int AFFIX_UPDATE_MIN = 7, AFFIX_UPDATE_MAX = 10;
+        static constexpr int AFFIX_MAX_UPGRADE_TIME = 4;
+        static constexpr std::pair<int, int> INITIAL_AFFIX_NUM_WEIGHT_TABLE[] = { {2, 4}, {3, 1} };
+        inline static const std::vector<std::pair<int, int>> INITIAL_AFFIX_NUM_WEIGHT = std::vector<std::pair<int, int>>(
+            std::begin(INITIAL_AFFIX_NUM_WEIGHT_TABLE), std::end(INITIAL_AFFIX_NUM_WEIGHT_TABLE));
+        static constexpr int DOGFOOD_COST[AFFIX_MAX_UPGRADE_TIME] = { 10000, 20000, 30000, 40000 };
+        static constexpr int FEED_DOGFOOD = 2000;
+    };
+
+    const int AFFIX_NUM = RULES_5STAR::AFFIX_NUM; // max affix number
+    const int AFFIX_UPDATE_MIN = RULES_5STAR::AFFIX_UPDATE_MIN, AFFIX_UPDATE_MAX = RULES_5STAR::AFFIX_UPDATE_MAX; // update weight range
+    const int AFFIX_MAX_UPGRADE_TIME = RULES_5STAR::AFFIX_MAX_UPGRADE_TIME;
 
     enum class SET_NAMES { start, flower, plume, sands, goblet, circlet, end };
     const int SET_NUMBER = static_cast<int>(SET_NAMES::end) - static_cast<int>(SET_NAMES::start) - 1;
@@ -43,38 +100,114 @@ namespace DATA {
         pyroDB, hydroDB, electroDB, anemoDB, cryoDB, geoDB, physicalDB, dendroDB,
         end,
     };
-    const std::unordered_map<std::string, SET_NAMES> string_to_set_names = {
-        {"flower", SET_NAMES::flower},
-        {"plume", SET_NAMES::plume},
-        {"sands", SET_NAMES::sands},
-        {"goblet", SET_NAMES::goblet},
-        {"circlet", SET_NAMES::circlet},
+    // names indexed by enum value, start and end are empty
+    constexpr std::string_view SET_NAME_STRINGS[] = {
+        "", "flower", "plume", "sands", "goblet", "circlet", "",
+    };
+    constexpr std::string_view AFFIX_NAME_STRINGS[] = {
+        "",
+        "hp", "atk", "def",
+        "hpp", "atkp", "defp",
+        "em", "er", "cr", "cd",
+        "hb",
+        "pyroDB", "hydroDB", "electroDB", "anemoDB", "cryoDB", "geoDB", "physicalDB", "dendroDB",
+        "",
+    };
+    static_assert(std::size(SET_NAME_STRINGS) == static_cast<int>(SET_NAMES::end) + 1, "set name number wrong");
+    static_assert(std::size(AFFIX_NAME_STRINGS) == static_cast<int>(AFFIX_NAMES::end) + 1, "affix name number wrong");
+
+    // FNV-1a of str, started from seed
+    constexpr uint32_t name_hash(std::string_view str, uint32_t seed) {
+        uint32_t res = 2166136261u ^ seed;
+        for (auto c : str) {
+            res ^= static_cast<unsigned char>(c);
+            res *= 16777619u;
+        }
+        return res;
+    }
+
+    // perfect hash of a names table: with seed, every name goes to a distinct
+    // slot, which keeps its enum value. seed is searched at compile time.
+    template <size_t SIZE>
+    struct NameHash {
+        static constexpr int SLOTS = SIZE * 4 > 64 ? 128 : 64;
+        uint32_t seed = 0;
+        int slot[SLOTS] = {}; // enum value, 0 is empty
+
+        constexpr int find(std::string_view str, const std::string_view(&names)[SIZE]) const {
+            auto res = slot[name_hash(str, seed) % SLOTS];
+            return res && names[res] == str ? res : 0;
+        }
+    };
+
+    template <size_t SIZE>
+    constexpr NameHash<SIZE> build_name_hash(const std::string_view(&names)[SIZE]) {
+        NameHash<SIZE> res;
+        for (uint32_t seed = 0; ; seed++) {
+            bool ok = true;
+            for (auto& i : res.slot) i = 0;
+            for (size_t i = 1; i + 1 < SIZE && ok; i++) {
+                auto& slot = res.slot[name_hash(names[i], seed) % res.SLOTS];
+                if (slot) ok = false;
+                else slot = i;
+            }
+            if (ok) {
+                res.seed = seed;
+                return res;
+            }
+        }
+    }
+
+    // names and perfect hash of an enum type
+    template <class T>
+    struct NameTable;
+    template <>
+    struct NameTable<SET_NAMES> {
+        static constexpr const auto& NAMES = SET_NAME_STRINGS;
+        static constexpr auto HASH = build_name_hash(SET_NAME_STRINGS);
     };
-    const std::unordered_map<std::string, AFFIX_NAMES> string_to_affix_names = {
-        { "hp", AFFIX_NAMES::hp },
-        { "atk", AFFIX_NAMES::atk },
-        { "def", AFFIX_NAMES::def },
-        { "hpp", AFFIX_NAMES::hpp },
-        { "atkp", AFFIX_NAMES::atkp },
-        { "defp", AFFIX_NAMES::defp },
-        { "em", AFFIX_NAMES::em },
-        { "er", AFFIX_NAMES::er },
-        { "cr", AFFIX_NAMES::cr },
-        { "cd", AFFIX_NAMES::cd },
-        { "hb", AFFIX_NAMES::hb },
-        { "pyroDB", AFFIX_NAMES::pyroDB },
-        { "hydroDB", AFFIX_NAMES::hydroDB },
-        { "electroDB", AFFIX_NAMES::electroDB },
-        { "anemoDB", AFFIX_NAMES::anemoDB },
-        { "cryoDB", AFFIX_NAMES::cryoDB },
-        { "geoDB", AFFIX_NAMES::geoDB },
-        { "physicalDB", AFFIX_NAMES::physicalDB },
-        { "dendroDB", AFFIX_NAMES::dendroDB },
+    template <>
+    struct NameTable<AFFIX_NAMES> {
+        static constexpr const auto& NAMES = AFFIX_NAME_STRINGS;
+        static constexpr auto HASH = build_name_hash(AFFIX_NAME_STRINGS);
     };
-    // source https://genshin-impact.fandom.com/wiki/Artifacts/Distribution
-    const std::vector<std::pair<int, int>> INITIAL_AFFIX_NUM_WEIGHT = { {3, 4}, {4, 1} };
+
+    // name of enum, empty for start and end
+    template <class T>
+    constexpr std::string_view name_of(T type) {
+        return NameTable<T>::NAMES[static_cast<int>(type)];
+    }
+    constexpr std::string_view set_name(SET_NAMES set) {
+        return name_of(set);
+    }
+    constexpr std::string_view affix_name(AFFIX_NAMES affix) {
+        return name_of(affix);
+    }
+
+    // find enum of name, return false if not found
+    template <class T>
+    constexpr bool parse_name(std::string_view str, T& res) {
+        auto i = NameTable<T>::HASH.find(str, NameTable<T>::NAMES);
+        if (!i) return false;
+        res = static_cast<T>(i);
+        return true;
+    }
+    static_assert(NameTable<AFFIX_NAMES>::HASH.find("physicalDB", AFFIX_NAME_STRINGS) == static_cast<int>(AFFIX_NAMES::physicalDB), "affix name hash wrong");
+
+    template <class T>
+    std::unordered_map<std::string, T> names_to_map() {
+        const auto& names = NameTable<T>::NAMES;
+        std::unordered_map<std::string, T> res;
+        for (size_t i = 1; i + 1 < std::size(names); i++)
+            res[std::string(names[i])] = static_cast<T>(i);
+        return res;
+    }
+
+    const std::unordered_map<std::string, SET_NAMES> string_to_set_names = names_to_map<SET_NAMES>();
+    const std::unordered_map<std::string, AFFIX_NAMES> string_to_affix_names = names_to_map<AFFIX_NAMES>();
+    const std::vector<std::pair<int, int>>& INITIAL_AFFIX_NUM_WEIGHT = RULES_5STAR::INITIAL_AFFIX_NUM_WEIGHT;
     // sub will not same as main, and other subs has its choose weight. when new sub is generated, choose valid one based on weight of all valid subs.
-    const std::vector<std::pair<AFFIX_NAMES, int>> SUB_PROB_WEIGHT = {
+    constexpr std::pair<AFFIX_NAMES, int> SUB_PROB_WEIGHT_TABLE[] = {
         {AFFIX_NAMES::hp, 6},
         {AFFIX_NAMES::atk, 6},
         {AFFIX_NAMES::def, 6},
@@ -86,58 +219,126 @@ namespace DATA {
         {AFFIX_NAMES::cr, 3},
         {AFFIX_NAMES::cd, 3},
     };
-    const std::unordered_map<SET_NAMES, std::unordered_map<AFFIX_NAMES, int>> MAIN_WEIGHT = {
-        {SET_NAMES::flower, {
-                {AFFIX_NAMES::hp, 1},
-            }
-        },
-        {SET_NAMES::plume, {
-                {AFFIX_NAMES::atk, 1},
-            }
-        },
-        {SET_NAMES::sands, {
-                {AFFIX_NAMES::hpp, 2668},
-                {AFFIX_NAMES::atkp, 2666},
-                {AFFIX_NAMES::defp, 2666},
-                {AFFIX_NAMES::em, 1000},
-                {AFFIX_NAMES::er, 1000},
-            }
-        },
-        {SET_NAMES::goblet, {
-                {AFFIX_NAMES::hpp, 19175},
-                {AFFIX_NAMES::atkp, 19175},
-                {AFFIX_NAMES::defp, 19150},
-                {AFFIX_NAMES::em, 2500},
-                {AFFIX_NAMES::pyroDB, 5000},
-                {AFFIX_NAMES::hydroDB, 5000},
-                {AFFIX_NAMES::electroDB, 5000},
-                {AFFIX_NAMES::anemoDB, 5000},
-                {AFFIX_NAMES::cryoDB, 5000},
-                {AFFIX_NAMES::geoDB, 5000},
-                {AFFIX_NAMES::physicalDB, 5000},
-                {AFFIX_NAMES::dendroDB, 5000},
-            }
-        },
-        {SET_NAMES::circlet, {
-                {AFFIX_NAMES::hpp, 22},
-                {AFFIX_NAMES::atkp, 22},
-                {AFFIX_NAMES::defp, 22},
-                {AFFIX_NAMES::em, 4},
-                {AFFIX_NAMES::cr, 10},
-                {AFFIX_NAMES::cd, 10},
-                {AFFIX_NAMES::hb, 10},
-            }
-        },
+    const std::vector<std::pair<AFFIX_NAMES, int>> SUB_PROB_WEIGHT(std::begin(SUB_PROB_WEIGHT_TABLE), std::end(SUB_PROB_WEIGHT_TABLE));
+
+    // main weight of every set, rows of one set are contiguous.
+    struct MainWeight {
+        SET_NAMES set;
+        AFFIX_NAMES main;
+        int weight;
+    };
+    constexpr MainWeight MAIN_WEIGHT_TABLE[] = {
+        {SET_NAMES::flower, AFFIX_NAMES::hp, 1},
+
+        {SET_NAMES::plume, AFFIX_NAMES::atk, 1},
+
+        {SET_NAMES::sands, AFFIX_NAMES::hpp, 2668},
+        {SET_NAMES::sands, AFFIX_NAMES::atkp, 2666},
+        {SET_NAMES::sands, AFFIX_NAMES::defp, 2666},
+        {SET_NAMES::sands, AFFIX_NAMES::em, 1000},
+        {SET_NAMES::sands, AFFIX_NAMES::er, 1000},
+
+        {SET_NAMES::goblet, AFFIX_NAMES::hpp, 19175},
+        {SET_NAMES::goblet, AFFIX_NAMES::atkp, 19175},
+        {SET_NAMES::goblet, AFFIX_NAMES::defp, 19150},
+        {SET_NAMES::goblet, AFFIX_NAMES::em, 2500},
+        {SET_NAMES::goblet, AFFIX_NAMES::pyroDB, 5000},
+        {SET_NAMES::goblet, AFFIX_NAMES::hydroDB, 5000},
+        {SET_NAMES::goblet, AFFIX_NAMES::electroDB, 5000},
+        {SET_NAMES::goblet, AFFIX_NAMES::anemoDB, 5000},
+        {SET_NAMES::goblet, AFFIX_NAMES::cryoDB, 5000},
+        {SET_NAMES::goblet, AFFIX_NAMES::geoDB, 5000},
+        {SET_NAMES::goblet, AFFIX_NAMES::physicalDB, 5000},
+        {SET_NAMES::goblet, AFFIX_NAMES::dendroDB, 5000},
+
+        {SET_NAMES::circlet, AFFIX_NAMES::hpp, 22},
+        {SET_NAMES::circlet, AFFIX_NAMES::atkp, 22},
+        {SET_NAMES::circlet, AFFIX_NAMES::defp, 22},
+        {SET_NAMES::circlet, AFFIX_NAMES::em, 4},
+        {SET_NAMES::circlet, AFFIX_NAMES::cr, 10},
+        {SET_NAMES::circlet, AFFIX_NAMES::cd, 10},
+        {SET_NAMES::circlet, AFFIX_NAMES::hb, 10},
+    };
+    const int SET_END = static_cast<int>(SET_NAMES::end), AFFIX_END = static_cast<int>(AFFIX_NAMES::end);
+
+    // main weight indexed by set and main, 0 if not a main of set
+    constexpr auto MAIN_WEIGHT = [] {
+        std::array<std::array<int, AFFIX_END + 1>, SET_END + 1> res{};
+        for (auto& row : MAIN_WEIGHT_TABLE)
+            res[static_cast<int>(row.set)][static_cast<int>(row.main)] = row.weight;
+        return res;
+    }();
+    // main weight sum of every set
+    constexpr auto MAIN_WEIGHT_SUM = [] {
+        std::array<int, SET_END + 1> res{};
+        for (auto& row : MAIN_WEIGHT_TABLE)
+            res[static_cast<int>(row.set)] += row.weight;
+        return res;
+    }();
+    // sub weight indexed by affix, 0 if not a sub
+    constexpr auto SUB_WEIGHT = [] {
+        std::array<int, AFFIX_END + 1> res{};
+        for (auto& [affix, weight] : SUB_PROB_WEIGHT_TABLE)
+            res[static_cast<int>(affix)] = weight;
+        return res;
+    }();
+
+    constexpr int SUB_TYPES = static_cast<int>(std::size(SUB_PROB_WEIGHT_TABLE));
+    // bit of affix in used sub mask, which is its index in SUB_PROB_WEIGHT_TABLE.
+    // 0 if not a sub.
+    constexpr auto SUB_BIT = [] {
+        std::array<int, AFFIX_END + 1> res{};
+        for (int i = 0; i < SUB_TYPES; i++)
+            res[static_cast<int>(SUB_PROB_WEIGHT_TABLE[i].first)] = 1 << i;
+        return res;
+    }();
+
+    // weights of subs not in a used mask, accumulated in SUB_PROB_WEIGHT_TABLE order
+    struct SubCumulative {
+        uint8_t weight[SUB_TYPES];
+
+        int sum() const {
+            return weight[SUB_TYPES - 1];
+        }
+        // weight of sub index i, 0 if used
+        int at(int i) const {
+            return weight[i] - (i ? weight[i - 1] : 0);
+        }
+        // sub whose weight range contains r, r in 0~sum()-1
+        AFFIX_NAMES pick(int r) const {
+            int i = 0;
+            while (weight[i] <= r) i++;
+            return SUB_PROB_WEIGHT_TABLE[i].first;
+        }
     };
+    // main excludes a sub same as a used one, so it is folded into the mask
+    // and one row per mask covers every main.
+    constexpr auto SUB_CUMULATIVE = [] {
+        std::array<SubCumulative, 1 << SUB_TYPES> res{};
+        for (int mask = 0; mask < (1 << SUB_TYPES); mask++)
+            for (int i = 0, sum = 0; i < SUB_TYPES; i++) {
+                if (!(mask >> i & 1)) sum += SUB_PROB_WEIGHT_TABLE[i].second;
+                res[mask].weight[i] = sum;
+            }
+        return res;
+    }();
+    static_assert(SUB_TYPES <= 16, "too many sub types for mask table");
+
+    // sub distribution after main and used subs, used is mask of SUB_BIT
+    inline const SubCumulative& sub_cumulative(AFFIX_NAMES main, int used) {
+        return SUB_CUMULATIVE[used | SUB_BIT[static_cast<int>(main)]];
+    }
 
+    // map is only for type deduction of old callers, name comes from NameTable
     template<class T>
-    std::string type_to_string(std::unordered_map<std::string, T> map, T type) {
-        for (auto& [i, j] : map)
-            if (j == type)
-                return i;
-        throw std::runtime_error("type_to_string: not found");
+    std::string type_to_string(const std::unordered_map<std::string, T>&, T type) {
+        auto name = name_of(type);
+        if (name.empty())
+            throw std::runtime_error("type_to_string: not found");
+        return std::string(name);
     }
 
+
     struct Artifact {
         SET_NAMES set;
         AFFIX_NAMES main;
@@ -151,48 +352,233 @@ namespace DATA {
             const std::vector<std::pair<AFFIX_NAMES, int>>& sub, int level) :
             set(set), main(main), sub(sub), level(level) {}
 
-        // construct with string output by to_string
-        Artifact(const std::string& art_str) {
-            std::string s = art_str;
-            for (auto& i : s)
-                if (i == '|')
-                    i = ' ';
-            std::istringstream sin(s);
-            std::string set_name, set_data, lv_name, main_name, main_data, sub_name;
-            int lv_data;
-            sin >> set_name >> set_data >> lv_name >> lv_data >> main_name >> main_data >> sub_name;
-            if (set_name != "SET" || lv_name != "LV" || main_name != "MAIN" || sub_name != "SUB")
-                throw std::runtime_error("wrong format: " + art_str);
-            set = string_to_set_names.find(set_data)->second;
-            level = lv_data;
-            main = string_to_affix_names.find(main_data)->second;
-            while (1) {
-                std::string sub_data = "";
-                sin >> sub_data;
-                if (!sub_data.size()) break;
-                auto comma_pos = sub_data.find(",");
-                auto sub_affix = string_to_affix_names.find(sub_data.substr(comma_pos + 1))->second;
-                auto sub_value = std::stoi(sub_data.substr(0, comma_pos));
-                sub.push_back({ sub_affix, sub_value });
-            }
-        }
+        // construct with string output by to_string, throw if malformed
+        Artifact(const std::string& art_str);
 
-        std::string to_string() {
+        std::string to_string() const {
             std::string substr = "";
             for (auto& [name, weight] : sub) {
                 if (substr.size()) substr += "|";
-                substr += format("{:-2d},{:4s}", weight, type_to_string(string_to_affix_names, name));
+                substr += format("{:-2d},{:4s}", weight, affix_name(name));
             }
             if (sub.size() < AFFIX_NUM) substr += "|";
             return format("SET {:7s}|LV {}|MAIN {:10s}|SUB {}",
-                type_to_string(string_to_set_names, set),
+                set_name(set),
                 level,
-                type_to_string(string_to_affix_names, main),
+                affix_name(main),
                 substr
             );
         }
     };
 
+    // artifact packed in 64 bits, so copying it never allocates. from low bits:
+    // set 3, main 5, level 3, sub number 3, sub types 4 * 5, sub weights 4 * 6.
+    struct PackedArtifact {
+        static const int MAX_SUB = 4;
+        static const int SUB_TYPE_OFFSET = 14, SUB_TYPE_BITS = 5;
+        static const int SUB_WEIGHT_OFFSET = SUB_TYPE_OFFSET + MAX_SUB * SUB_TYPE_BITS, SUB_WEIGHT_BITS = 6;
+        uint64_t code = 0;
+
+        PackedArtifact() = default;
+        explicit PackedArtifact(const Artifact& art) {
+            if (art.sub.size() > MAX_SUB)
+                throw std::runtime_error("too many subs to pack");
+            put(0, 3, static_cast<int>(art.set));
+            put(3, 5, static_cast<int>(art.main));
+            set_level(art.level);
+            for (auto& [t, w] : art.sub)
+                push_sub(t, w);
+        }
+
+        int get(int offset, int bits) const {
+            return static_cast<int>(code >> offset & ((1ull << bits) - 1));
+        }
+        void put(int offset, int bits, int value) {
+            if (value < 0 || value >= (1 << bits))
+                throw std::runtime_error("value out of packed range");
+            code = (code & ~(((1ull << bits) - 1) << offset)) | static_cast<uint64_t>(value) << offset;
+        }
+
+        SET_NAMES set() const { return static_cast<SET_NAMES>(get(0, 3)); }
+        AFFIX_NAMES main() const { return static_cast<AFFIX_NAMES>(get(3, 5)); }
+        int level() const { return get(8, 3); }
+        int sub_number() const { return get(11, 3); }
+        AFFIX_NAMES sub_type(int i) const { return static_cast<AFFIX_NAMES>(get(SUB_TYPE_OFFSET + i * SUB_TYPE_BITS, SUB_TYPE_BITS)); }
+        int sub_weight(int i) const { return get(SUB_WEIGHT_OFFSET + i * SUB_WEIGHT_BITS, SUB_WEIGHT_BITS); }
+
+        void set_level(int level) { put(8, 3, level); }
+        void set_sub_weight(int i, int weight) { put(SUB_WEIGHT_OFFSET + i * SUB_WEIGHT_BITS, SUB_WEIGHT_BITS, weight); }
+        void push_sub(AFFIX_NAMES type, int weight) {
+            int i = sub_number();
+            if (i == MAX_SUB)
+                throw std::runtime_error("too many subs to pack");
+            put(SUB_TYPE_OFFSET + i * SUB_TYPE_BITS, SUB_TYPE_BITS, static_cast<int>(type));
+            set_sub_weight(i, weight);
+            put(11, 3, i + 1);
+        }
+        void pop_sub() {
+            int i = sub_number() - 1;
+            put(SUB_TYPE_OFFSET + i * SUB_TYPE_BITS, SUB_TYPE_BITS, 0);
+            set_sub_weight(i, 0);
+            put(11, 3, i);
+        }
+
+        Artifact to_artifact() const {
+            decltype(Artifact::sub) sub;
+            for (int i = 0; i < sub_number(); i++)
+                sub.push_back({ sub_type(i), sub_weight(i) });
+            return Artifact{ set(), main(), sub, level() };
+        }
+    };
+    static_assert(sizeof(PackedArtifact) == sizeof(uint64_t), "packed artifact is not 64 bits");
+
+    // parse one artifact in Artifact::to_string format without allocation.
+    // '|' and spaces are separators. return null if success, otherwise the
+    // reason, and art is undefined.
+    template <class R = RULES_5STAR>
+    const char* parse_artifact(std::string_view str, PackedArtifact& art) {
+        size_t p = 0;
+        auto next_token = [&]() {
+            while (p < str.size() && (str[p] == ' ' || str[p] == '|' || str[p] == '\t' || str[p] == '\r')) p++;
+            auto begin = p;
+            while (p < str.size() && str[p] != ' ' && str[p] != '|' && str[p] != '\t' && str[p] != '\r') p++;
+            return str.substr(begin, p - begin);
+        };
+        auto parse_int = [](std::string_view token, int& value) {
+            auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+            return ec == std::errc() && ptr == token.data() + token.size();
+        };
+        art = PackedArtifact();
+        SET_NAMES set;
+        AFFIX_NAMES main;
+        int level;
+        if (next_token() != "SET") return "SET not found";
+        if (!parse_name(next_token(), set)) return "unknown set";
+        if (next_token() != "LV") return "LV not found";
+        if (!parse_int(next_token(), level) || level < 0 || level > R::AFFIX_MAX_UPGRADE_TIME) return "wrong level";
+        if (next_token() != "MAIN") return "MAIN not found";
+        if (!parse_name(next_token(), main)) return "unknown main";
+        if (next_token() != "SUB") return "SUB not found";
+        art.put(0, 3, static_cast<int>(set));
+        art.put(3, 5, static_cast<int>(main));
+        art.set_level(level);
+        while (true) {
+            auto token = next_token();
+            if (token.empty()) break;
+            auto comma = token.find(',');
+            AFFIX_NAMES type;
+            int weight;
+            if (comma == std::string_view::npos) return "sub without comma";
+            if (!parse_int(token.substr(0, comma), weight) || weight < 0 || weight > R::AFFIX_UPDATE_MAX * (R::AFFIX_MAX_UPGRADE_TIME + 1))
+                return "wrong sub weight";
+            if (!parse_name(token.substr(comma + 1), type)) return "unknown sub";
+            if (art.sub_number() == std::min(R::AFFIX_NUM, PackedArtifact::MAX_SUB)) return "too many subs";
+            art.push_sub(type, weight);
+        }
+        return nullptr;
+    }
+
+    // largest length of format_artifact
+    const int ARTIFACT_STRING_SIZE = 128;
+
+    // write artifact in Artifact::to_string format into buf, which has at
+    // least ARTIFACT_STRING_SIZE chars. return length, no terminating zero.
+    template <class R = RULES_5STAR>
+    int format_artifact(const PackedArtifact& art, char* buf) {
+        int len = 0;
+        auto put = [&](std::string_view str, int width = 0) {
+            for (auto c : str) buf[len++] = c;
+            for (int i = str.size(); i < width; i++) buf[len++] = ' ';
+        };
+        auto put_int = [&](int value, int width = 0) {
+            char num[16];
+            auto end = std::to_chars(num, num + sizeof(num), value).ptr;
+            for (int i = end - num; i < width; i++) buf[len++] = ' ';
+            put(std::string_view(num, end - num));
+        };
+        put("SET ");
+        put(set_name(art.set()), 7);
+        put("|LV ");
+        put_int(art.level());
+        put("|MAIN ");
+        put(affix_name(art.main()), 10);
+        put("|SUB ");
+        for (int i = 0; i < art.sub_number(); i++) {
+            if (i) put("|");
+            put_int(art.sub_weight(i), 2);
+            put(",");
+            put(affix_name(art.sub_type(i)), 4);
+        }
+        if (art.sub_number() < R::AFFIX_NUM) put("|");
+        return len;
+    }
+
+    inline Artifact::Artifact(const std::string& art_str) {
+        PackedArtifact art;
+        if (auto reason = parse_artifact(art_str, art))
+            throw std::runtime_error(format("wrong format: {} ({})", art_str, reason));
+        *this = art.to_artifact();
+    }
+
+    // malformed line of parse_artifact_file, reason is a static string
+    struct ParseError {
+        size_t line; // 1-based
+        const char* reason;
+    };
+
+    // parse text of newline separated artifacts. empty lines are skipped,
+    // malformed ones are appended to errors. return parsed number.
+    template <class R = RULES_5STAR>
+    size_t parse_artifact_lines(std::string_view text, std::vector<PackedArtifact>& res, std::vector<ParseError>& errors) {
+        size_t count = 0, line = 0;
+        while (text.size()) {
+            auto end = text.find('\n');
+            auto str = text.substr(0, end);
+            text = end == std::string_view::npos ? std::string_view() : text.substr(end + 1);
+            line++;
+            if (str.find_first_not_of(" \t\r") == std::string_view::npos) continue;
+            PackedArtifact art;
+            if (auto reason = parse_artifact<R>(str, art))
+                errors.push_back({ line, reason });
+            else {
+                res.push_back(art);
+                count++;
+            }
+        }
+        return count;
+    }
+
+    // parse_artifact_lines on a whole file, which is mapped into memory
+    // instead of read line by line. return false if file can not be read.
+    template <class R = RULES_5STAR>
+    bool parse_artifact_file(const std::string& filename, std::vector<PackedArtifact>& res, std::vector<ParseError>& errors) {
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+        std::ifstream fin(filename, std::ios::binary);
+        if (!fin) return false;
+        std::string text((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+        parse_artifact_lines<R>(text, res, errors);
+#else
+        int fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat st;
+        if (fstat(fd, &st) < 0) {
+            close(fd);
+            return false;
+        }
+        if (st.st_size > 0) {
+            void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                close(fd);
+                return false;
+            }
+            parse_artifact_lines<R>(std::string_view(static_cast<const char*>(data), st.st_size), res, errors);
+            munmap(data, st.st_size);
+        }
+        close(fd);
+#endif
+        return true;
+    }
+
     std::random_device rd;
     std::mt19937 mt(rd());
     std::uniform_real_distribution<double> rand_real_dist(0, 1);
@@ -240,19 +626,31 @@ namespace DATA {
         return static_cast<SET_NAMES>(res + 1);
     }
 
-    auto get_main_distribution(const SET_NAMES set) {
-        const auto& main_weight = MAIN_WEIGHT.find(set)->second;
-        std::vector<std::pair<AFFIX_NAMES, int>> main_vec;
-        for (auto& elem : main_weight)
-            main_vec.push_back(elem);
-        return main_vec;
+    // mains of set with weights, in MAIN_WEIGHT_TABLE order. built once.
+    const std::vector<std::pair<AFFIX_NAMES, int>>& get_main_distribution(const SET_NAMES set) {
+        static const auto main_vecs = [] {
+            std::array<std::vector<std::pair<AFFIX_NAMES, int>>, SET_END + 1> res;
+            for (auto& row : MAIN_WEIGHT_TABLE)
+                res[static_cast<int>(row.set)].push_back({ row.main, row.weight });
+            return res;
+        }();
+        return main_vecs[static_cast<int>(set)];
+    }
+
+    // used sub mask of subs, to index sub_cumulative
+    inline int sub_mask(const std::vector<AFFIX_NAMES>& sub) {
+        int res = 0;
+        for (auto i : sub)
+            res |= SUB_BIT[static_cast<int>(i)];
+        return res;
     }
 
     auto get_sub_distribution(const AFFIX_NAMES main, const std::vector<AFFIX_NAMES>& sub) {
         std::vector<std::pair<AFFIX_NAMES, int>> sub_vec;
-        for (auto& [i, j] : SUB_PROB_WEIGHT)
-            if (i != main && std::find(sub.begin(), sub.end(), i) == sub.end())
-                sub_vec.push_back({ i, j });
+        auto& dist = sub_cumulative(main, sub_mask(sub));
+        for (int i = 0; i < SUB_TYPES; i++)
+            if (dist.at(i))
+                sub_vec.push_back({ SUB_PROB_WEIGHT_TABLE[i].first, dist.at(i) });
         return sub_vec;
     }
 
@@ -266,41 +664,47 @@ namespace DATA {
 
     // random one artifact. can specify some keys, and if find key conflict (e.g. set is flower but main is not hp),
     // will throw runtime error.
+    template <class R = RULES_5STAR>
     auto random_one_artifact(SET_NAMES set = SET_NAMES::end, AFFIX_NAMES main = AFFIX_NAMES::end, int initial = 0,
         std::vector<std::pair<AFFIX_NAMES, int>> sub = std::vector<std::pair<AFFIX_NAMES, int>>()) {
         if (set == SET_NAMES::end)
             set = get_random_set();
-        auto main_dist = get_main_distribution(set);
         if (main == AFFIX_NAMES::end)
-            main = weighted_rand(main_dist);
-        else
-            get_weight_from_distribution(main, main_dist); // if chosen main not in dist, throw error
+            main = weighted_rand(get_main_distribution(set));
+        else if (!MAIN_WEIGHT[static_cast<int>(set)][static_cast<int>(main)])
+            throw std::runtime_error("main not in set");
         std::vector<AFFIX_NAMES> sub_affix;
+        int used = 0;
         if (!initial)
-            initial = weighted_rand(INITIAL_AFFIX_NUM_WEIGHT);
+            initial = weighted_rand(R::INITIAL_AFFIX_NUM_WEIGHT);
         else
-            get_weight_from_distribution(initial, INITIAL_AFFIX_NUM_WEIGHT);
+            get_weight_from_distribution(initial, R::INITIAL_AFFIX_NUM_WEIGHT);
         if (sub.size() > initial)
             throw std::runtime_error("sub number too much");
         for (int i = 0; i < initial; i++) {
-            auto dist = get_sub_distribution(main, sub_affix);
+            auto& dist = sub_cumulative(main, used);
             if (i < sub.size()) {
+                auto bit = SUB_BIT[static_cast<int>(sub[i].first)];
+                if (!bit || (bit & (used | SUB_BIT[static_cast<int>(main)])))
+                    throw std::runtime_error("sub not valid");
                 sub_affix.push_back(sub[i].first);
-                get_weight_from_distribution(sub[i].first, dist);
-                if (AFFIX_UPDATE_MAX < sub[i].second || AFFIX_UPDATE_MIN > sub[i].second)
+                if (R::AFFIX_UPDATE_MAX < sub[i].second || R::AFFIX_UPDATE_MIN > sub[i].second)
                     throw std::runtime_error("affix weight wrong");
             }
             else
-                sub_affix.push_back(weighted_rand(dist));
+                sub_affix.push_back(dist.pick(randint(dist.sum())));
+            used |= SUB_BIT[static_cast<int>(sub_affix.back())];
         }
         for (int i = sub.size(); i < initial; i++)
-            sub.push_back({ sub_affix[i], randint(AFFIX_UPDATE_MAX - AFFIX_UPDATE_MIN + 1) + AFFIX_UPDATE_MIN });
+            sub.push_back({ sub_affix[i], randint(R::AFFIX_UPDATE_MAX - R::AFFIX_UPDATE_MIN + 1) + R::AFFIX_UPDATE_MIN });
         return Artifact{ set, main, sub, 0 };
     }
 
+    template <class R = RULES_5STAR>
     auto artifact_appear_rate(const Artifact& a, bool debug = false) {
-        if (!(a.level == 0 && (a.sub.size() == 3 || a.sub.size() == 4)))
+        if (a.level != 0)
             throw std::runtime_error("level not zero or sub number wrong");
+        get_weight_from_distribution(static_cast<int>(a.sub.size()), R::INITIAL_AFFIX_NUM_WEIGHT); // throw if sub number wrong
         double rate = 1, orate;
 
         // set rate
@@ -310,37 +714,80 @@ namespace DATA {
 
         // affix number rate
         orate = rate;
-        rate *= get_weight_from_distribution(static_cast<int>(a.sub.size()), INITIAL_AFFIX_NUM_WEIGHT);
-        rate /= weighted_sum(INITIAL_AFFIX_NUM_WEIGHT);
+        rate *= get_weight_from_distribution(static_cast<int>(a.sub.size()), R::INITIAL_AFFIX_NUM_WEIGHT);
+        rate /= weighted_sum(R::INITIAL_AFFIX_NUM_WEIGHT);
         if (debug) std::cout << format("{:.2f}|", rate / orate);
 
         // main rate
         orate = rate;
-        const auto main_dist = get_main_distribution(a.set);
-        rate *= get_weight_from_distribution(a.main, main_dist);
-        rate /= weighted_sum(main_dist);
+        auto main_weight = MAIN_WEIGHT[static_cast<int>(a.set)][static_cast<int>(a.main)];
+        if (!main_weight)
+            throw std::runtime_error("main not in set");
+        rate *= main_weight;
+        rate /= MAIN_WEIGHT_SUM[static_cast<int>(a.set)];
         if (debug) std::cout << format("{:15.4f}|SUB ", rate / orate);
 
         // sub rate
-        std::vector<AFFIX_NAMES> calculated_subs;
+        int used = 0;
         for (auto& [name, weight] : a.sub) {
-            auto dist = get_sub_distribution(a.main, calculated_subs);
+            auto& dist = sub_cumulative(a.main, used);
+            auto bit = SUB_BIT[static_cast<int>(name)];
+            if (!bit || (bit & (used | SUB_BIT[static_cast<int>(a.main)])))
+                throw std::runtime_error("sub not valid");
 
             // type rate
             orate = rate;
-            rate *= get_weight_from_distribution(name, dist);
-            rate /= weighted_sum(dist);
+            rate *= SUB_WEIGHT[static_cast<int>(name)];
+            rate /= dist.sum();
             if (debug) std::cout << format("{:7.4f}|", rate / orate);
 
             // weight rate
-            // rate /= AFFIX_UPDATE_MAX - AFFIX_UPDATE_MIN + 1;
+            // rate /= R::AFFIX_UPDATE_MAX - R::AFFIX_UPDATE_MIN + 1;
 
-            calculated_subs.push_back(name);
+            used |= bit;
         }
 
         return rate;
     }
 
+    // artifact_appear_rate of a whole inventory, res[i] is rate of arts[i].
+    // artifacts which can not drop get 0 instead of throwing. every pass runs
+    // over all artifacts with table lookups only, and operations are in same
+    // order as artifact_appear_rate, so results are bit identical.
+    template <class R = RULES_5STAR>
+    void artifact_appear_rate(const std::vector<PackedArtifact>& arts, std::vector<double>& res) {
+        std::array<int, PackedArtifact::MAX_SUB + 1> initial_weight{};
+        for (auto& [initial, weight] : R::INITIAL_AFFIX_NUM_WEIGHT)
+            if (initial <= PackedArtifact::MAX_SUB)
+                initial_weight[initial] = weight;
+        double initial_sum = weighted_sum(R::INITIAL_AFFIX_NUM_WEIGHT);
+        size_t number = arts.size();
+        res.resize(number);
+        thread_local std::vector<int> used;
+        used.resize(number);
+
+        // set, affix number and main rate
+        for (size_t i = 0; i < number; i++) {
+            auto& a = arts[i];
+            int set = static_cast<int>(a.set()), main = static_cast<int>(a.main());
+            double rate = 1.0 / SET_NUMBER * initial_weight[a.sub_number()] / initial_sum
+                * MAIN_WEIGHT[set][main] / MAIN_WEIGHT_SUM[set];
+            res[i] = a.level() ? 0 : rate;
+            used[i] = SUB_BIT[main];
+        }
+        // sub rate, one sub position per pass
+        for (int j = 0; j < R::AFFIX_NUM; j++)
+            for (size_t i = 0; i < number; i++) {
+                auto& a = arts[i];
+                if (j >= a.sub_number()) continue;
+                auto name = static_cast<int>(a.sub_type(j));
+                auto bit = SUB_BIT[name];
+                if (!bit || (bit & used[i])) res[i] = 0;
+                else res[i] = res[i] * SUB_WEIGHT[name] / SUB_CUMULATIVE[used[i]].sum();
+                used[i] |= bit;
+            }
+    }
+
     // count sub appear rate with randomization
     auto check_sub_appear_rate(int initial_sub_number = 4, int sim_time = 1000000, SET_NAMES set = SET_NAMES::end, AFFIX_NAMES main_affix = AFFIX_NAMES::end) {
         std::map<AFFIX_NAMES, int> m;
@@ -356,6 +803,8 @@ namespace DATA {
         return m;
     }
 
+    // every ordered sub sequence with its rate. catalog sums orders by
+    // subset_rates instead, this is reference of compare_catalog_generation.
     auto generate_all_possible_sub_orders(
         const int update_number, const AFFIX_NAMES main,
         std::vector<AFFIX_NAMES> current_sub = std::vector<AFFIX_NAMES>(), const double current_prob = 1) {
@@ -364,10 +813,12 @@ namespace DATA {
             res.push_back({ current_sub, current_prob });
             return res;
         }
-        auto subs = get_sub_distribution(main, current_sub);
-        auto sub_weight_sum = weighted_sum(subs);
-        for (auto& [sub, sub_weight] : subs) {
-            current_sub.push_back(sub);
+        auto& dist = sub_cumulative(main, sub_mask(current_sub));
+        auto sub_weight_sum = dist.sum();
+        for (int i = 0; i < SUB_TYPES; i++) {
+            auto sub_weight = dist.at(i);
+            if (!sub_weight) continue;
+            current_sub.push_back(SUB_PROB_WEIGHT_TABLE[i].first);
             for (auto& i : generate_all_possible_sub_orders(update_number - 1, main, current_sub, current_prob* sub_weight / sub_weight_sum)) {
                 res.push_back(std::move(i));
             }
@@ -376,102 +827,312 @@ namespace DATA {
         return res;
     }
 
-    std::vector<std::pair<Artifact, double>> all_artifacts_accumulated;
-    std::map<SET_NAMES, std::vector<std::pair<Artifact, double>>> all_artifacts_accumulated_divided_by_set;
-    bool ALL_ARTIFACTS_ACCUMULATED_DONE = false;
+    // accumulated catalog of one rules, filled by generate_all_artifacts_with_probs
+    template <class R>
+    struct ArtifactCatalog {
+        inline static std::vector<std::pair<PackedArtifact, double>> all_artifacts_accumulated;
+        inline static std::map<SET_NAMES, std::vector<std::pair<PackedArtifact, double>>> all_artifacts_accumulated_divided_by_set;
+        inline static std::once_flag DONE; // filled once even if first used by many threads
+    };
+
+    // number of ways choosing k from n
+    constexpr int combination(int n, int k) {
+        if (k < 0 || k > n) return 0;
+        int res = 1;
+        for (int i = 1; i <= k; i++)
+            res = res * (n - k + i) / i;
+        return res;
+    }
+
+    // index of ascending positions among all sets of same size, in colexicographic order
+    constexpr int subset_rank(const int* pos, int number) {
+        int res = 0;
+        for (int i = 0; i < number; i++)
+            res += combination(pos[i], i + 1);
+        return res;
+    }
+
+    // offset of sets of size number in subset_rates result. with number = max
+    // size + 1, it is the result size.
+    constexpr int subset_offset(int total, int number) {
+        int res = 0;
+        for (int i = 0; i < number; i++)
+            res += combination(total, i);
+        return res;
+    }
+
+    // next chosen positions of number in total in lexicographic order. return
+    // false after the last one.
+    constexpr bool next_combination(int* pos, int number, int total) {
+        int i = number - 1;
+        while (i >= 0 && pos[i] == total - number + i) i--;
+        if (i < 0) return false;
+        pos[i]++;
+        for (int j = i + 1; j < number; j++)
+            pos[j] = pos[j - 1] + 1;
+        return true;
+    }
+
+    // rate of every sub set being the first chosen subs, when subs are chosen
+    // one by one by weight without replacement. sets are expanded size by size
+    // up to max_number, and rate of set with ascending positions pos is
+    // rate[subset_offset(number, size) + subset_rank(pos, size)], which sums
+    // all its orders.
+    constexpr void subset_rates(const int* weight, int number, int max_number, double* rate) {
+        const int MAX_SUB = 32;
+        int weight_sum = 0;
+        for (int i = 0; i < number; i++)
+            weight_sum += weight[i];
+        for (int i = 0; i < subset_offset(number, max_number + 1); i++)
+            rate[i] = 0;
+        rate[0] = 1;
+        for (int size = 0; size < max_number; size++) {
+            int from = subset_offset(number, size), to = subset_offset(number, size + 1);
+            int pos[MAX_SUB] = {}, next[MAX_SUB] = {};
+            for (int i = 0; i < size; i++)
+                pos[i] = i;
+            do {
+                double current = rate[from + subset_rank(pos, size)];
+                int remain_sum = weight_sum;
+                for (int i = 0; i < size; i++)
+                    remain_sum -= weight[pos[i]];
+                // add every not chosen sub, keeping positions ascending
+                for (int add = 0, p = 0; add < number; add++) {
+                    if (p < size && pos[p] == add) {
+                        p++;
+                        continue;
+                    }
+                    for (int i = 0; i < p; i++)
+                        next[i] = pos[i];
+                    next[p] = add;
+                    for (int i = p; i < size; i++)
+                        next[i + 1] = pos[i];
+                    rate[to + subset_rank(next, size + 1)] += current * weight[add] / remain_sum;
+                }
+            } while (next_combination(pos, size, number));
+        }
+    }
 
     // Generate all possible artifacts and calculate their posibilities.
     // As sub weight is always uniform, sub weight of generated artifacts
     // will always be AFFIX_UPDATE_MIN. should generate weight manually.
-    // Sub affix will be sorted, but their order will affect its appear
-    // rate, so generate artifacts with no-order, and sort their subs,
-    // and combine same sub artifacts and their posibilities.
-    auto generate_all_artifacts_with_probs() {
-
-        if (ALL_ARTIFACTS_ACCUMULATED_DONE) return;
-
-        decltype(all_artifacts_accumulated) res;
-        auto initial_weight_sum = weighted_sum(INITIAL_AFFIX_NUM_WEIGHT);
+    // Sub order affects its appear rate but not the artifact, so rate of
+    // every sub set is summed over its orders by subset_rates, and sets are
+    // output in lexicographic order, same as sorted sub vectors.
+    // result is not accumulated.
+    template <class R = RULES_5STAR>
+    auto build_all_artifacts_with_probs() {
+        std::vector<std::pair<Artifact, double>> res;
+        auto initial_weight_sum = weighted_sum(R::INITIAL_AFFIX_NUM_WEIGHT);
+        int max_initial = 0;
+        for (auto& [initial, initial_weight] : R::INITIAL_AFFIX_NUM_WEIGHT)
+            max_initial = std::max(max_initial, initial);
 
         // generate all artifacts and its possibilities
         for (int setn = static_cast<int>(SET_NAMES::start) + 1; setn < static_cast<int>(SET_NAMES::end); setn++) {
             auto set = static_cast<SET_NAMES>(setn);
             auto set_count = SET_NUMBER;
-            auto main_dist = get_main_distribution(set);
-            auto main_weight_sum = weighted_sum(main_dist);
+            const auto& main_dist = get_main_distribution(set);
+            auto main_weight_sum = MAIN_WEIGHT_SUM[setn];
             for (auto& [main, main_weight] : main_dist) {
-                std::vector<AFFIX_NAMES> sub_affix;
-                for (auto& [initial, initial_weight] : INITIAL_AFFIX_NUM_WEIGHT) {
-                    auto possible_sub_orders = generate_all_possible_sub_orders(initial, main);
-                    decltype(possible_sub_orders) filtered_possible_sub_orders;
-                    // sort inner subs and sort all subs pairs
-                    for (auto& i : possible_sub_orders)
-                        std::sort(i.first.begin(), i.first.end());
-                    std::sort(possible_sub_orders.begin(), possible_sub_orders.end());
-
-                    // for (auto& [i, w] : possible_sub_orders) {
-                    //     for (auto& j : i)
-                    //         std::cout << static_cast<int>(j) << ' ';
-                    //     std::cout << w << '\n';
-                    // }
-
-                    // if sub same as last, add weight; otherwise push
-                    for (auto& [i, w] : possible_sub_orders) {
-                        if (filtered_possible_sub_orders.size() && std::equal(i.begin(), i.end(), filtered_possible_sub_orders.crbegin()->first.begin())) {
-                            filtered_possible_sub_orders.rbegin()->second += w;
-                        }
-                        else {
-                            filtered_possible_sub_orders.push_back({ i, w });
-                        }
-                    }
-
-                    for (auto& [sub_affix, sub_weight] : filtered_possible_sub_orders) {
+                auto sub_dist = get_sub_distribution(main, std::vector<AFFIX_NAMES>());
+                int sub_number = sub_dist.size();
+                std::vector<int> sub_weight;
+                for (auto& [sub, weight] : sub_dist)
+                    sub_weight.push_back(weight);
+                std::vector<double> rate(subset_offset(sub_number, max_initial + 1));
+                subset_rates(sub_weight.data(), sub_number, max_initial, rate.data());
+                for (auto& [initial, initial_weight] : R::INITIAL_AFFIX_NUM_WEIGHT) {
+                    std::vector<int> pos(initial);
+                    for (int i = 0; i < initial; i++)
+                        pos[i] = i;
+                    do {
                         decltype(Artifact::sub) sub;
-                        for (auto& sub_name : sub_affix)
-                            sub.push_back({ sub_name, AFFIX_UPDATE_MIN });
+                        for (auto i : pos)
+                            sub.push_back({ sub_dist[i].first, R::AFFIX_UPDATE_MIN });
                         auto art = Artifact{ set, main, sub, 0 };
-                        auto art_rate = 1.0 / set_count * main_weight / main_weight_sum * initial_weight / initial_weight_sum * sub_weight;
+                        auto sub_rate = rate[subset_offset(sub_number, initial) + subset_rank(pos.data(), initial)];
+                        auto art_rate = 1.0 / set_count * main_weight / main_weight_sum * initial_weight / initial_weight_sum * sub_rate;
                         res.push_back({ art, art_rate });
-                    }
+                    } while (next_combination(pos.data(), initial, sub_number));
                 }
             }
         }
-        for (int i = static_cast<int>(SET_NAMES::start) + 1; i < static_cast<int>(SET_NAMES::end); i++)
-            all_artifacts_accumulated_divided_by_set[static_cast<SET_NAMES>(i)] = std::vector<std::pair<Artifact, double>>();
-        for (auto i : res) {
-            auto set = i.first.set;
-            i.second *= SET_NUMBER; // probability in set equals to multiply set number
-            all_artifacts_accumulated_divided_by_set[set].push_back(std::move(i));
+        return res;
+    }
+
+    // one catalog artifact with fixed size subs, used by compile time catalog.
+    // subs are sorted and their weights are AFFIX_UPDATE_MIN.
+    template <class R>
+    struct CatalogEntry {
+        SET_NAMES set = SET_NAMES::start;
+        AFFIX_NAMES main = AFFIX_NAMES::start;
+        int sub_number = 0;
+        AFFIX_NAMES sub[R::AFFIX_NUM] = {};
+        double rate = 0; // rate in all artifacts
+        double accumulated = 0; // accumulated rate in all artifacts
+        double accumulated_in_set = 0; // accumulated rate in its set
+
+        Artifact to_artifact() const {
+            return to_packed().to_artifact();
+        }
+
+        PackedArtifact to_packed() const {
+            PackedArtifact res;
+            res.put(0, 3, static_cast<int>(set));
+            res.put(3, 5, static_cast<int>(main));
+            for (int i = 0; i < sub_number; i++)
+                res.push_sub(sub[i], R::AFFIX_UPDATE_MIN);
+            return res;
+        }
+    };
+
+    // same catalog as build_all_artifacts_with_probs, evaluated at compile time.
+    // it shares subset_rates, so rates are bit identical; mains follow
+    // MAIN_WEIGHT_TABLE order instead of unordered_map order.
+    template <class R>
+    struct EmbeddedCatalog {
+        static constexpr int RATE_SIZE = subset_offset(SUB_TYPES, R::AFFIX_NUM + 1);
+
+        static constexpr int initial_weight_sum() {
+            int res = 0;
+            for (auto& row : R::INITIAL_AFFIX_NUM_WEIGHT_TABLE)
+                res += row.second;
+            return res;
+        }
+
+        static constexpr int count() {
+            int res = 0;
+            for (auto& row : MAIN_WEIGHT_TABLE) {
+                int valid = 0;
+                for (auto& sub : SUB_PROB_WEIGHT_TABLE)
+                    if (sub.first != row.main) valid++;
+                for (auto& initial : R::INITIAL_AFFIX_NUM_WEIGHT_TABLE)
+                    res += combination(valid, initial.first);
+            }
+            return res;
         }
-        for (auto& [set, vec] : all_artifacts_accumulated_divided_by_set) {
-            for (int i = 1; i < vec.size(); i++)
-                vec[i].second += vec[i - 1].second;
+
+        static constexpr int SIZE = count();
+
+        static constexpr std::array<CatalogEntry<R>, SIZE> build() {
+            std::array<CatalogEntry<R>, SIZE> res{};
+            int max_initial = 0;
+            for (auto& row : R::INITIAL_AFFIX_NUM_WEIGHT_TABLE)
+                max_initial = std::max(max_initial, row.first);
+            int size = 0;
+            for (int setn = static_cast<int>(SET_NAMES::start) + 1; setn < static_cast<int>(SET_NAMES::end); setn++) {
+                auto set = static_cast<SET_NAMES>(setn);
+                int set_begin = size, set_weight_sum = MAIN_WEIGHT_SUM[setn];
+                for (auto& row : MAIN_WEIGHT_TABLE) {
+                    if (row.set != set) continue;
+                    AFFIX_NAMES valid[SUB_TYPES] = {};
+                    int valid_weight[SUB_TYPES] = {}, valid_number = 0;
+                    for (auto& sub : SUB_PROB_WEIGHT_TABLE)
+                        if (sub.first != row.main) {
+                            valid[valid_number] = sub.first;
+                            valid_weight[valid_number++] = sub.second;
+                        }
+                    double rate[RATE_SIZE] = {};
+                    subset_rates(valid_weight, valid_number, max_initial, rate);
+                    for (auto& [initial, initial_weight] : R::INITIAL_AFFIX_NUM_WEIGHT_TABLE) {
+                        int pos[R::AFFIX_NUM] = {};
+                        for (int i = 0; i < initial; i++)
+                            pos[i] = i;
+                        do {
+                            auto& entry = res[size++];
+                            entry.set = set;
+                            entry.main = row.main;
+                            entry.sub_number = initial;
+                            for (int i = 0; i < initial; i++)
+                                entry.sub[i] = valid[pos[i]];
+                            auto sub_rate = rate[subset_offset(valid_number, initial) + subset_rank(pos, initial)];
+                            entry.rate = 1.0 / SET_NUMBER * row.weight / set_weight_sum * initial_weight / initial_weight_sum() * sub_rate;
+                        } while (next_combination(pos, initial, valid_number));
+                    }
+                }
+                for (int i = set_begin; i < size; i++) {
+                    res[i].accumulated_in_set = res[i].rate * SET_NUMBER;
+                    if (i > set_begin) res[i].accumulated_in_set += res[i - 1].accumulated_in_set;
+                }
+            }
+            for (int i = 0; i < size; i++) {
+                res[i].accumulated = res[i].rate;
+                if (i) res[i].accumulated += res[i - 1].accumulated;
+            }
+            return res;
         }
-        for (int i = 1; i < res.size(); i++)
-            res[i].second += res[i - 1].second;
-        all_artifacts_accumulated = std::move(res);
-        ALL_ARTIFACTS_ACCUMULATED_DONE = true;
+
+        static constexpr std::array<CatalogEntry<R>, SIZE> TABLE = build();
+    };
+
+    // fill accumulated catalog, from embedded table or by runtime generation
+    template <class R = RULES_5STAR>
+    void generate_all_artifacts_with_probs() {
+        std::call_once(ArtifactCatalog<R>::DONE, [] {
+            auto& all_artifacts_accumulated = ArtifactCatalog<R>::all_artifacts_accumulated;
+            auto& all_artifacts_accumulated_divided_by_set = ArtifactCatalog<R>::all_artifacts_accumulated_divided_by_set;
+
+            for (int i = static_cast<int>(SET_NAMES::start) + 1; i < static_cast<int>(SET_NAMES::end); i++)
+                all_artifacts_accumulated_divided_by_set[static_cast<SET_NAMES>(i)] = std::vector<std::pair<PackedArtifact, double>>();
+#if EMBED_TABLES
+            all_artifacts_accumulated.reserve(EmbeddedCatalog<R>::SIZE);
+            for (auto& entry : EmbeddedCatalog<R>::TABLE) {
+                auto art = entry.to_packed();
+                all_artifacts_accumulated_divided_by_set[entry.set].push_back({ art, entry.accumulated_in_set });
+                all_artifacts_accumulated.push_back({ art, entry.accumulated });
+            }
+#else
+            std::vector<std::pair<PackedArtifact, double>> res;
+            for (auto& [art, rate] : build_all_artifacts_with_probs<R>())
+                res.push_back({ PackedArtifact(art), rate });
+            for (auto i : res) {
+                auto set = i.first.set();
+                i.second *= SET_NUMBER; // probability in set equals to multiply set number
+                all_artifacts_accumulated_divided_by_set[set].push_back(i);
+            }
+            for (auto& [set, vec] : all_artifacts_accumulated_divided_by_set) {
+                for (int i = 1; i < vec.size(); i++)
+                    vec[i].second += vec[i - 1].second;
+            }
+            for (int i = 1; i < res.size(); i++)
+                res[i].second += res[i - 1].second;
+            all_artifacts_accumulated = std::move(res);
+#endif
+        });
     }
 
-    // global variable is accumulated data, here return not accumulated data. 
+    // global variable is accumulated data, here return not accumulated data.
     // if set not specified(end), return all. otherwise only this set.
-    auto get_all_artifacts_with_probs(SET_NAMES set = SET_NAMES::end) {
-        generate_all_artifacts_with_probs();
-        std::vector<std::pair<Artifact, double>> res;
+    template <class R = RULES_5STAR>
+    auto get_all_packed_artifacts_with_probs(SET_NAMES set = SET_NAMES::end) {
+        generate_all_artifacts_with_probs<R>();
+        std::vector<std::pair<PackedArtifact, double>> res;
         if (set == SET_NAMES::end) {
-            res = all_artifacts_accumulated;
+            res = ArtifactCatalog<R>::all_artifacts_accumulated;
         }
         else {
-            res = all_artifacts_accumulated_divided_by_set[set];
+            res = ArtifactCatalog<R>::all_artifacts_accumulated_divided_by_set.at(set);
         }
         for (int i = res.size() - 1; i >= 1; i--)
             res[i].second -= res[i - 1].second;
         return res;
     }
 
+    // same as get_all_packed_artifacts_with_probs, unpacked
+    template <class R = RULES_5STAR>
+    auto get_all_artifacts_with_probs(SET_NAMES set = SET_NAMES::end) {
+        std::vector<std::pair<Artifact, double>> res;
+        for (auto& [art, rate] : get_all_packed_artifacts_with_probs<R>(set))
+            res.push_back({ art.to_artifact(), rate });
+        return res;
+    }
+
     // get random drop with all_artifacts_accumulated. random is double between 0 and 1.
-    auto get_drop(double randnum) {
-        generate_all_artifacts_with_probs();
+    template <class R = RULES_5STAR>
+    auto get_packed_drop(double randnum) {
+        generate_all_artifacts_with_probs<R>();
+        const auto& all_artifacts_accumulated = ArtifactCatalog<R>::all_artifacts_accumulated;
         // avoid border and accuracy problem
         if (randnum <= all_artifacts_accumulated.begin()->second)
             return all_artifacts_accumulated.begin()->first;
@@ -489,158 +1150,603 @@ namespace DATA {
         auto art = all_artifacts_accumulated[right].first;
         // scale randnum to 0-1, and decide affix based on its number
         randnum = (randnum - all_artifacts_accumulated[left].second) / (all_artifacts_accumulated[right].second - all_artifacts_accumulated[left].second);
-        auto update_way = AFFIX_UPDATE_MAX - AFFIX_UPDATE_MIN + 1;
-        for (auto& [t, w] : art.sub) {
+        auto update_way = R::AFFIX_UPDATE_MAX - R::AFFIX_UPDATE_MIN + 1;
+        for (int i = 0; i < art.sub_number(); i++) {
             randnum = randnum * update_way;
-            w = int(randnum);
+            int w = int(randnum);
             if (w >= update_way)
                 w = update_way - 1;
             randnum -= w;
-            w += AFFIX_UPDATE_MIN;
+            art.set_sub_weight(i, w + R::AFFIX_UPDATE_MIN);
         }
         return art;
     }
 
+    template <class R = RULES_5STAR>
+    auto get_drop(double randnum) {
+        return get_packed_drop<R>(randnum).to_artifact();
+    }
+
+    template <class R = RULES_5STAR>
     inline auto get_random_drop() {
-        return get_drop(rand());
+        return get_drop<R>(rand());
+    }
+
+    // write random drops with some malformed lines into filename, then compare
+    // to_string with format_artifact, and line by line parsing with
+    // parse_artifact_file. parsed artifacts should equal written ones.
+    void test_artifact_parser(int number = 200000, const std::string& filename = "artifact_parser_test.txt") {
+        const char* MALFORMED[] = {
+            "SET flower |LV 9|MAIN hp        |SUB  7,atk | 8,def |",
+            "SET flower |LV 0|MAIN hp        |SUB  7,atk | 8,xyz |",
+            "SET |LV 0|MAIN hp",
+        };
+        const int MALFORMED_EVERY = 10000;
+        std::vector<PackedArtifact> arts;
+        for (int i = 0; i < number; i++)
+            arts.push_back(get_packed_drop(rand()));
+
+        auto cc = clock();
+        std::string old_text;
+        for (auto& art : arts) {
+            old_text += art.to_artifact().to_string();
+            old_text += '\n';
+        }
+        auto to_string_time = clock() - cc;
+
+        cc = clock();
+        std::string text;
+        char buf[ARTIFACT_STRING_SIZE];
+        for (int i = 0; i < number; i++) {
+            text.append(buf, format_artifact(arts[i], buf));
+            text += '\n';
+            if (i % MALFORMED_EVERY == 0) {
+                text += MALFORMED[i / MALFORMED_EVERY % std::size(MALFORMED)];
+                text += '\n';
+            }
+        }
+        auto format_time = clock() - cc;
+        std::ofstream(filename, std::ios::binary) << text;
+
+        cc = clock();
+        std::ifstream fin(filename);
+        std::string line;
+        size_t stream_count = 0;
+        while (std::getline(fin, line)) {
+            try {
+                Artifact art(line);
+                stream_count++;
+            }
+            catch (std::runtime_error&) {}
+        }
+        auto stream_time = clock() - cc;
+
+        cc = clock();
+        std::vector<PackedArtifact> parsed;
+        std::vector<ParseError> errors;
+        if (!parse_artifact_file(filename, parsed, errors))
+            throw std::runtime_error("can not read " + filename);
+        auto bulk_time = clock() - cc;
+
+        if (parsed.size() != arts.size())
+            throw std::runtime_error("parsed artifact number differs");
+        for (int i = 0; i < number; i++) {
+            if (parsed[i].code != arts[i].code)
+                throw std::runtime_error(format("artifact {} differs after parsing", i));
+            if (std::string_view(buf, format_artifact(arts[i], buf)) != arts[i].to_artifact().to_string())
+                throw std::runtime_error(format("artifact {} formats differently", i));
+        }
+        std::cout << format("{} artifacts, to_string {:.3f}s format_artifact {:.3f}s, getline+Artifact {:.3f}s ({} parsed), parse_artifact_file {:.3f}s, {} malformed\n",
+            number, to_string_time * 1. / CLOCKS_PER_SEC, format_time * 1. / CLOCKS_PER_SEC,
+            stream_time * 1. / CLOCKS_PER_SEC, stream_count, bulk_time * 1. / CLOCKS_PER_SEC, errors.size());
+        for (int i = 0; i < errors.size() && i < 3; i++)
+            std::cout << format("    line {}: {}\n", errors[i].line, errors[i].reason);
+    }
+
+    // compare batched artifact_appear_rate with calling it one by one on
+    // random drops, every INVALID_EVERY one is upgraded so its rate is 0.
+    void test_appear_rate(int number = 200000) {
+        const int INVALID_EVERY = 100;
+        std::vector<PackedArtifact> arts;
+        for (int i = 0; i < number; i++) {
+            arts.push_back(get_packed_drop(rand()));
+            if (i % INVALID_EVERY == 0) arts.back().set_level(1);
+        }
+
+        auto cc = clock();
+        std::vector<double> single(number);
+        for (int i = 0; i < number; i++) {
+            try {
+                single[i] = artifact_appear_rate(arts[i].to_artifact());
+            }
+            catch (std::runtime_error&) {}
+        }
+        auto single_time = clock() - cc;
+
+        cc = clock();
+        std::vector<double> batch;
+        artifact_appear_rate(arts, batch);
+        auto batch_time = clock() - cc;
+
+        int diff = 0;
+        for (int i = 0; i < number; i++)
+            diff += single[i] != batch[i];
+        std::cout << format("{} artifacts, one by one {:.3f}s, batched {:.3f}s, {} differ\n",
+            number, single_time * 1. / CLOCKS_PER_SEC, batch_time * 1. / CLOCKS_PER_SEC, diff);
     }
 
 }
 
 namespace DP {
 
-    bool DEBUG = false; // if true, output debug message
-
     const int N = DATA::AFFIX_MAX_UPGRADE_TIME; // max dfs depth
     const int BASE = 64; // base of affix weight
 
-    // multiplier for weight, so can use int to approximate float
-    const int SCORE_MULTIPLIER = 1;
-
-    const double EPS = 1e-8;
+    enum class ENGINE_NAMES { start, calc, calc2, lazy, end };
+    const int ENGINE_NUMBER = static_cast<int>(ENGINE_NAMES::end) - static_cast<int>(ENGINE_NAMES::start) - 1;
+    const int BAR_BUCKETS = 7; // below 0, five buckets in [0, 1], above 1
+    const std::string ENGINE_PROFILE_FILE = "engine_profile.txt";
 
     typedef double dftype; // type used by dogfood
     typedef double stype; // type used by score
 
-    // dogfood consts
-    const int DOGFOOD_COST[] = { 16300, 28425, 42425, 66150, 117175 };
-    const int SUCCESS_DOGFOOD_COST = DOGFOOD_COST[0] + DOGFOOD_COST[1]
-        + DOGFOOD_COST[2] + DOGFOOD_COST[3] + DOGFOOD_COST[4];
-    const int FEED_DOGFOOD = 3780;
-    const int DOGFOOD_LOSS[] = {
-        FEED_DOGFOOD,
-        FEED_DOGFOOD - (DOGFOOD_COST[0]) / 5,
-        FEED_DOGFOOD - (DOGFOOD_COST[0] + DOGFOOD_COST[1]) / 5,
-        FEED_DOGFOOD - (DOGFOOD_COST[0] + DOGFOOD_COST[1] + DOGFOOD_COST[2]) / 5,
-        FEED_DOGFOOD - (DOGFOOD_COST[0] + DOGFOOD_COST[1] + DOGFOOD_COST[2] + DOGFOOD_COST[3]) / 5,
-        FEED_DOGFOOD - (DOGFOOD_COST[0] + DOGFOOD_COST[1] + DOGFOOD_COST[2] + DOGFOOD_COST[3] + DOGFOOD_COST[4]) / 5,
-    };
+    // configuration and cost model of one DP session. free functions use the
+    // engine bound to current thread by EngineScope, or default_engine(), so
+    // engines in different threads run isolated from each other. cell[] and
+    // catalog never change after their one time init and are shared.
+    struct Engine {
+        bool debug = false; // if true, output debug message
+        bool gain_prune = true; // if true, DP cuts states by expected gain bound
+        bool find_gain_debug = false; // if true, get_expected_dfcost and find_gain output progress
+        ENGINE_NAMES engine = ENGINE_NAMES::end; // if not end, calc_auto always uses this engine
+        // average time of every engine measured by calibrate_engines, indexed by
+        // upgrade time, non-zero score number, bar bucket. zero means not measured.
+        double engine_cost[N + 1][DATA::AFFIX_NUM + 1][BAR_BUCKETS][ENGINE_NUMBER] = {};
 
-    bool IS_INIT = false; // if initialized
-    std::map<int, int> m; // used in dfs
-    // first is cell status code, second is route count
-    std::vector<std::pair<unsigned int, int>> cell[N + 1];
+        // same as free functions of same name, run with this engine bound
+        template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+        std::tuple<bool, dftype, dftype, double, double> calc(const DATA::PackedArtifact& art,
+            const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype gain);
+        template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+        dftype get_expected_dfcost(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar,
+            const std::vector<std::pair<DATA::PackedArtifact, double>>& allart, dftype gain);
+        template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+        dftype find_gain(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost,
+            DATA::SET_NAMES set = DATA::SET_NAMES::end, dftype max_gain = 100000000, dftype gain_precision = 1);
+        void calibrate_engines(int samples = 5, bool output = false);
+        bool save_engine_profile(const std::string& filename = ENGINE_PROFILE_FILE);
+        bool load_engine_profile(const std::string& filename = ENGINE_PROFILE_FILE);
+    };
 
-    inline std::string status2str(int status) {
-        std::string res;
-        for (int i = DATA::AFFIX_NUM; i--; ) {
-            if (res.size()) res += "-";
-            res += format("{}", status % BASE);
-            status /= BASE;
-        }
+    // engine of free functions when no engine is bound
+    Engine& default_engine() {
+        static Engine res;
         return res;
     }
 
-    // dfs to find possible states
-    void dfs(int remain, std::vector<int>& current) {
-        if (remain) {
-            for (int i = 0; i < DATA::AFFIX_NUM; i++)
-                for (int j = DATA::AFFIX_UPDATE_MIN; j <= DATA::AFFIX_UPDATE_MAX; j++) {
-                    current[i] += j;
-                    dfs(remain - 1, current);
-                    current[i] -= j;
-                }
-        }
-        else {
-            int id = 0;
-            for (auto i : current)
-                id = id * BASE + i;
-            if (m.find(id) == m.end())
-                m[id] = 0;
-            m[id] ++;
-        }
+    thread_local Engine* BOUND_ENGINE = nullptr;
+
+    inline Engine& current_engine() {
+        return BOUND_ENGINE ? *BOUND_ENGINE : default_engine();
     }
 
-    // init states
-    void init() {
-        if (IS_INIT) return;
-        for (int n = 0; n <= N; n++) {
-            std::vector<int> start;
-            start.resize(DATA::AFFIX_NUM);
-            m.clear();
-            dfs(n, start);
-            for (auto& i : m)
-                cell[n].push_back(i);
+    // bind engine to current thread until end of scope, can be nested
+    class EngineScope {
+        Engine* old;
+    public:
+        explicit EngineScope(Engine& engine) : old(BOUND_ENGINE) {
+            BOUND_ENGINE = &engine;
         }
-        IS_INIT = true;
-    }
+        ~EngineScope() {
+            BOUND_ENGINE = old;
+        }
+        EngineScope(const EngineScope&) = delete;
+        EngineScope& operator=(const EngineScope&) = delete;
+    };
 
-    // no need to explicitly call it. if find 3 sub artifact, calc will call this
-    // function automatically. 
-    std::tuple<bool, dftype, dftype, double, double> calc_3(DATA::Artifact art,
-        const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype gain);
+    // options of default engine, kept for old callers
+    bool& DEBUG = default_engine().debug; // if true, output debug message
+    bool& GAIN_PRUNE = default_engine().gain_prune; // if true, DP cuts states by expected gain bound
+    bool& FIND_GAIN_DEBUG = default_engine().find_gain_debug;
+    ENGINE_NAMES& ENGINE = default_engine().engine; // if not end, calc_auto always uses this engine
 
-    /*
-    input: current weight w1 w2 w3 w4, affix score s1 s2 s3 s4, upgrade time N,
-           score bar S, gain G.
-           WARNING: it is recommended to call it with overload
-           (artifact, score_map, score_bar, gain), otherwise it can only deal with
-           4-sub artifacts.
+    // multiplier for weight, so can use int to approximate float. floating
+    // score types keep 1, integer score types are fixed point of 3 decimals.
+    template <class S>
+    const int SCORE_MULTIPLIER = std::is_integral<S>::value ? 1000 : 1;
 
-    output: whether upgrade, expected gain, expected dogfood cost,
-            success rate in current policy, expected score gain when success.
-    */
-    auto calc(const std::vector<int>& weight, const std::vector<double>& score,
-        int upgrade_time, double score_bar, dftype gain) {
+    const double EPS = 1e-8;
 
-        init();
+    // convert score into score type S
+    template <class S>
+    inline S to_score(double score) {
+        if (std::is_integral<S>::value) return S(std::lround(score * SCORE_MULTIPLIER<S>));
+        return S(score * SCORE_MULTIPLIER<S>);
+    }
+
+    // value with derivatives of K parameters, for forward mode derivatives.
+    // comparisons only look at value.
+    template <int K>
+    struct Dual {
+        double v = 0;
+        std::array<double, K> d{};
+
+        Dual() = default;
+        Dual(double v) : v(v) {}
+
+        // parameter k with value v
+        static Dual variable(double v, int k) {
+            Dual res(v);
+            res.d[k] = 1;
+            return res;
+        }
+
+        Dual& operator+=(const Dual& o) {
+            v += o.v;
+            for (int k = 0; k < K; k++) d[k] += o.d[k];
+            return *this;
+        }
+        Dual& operator-=(const Dual& o) {
+            v -= o.v;
+            for (int k = 0; k < K; k++) d[k] -= o.d[k];
+            return *this;
+        }
+        Dual& operator*=(const Dual& o) {
+            for (int k = 0; k < K; k++) d[k] = d[k] * o.v + v * o.d[k];
+            v *= o.v;
+            return *this;
+        }
+        Dual& operator/=(const Dual& o) {
+            for (int k = 0; k < K; k++) d[k] = (d[k] * o.v - v * o.d[k]) / (o.v * o.v);
+            v /= o.v;
+            return *this;
+        }
+        friend Dual operator+(Dual a, const Dual& b) { return a += b; }
+        friend Dual operator-(Dual a, const Dual& b) { return a -= b; }
+        friend Dual operator*(Dual a, const Dual& b) { return a *= b; }
+        friend Dual operator/(Dual a, const Dual& b) { return a /= b; }
+        friend Dual operator-(Dual a) { return Dual() -= a; }
+        friend bool operator<(const Dual& a, const Dual& b) { return a.v < b.v; }
+        friend bool operator>(const Dual& a, const Dual& b) { return a.v > b.v; }
+    };
+
+    // dogfood consts and state cells of one rules
+    template <class R>
+    struct Rule {
+        static constexpr int N = R::AFFIX_MAX_UPGRADE_TIME; // max dfs depth
+        static_assert(R::AFFIX_UPDATE_MAX * N < BASE, "affix weight overflows status digit");
+
+        static constexpr int success_dogfood_cost() {
+            int res = 0;
+            for (int i = 0; i < N; i++)
+                res += R::DOGFOOD_COST[i];
+            return res;
+        }
+        static constexpr std::array<int, N + 1> dogfood_loss() {
+            std::array<int, N + 1> res = {};
+            int cost = 0;
+            for (int i = 0; i <= N; i++) {
+                res[i] = R::FEED_DOGFOOD - cost / 5;
+                if (i < N) cost += R::DOGFOOD_COST[i];
+            }
+            return res;
+        }
+
+        static constexpr int SUCCESS_DOGFOOD_COST = success_dogfood_cost();
+        // value of feeding artifact after i upgrades, which loses 1/5 of used dogfood
+        static constexpr std::array<int, N + 1> DOGFOOD_LOSS = dogfood_loss();
+
+        inline static std::once_flag INIT_FLAG; // cell is filled once, even if first used by many threads
+        // first is cell status code, second is route count
+        inline static std::vector<std::pair<unsigned int, int>> cell[N + 1];
+    };
+
+    // dogfood consts
+    const auto& DOGFOOD_COST = DATA::RULES_5STAR::DOGFOOD_COST;
+    const int SUCCESS_DOGFOOD_COST = Rule<DATA::RULES_5STAR>::SUCCESS_DOGFOOD_COST;
+    const int FEED_DOGFOOD = DATA::RULES_5STAR::FEED_DOGFOOD;
+    const auto& DOGFOOD_LOSS = Rule<DATA::RULES_5STAR>::DOGFOOD_LOSS;
+
+    // first is cell status code, second is route count
+    auto& cell = Rule<DATA::RULES_5STAR>::cell;
+
+    inline std::string status2str(int status) {
+        std::string res;
+        for (int i = DATA::AFFIX_NUM; i--; ) {
+            if (res.size()) res += "-";
+            res += format("{}", status % BASE);
+            status /= BASE;
+        }
+        return res;
+    }
+
+    // dfs to find possible states
+    template <class R>
+    void dfs(int remain, std::vector<int>& current, std::map<int, int>& m) {
+        if (remain) {
+            for (int i = 0; i < R::AFFIX_NUM; i++)
+                for (int j = R::AFFIX_UPDATE_MIN; j <= R::AFFIX_UPDATE_MAX; j++) {
+                    current[i] += j;
+                    dfs<R>(remain - 1, current, m);
+                    current[i] -= j;
+                }
+        }
+        else {
+            int id = 0;
+            for (auto i : current)
+                id = id * BASE + i;
+            if (m.find(id) == m.end())
+                m[id] = 0;
+            m[id] ++;
+        }
+    }
+
+    // build states of every upgrade time by dfs
+    template <class R>
+    void build_cell(std::vector<std::pair<unsigned int, int>>(&res)[Rule<R>::N + 1]) {
+        for (int n = 0; n <= Rule<R>::N; n++) {
+            std::vector<int> start;
+            start.resize(R::AFFIX_NUM);
+            std::map<int, int> m;
+            dfs<R>(n, start, m);
+            res[n].clear();
+            for (auto& i : m)
+                res[n].push_back(i);
+        }
+    }
+
+    // same states as build_cell, evaluated at compile time. after n upgrades,
+    // sub i is upgraded c_i times with sum c_i = n, and its weight is sum of
+    // c_i rolls. states are walked digit by digit in ascending status order,
+    // acc[r] counts routes of current digits with r upgrades left.
+    template <class R>
+    struct EmbeddedCell {
+        static constexpr int N = Rule<R>::N;
+        struct State {
+            unsigned int status = 0;
+            int count = 0;
+        };
+        // ways[c][w]: roll sequences of c upgrades with weight sum w
+        struct Counts {
+            long long ways[N + 1][BASE] = {};
+            long long binomial[N + 1][N + 1] = {};
+        };
+
+        static constexpr Counts counts() {
+            Counts res{};
+            res.ways[0][0] = 1;
+            for (int c = 1; c <= N; c++)
+                for (int w = 0; w < BASE; w++)
+                    for (int j = R::AFFIX_UPDATE_MIN; j <= R::AFFIX_UPDATE_MAX && j <= w; j++)
+                        res.ways[c][w] += res.ways[c - 1][w - j];
+            for (int i = 0; i <= N; i++) {
+                res.binomial[i][0] = 1;
+                for (int j = 1; j <= i; j++)
+                    res.binomial[i][j] = res.binomial[i - 1][j - 1] + (j < i ? res.binomial[i - 1][j] : 0);
+            }
+            return res;
+        }
+        static constexpr Counts COUNTS = counts();
+
+        // count states when out is null, otherwise also write them
+        static constexpr int walk(int pos, unsigned int status, const long long* acc, State* out, int size) {
+            int rmin = N + 1, rmax = -1;
+            for (int r = 0; r <= N; r++)
+                if (acc[r]) {
+                    if (rmin > N) rmin = r;
+                    rmax = r;
+                }
+            if (pos == R::AFFIX_NUM) {
+                if (out) out[size] = State{ status, static_cast<int>(acc[0]) };
+                return size + 1;
+            }
+            // last sub takes all upgrades left
+            bool last = pos == R::AFFIX_NUM - 1;
+            int wmin = last && rmin ? R::AFFIX_UPDATE_MIN * rmin : 0;
+            for (int w = wmin; w <= R::AFFIX_UPDATE_MAX * rmax; w++) {
+                if (w > 0 && w < R::AFFIX_UPDATE_MIN) w = R::AFFIX_UPDATE_MIN;
+                long long next[N + 1] = {};
+                bool any = false;
+                for (int r = rmin; r <= rmax; r++) {
+                    if (!acc[r]) continue;
+                    for (int c = last ? r : 0; c <= r; c++)
+                        if (COUNTS.ways[c][w]) {
+                            next[r - c] += acc[r] * COUNTS.binomial[r][c] * COUNTS.ways[c][w];
+                            any = true;
+                        }
+                }
+                if (any) size = walk(pos + 1, status * BASE + w, next, out, size);
+            }
+            return size;
+        }
+
+        static constexpr std::array<int, N + 2> begins() {
+            std::array<int, N + 2> res{};
+            for (int n = 0; n <= N; n++) {
+                long long acc[N + 1] = {};
+                acc[n] = 1;
+                res[n + 1] = res[n] + walk(0, 0, acc, nullptr, 0);
+            }
+            return res;
+        }
+
+        // states of n upgrades are TABLE[BEGIN[n], BEGIN[n + 1])
+        static constexpr std::array<int, N + 2> BEGIN = begins();
+
+        static constexpr std::array<State, BEGIN[N + 1]> build() {
+            std::array<State, BEGIN[N + 1]> res{};
+            for (int n = 0; n <= N; n++) {
+                long long acc[N + 1] = {};
+                acc[n] = 1;
+                walk(0, 0, acc, res.data() + BEGIN[n], 0);
+            }
+            return res;
+        }
+
+        static constexpr std::array<State, BEGIN[N + 1]> TABLE = build();
+    };
+
+    // init states
+    template <class R = DATA::RULES_5STAR>
+    void init() {
+        std::call_once(Rule<R>::INIT_FLAG, [] {
+#if EMBED_TABLES
+            using E = EmbeddedCell<R>;
+            for (int n = 0; n <= Rule<R>::N; n++) {
+                Rule<R>::cell[n].reserve(E::BEGIN[n + 1] - E::BEGIN[n]);
+                for (int i = E::BEGIN[n]; i < E::BEGIN[n + 1]; i++)
+                    Rule<R>::cell[n].push_back({ E::TABLE[i].status, E::TABLE[i].count });
+            }
+#else
+            build_cell<R>(Rule<R>::cell);
+#endif
+        });
+    }
+
+    // state counters of a DP engine, used to compare how many states each
+    // engine touches for the same query
+    struct CalcStats {
+        long long visited = 0; // states whose children are expanded
+        long long memo_hit = 0; // states answered by memo
+        long long pruned_fail = 0; // states fixed as fail by score bound
+        long long pruned_success = 0; // states fixed as success by score bound
+        long long pruned_gain = 0; // states cut by expected gain bound
+    };
+
+    // distribution of score increase after k random upgrades, sorted by score,
+    // with suffix probability. as upgrading until full maximizes success rate,
+    // it bounds success rate of any policy from a state.
+    template <class S>
+    struct IncreaseTail {
+        bool built = false;
+        std::vector<S> score; // ascending
+        std::vector<double> suffix; // suffix[j] = P(increase >= score[j])
+
+        // upper bound of P(increase >= need)
+        double at_least(double need) const {
+            auto p = std::lower_bound(score.begin(), score.end(), need - EPS) - score.begin();
+            return p == score.size() ? 0 : suffix[p];
+        }
+    };
+
+    // tails for k = 0..N of given scores, built on first use. get_expected_dfcost
+    // calls calc with same scores for every sub weight and gain, so cache recent
+    // ones per thread.
+    template <class S, class R>
+    std::vector<IncreaseTail<S>>& get_increase_tails(const std::vector<S>& SCORE) {
+        const int CACHE_SIZE = 64;
+        thread_local std::map<std::vector<S>, std::vector<IncreaseTail<S>>> cache;
+        auto ite = cache.find(SCORE);
+        if (ite != cache.end()) return ite->second;
+        if (cache.size() >= CACHE_SIZE) cache.clear();
+        auto& tails = cache[SCORE];
+        tails.resize(Rule<R>::N + 1);
+        return tails;
+    }
+
+    template <class S, class R>
+    const IncreaseTail<S>& build_increase_tail(IncreaseTail<S>& tail, const std::vector<S>& SCORE, int k) {
+        if (tail.built) return tail;
+        init<R>();
+        std::vector<std::pair<S, int>> dist;
+        int total = 0;
+        for (auto& [status, count] : Rule<R>::cell[k]) {
+            S res = 0;
+            for (int i = 0, j = status; i < R::AFFIX_NUM; i++) {
+                res += (j % BASE) * SCORE[i];
+                j /= BASE;
+            }
+            dist.push_back({ res, count });
+            total += count;
+        }
+        std::sort(dist.begin(), dist.end());
+        tail.score.resize(dist.size());
+        tail.suffix.resize(dist.size());
+        double sum = 0;
+        for (int j = dist.size(); j--; ) {
+            sum += dist[j].second;
+            tail.score[j] = dist[j].first;
+            tail.suffix[j] = sum / total;
+        }
+        tail.built = true;
+        return tail;
+    }
+
+    // tail used to prune states at level i, or null. a tail larger than the
+    // level costs more to build than it saves, so only cut in later levels.
+    template <class S, class R>
+    inline const IncreaseTail<S>* prune_tail(std::vector<IncreaseTail<S>>& tails, const std::vector<S>& SCORE,
+        int i, int upgrade_time) {
+        auto k = upgrade_time - i;
+        if (!current_engine().gain_prune || k <= 0 || Rule<R>::cell[k].size() > Rule<R>::cell[i].size()) return nullptr;
+        return &build_increase_tail<S, R>(tails[k], SCORE, k);
+    }
+
+    // branch and bound on expected gain. from a partial upgraded state at
+    // level i, any policy gets gain with rate at most tail, otherwise feeds
+    // at level i + 1 or later, which loses no less than DOGFOOD_LOSS[i + 1].
+    // if this bound can not beat DOGFOOD_LOSS[i], state is not upgraded.
+    template <class R, class V, class S>
+    inline bool gain_bound_prune(const IncreaseTail<S>* tail, double need, V gain, int level) {
+        if (!tail) return false;
+        V next_loss = Rule<R>::DOGFOOD_LOSS[level + 1];
+        V bound = next_loss + tail->at_least(need) * std::max<V>(0, gain - next_loss);
+        return bound < Rule<R>::DOGFOOD_LOSS[level] - EPS * std::max<V>(1, std::abs(gain));
+    }
+
+    // no need to explicitly call it. if find 3 sub artifact, calc will call this
+    // function automatically. 
+    std::tuple<bool, dftype, dftype, double, double> calc_3(DATA::Artifact art,
+        const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype gain);
+
+    // expected values of statuses in one calc. dp_map[i] holds statuses after
+    // i upgrades which are worth upgrading, value is count, score in current
+    // status, expected gain, expected dogfood cost, success rate, expected
+    // score gain when success. status not in it should be fed.
+    template <class S, class V>
+    using DPTable = std::vector<std::unordered_map<int, std::tuple<int, S, V, V, double, double>>>;
+
+    // bottom-up sweep of calc, every status of every level is filled into
+    // dp_map, so it answers all later decisions of same artifact.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    void calc_table(const std::vector<int>& weight, const std::vector<double>& score,
+        int upgrade_time, double score_bar, dftype gain, DPTable<S, V>& dp_map, CalcStats* stats = nullptr) {
 
-        if (weight.size() != DATA::AFFIX_NUM || score.size() != DATA::AFFIX_NUM)
-            throw std::runtime_error("w or s size not equal to DATA::AFFIX_NUM");
+        init<R>();
+        const bool debug = current_engine().debug;
+
+        if (weight.size() != R::AFFIX_NUM || score.size() != R::AFFIX_NUM)
+            throw std::runtime_error("w or s size not equal to AFFIX_NUM");
 
         // multiply scores
-        stype SCORE_BAR = score_bar * SCORE_MULTIPLIER;
-        std::vector<stype> SCORE;
+        S SCORE_BAR = to_score<S>(score_bar);
+        std::vector<S> SCORE;
         for (auto& i : score)
-            SCORE.push_back(i * SCORE_MULTIPLIER);
-        for (int i = 0; i < DATA::AFFIX_NUM; i++)
+            SCORE.push_back(to_score<S>(i));
+        for (int i = 0; i < R::AFFIX_NUM; i++)
             SCORE_BAR -= weight[i] * SCORE[i];
 
-        // status, count, score in current status, used to sort
-        std::vector<std::vector<std::tuple<int, int, stype>>> dp_cell;
-        // key status; value count, score in current status, 
-        // expected gain, expected dogfood cost, success rate, 
-        // expected score gain when success
-        std::vector<std::unordered_map<
-            int, std::tuple<int, stype, dftype, dftype, double, stype>>> dp_map;
-
-        dp_cell.resize(upgrade_time + 1);
+        dp_map.clear();
         dp_map.resize(upgrade_time + 1);
-        auto max_increase = *std::max_element(SCORE.begin(), SCORE.end()) * DATA::AFFIX_UPDATE_MAX;
-        auto current_upgrade = N - upgrade_time;
+        auto max_increase = *std::max_element(SCORE.begin(), SCORE.end()) * R::AFFIX_UPDATE_MAX;
+        auto current_upgrade = Rule<R>::N - upgrade_time;
+        auto& tails = get_increase_tails<S, R>(SCORE);
+        CalcStats local_stats;
+        if (!stats) stats = &local_stats;
         for (int i = upgrade_time; i >= 0; i--) {
             auto current_score_bar = SCORE_BAR - max_increase * (upgrade_time - i) - EPS;
-            if (DEBUG) std::cout << format("time {}, current score bar {}\n", i, current_score_bar);
+            auto tail = prune_tail<S, R>(tails, SCORE, i, upgrade_time);
+            if (debug) std::cout << format("time {}, current score bar {}\n", i, current_score_bar);
             int for_count = 0;
-            for (auto& [status, count] : cell[i]) {
-                stype status_score = 0;
-                for (int i = 0, j = status; i < DATA::AFFIX_NUM; i++) {
+            for (auto& [status, count] : Rule<R>::cell[i]) {
+                S status_score = 0;
+                for (int i = 0, j = status; i < R::AFFIX_NUM; i++) {
                     status_score += (j % BASE) * SCORE[i];
                     j /= BASE;
                 }
-                dftype e_gain = 0, e_df_cost = 0;
+                V e_gain = 0, e_df_cost = 0;
                 double success_rate = 0;
-                stype e_score_gain = 0;
+                double e_score_gain = 0;
                 for_count++;
                 if (i == upgrade_time) {
                     if (status_score < current_score_bar)
@@ -648,12 +1754,12 @@ namespace DP {
                     // full upgraded
                     success_rate = 1;
                     e_gain = gain;
-                    e_df_cost = SUCCESS_DOGFOOD_COST;
+                    e_df_cost = Rule<R>::SUCCESS_DOGFOOD_COST;
                     e_score_gain = status_score - SCORE_BAR;
 
-                    if (DEBUG)
+                    if (debug)
                         std::cout << format("DP {}: {} {} C:{} SS:{} EG:{} EDF:{} SR:{}, ESG:{}\n",
-                            i, status2str(status), e_gain > DOGFOOD_LOSS[current_upgrade + i] ? "SUCC" : "FAIL", count, status_score, e_gain, e_df_cost, success_rate, e_score_gain);
+                            i, status2str(status), e_gain > Rule<R>::DOGFOOD_LOSS[current_upgrade + i] ? "SUCC" : "FAIL", count, status_score, e_gain, e_df_cost, success_rate, e_score_gain);
 
                     dp_map[i][status] = {
                         count,
@@ -665,18 +1771,23 @@ namespace DP {
                     };
                 }
                 else {
+                    if (gain_bound_prune<R>(tail, SCORE_BAR - status_score, gain, current_upgrade + i)) {
+                        stats->pruned_gain++;
+                        continue;
+                    }
                     // partial upgraded, need DP
+                    stats->visited++;
                     auto current_base = 1;
-                    auto route_number = DATA::AFFIX_NUM * (1 + DATA::AFFIX_UPDATE_MAX
-                        - DATA::AFFIX_UPDATE_MIN);
-                    for (int a_idx = 0; a_idx < DATA::AFFIX_NUM; a_idx++) {
-                        for (int upd_w = DATA::AFFIX_UPDATE_MIN; upd_w <= DATA::AFFIX_UPDATE_MAX; upd_w++) {
+                    auto route_number = R::AFFIX_NUM * (1 + R::AFFIX_UPDATE_MAX
+                        - R::AFFIX_UPDATE_MIN);
+                    for (int a_idx = 0; a_idx < R::AFFIX_NUM; a_idx++) {
+                        for (int upd_w = R::AFFIX_UPDATE_MIN; upd_w <= R::AFFIX_UPDATE_MAX; upd_w++) {
                             auto new_status = status + upd_w * current_base;
                             auto target = dp_map[i + 1].find(new_status);
                             if (target == dp_map[i + 1].end()) {
                                 // not in map, default not needed
-                                e_gain += DOGFOOD_LOSS[current_upgrade + i + 1];
-                                e_df_cost -= DOGFOOD_LOSS[current_upgrade + i + 1];
+                                e_gain += Rule<R>::DOGFOOD_LOSS[current_upgrade + i + 1];
+                                e_df_cost -= Rule<R>::DOGFOOD_LOSS[current_upgrade + i + 1];
                             }
                             else {
                                 auto& [t_count, t_status_score, t_e_gain,
@@ -695,9 +1806,9 @@ namespace DP {
                     e_df_cost /= route_number;
                     success_rate /= route_number;
                     if (success_rate > 0) e_score_gain /= route_number * success_rate;
-                    if (DEBUG) std::cout << format("DP {}: {} {} C:{} SS:{} EG:{} EDF:{} SR:{}, ESG:{}\n",
-                        i, status2str(status), e_gain > DOGFOOD_LOSS[current_upgrade + i] ? "SUCC" : "FAIL", count, status_score, e_gain, e_df_cost, success_rate, e_score_gain);
-                    if (e_gain > DOGFOOD_LOSS[current_upgrade + i])
+                    if (debug) std::cout << format("DP {}: {} {} C:{} SS:{} EG:{} EDF:{} SR:{}, ESG:{}\n",
+                        i, status2str(status), e_gain > Rule<R>::DOGFOOD_LOSS[current_upgrade + i] ? "SUCC" : "FAIL", count, status_score, e_gain, e_df_cost, success_rate, e_score_gain);
+                    if (e_gain > Rule<R>::DOGFOOD_LOSS[current_upgrade + i])
                         dp_map[i][status] = {
                             count,
                             status_score,
@@ -709,30 +1820,44 @@ namespace DP {
                 }
             }
         }
-        if (dp_map[0].find(0) == dp_map[0].end()) {
-            dftype gain = DOGFOOD_LOSS[current_upgrade];
-            dftype df_cost = -gain;
-            double s_rate = 0;
-            stype score_gain = 0;
-            return std::make_tuple(
-                false,
-                gain,
-                df_cost,
-                s_rate,
-                score_gain * 1. / SCORE_MULTIPLIER
-            );
+    }
+
+    // calc result of status after i upgrades in dp_map, level is artifact level of status
+    template <class V, class S, class R>
+    std::tuple<bool, dftype, dftype, double, double> table_result(const DPTable<S, V>& dp_map, int i, int status, int level) {
+        auto ite = dp_map[i].find(status);
+        if (ite == dp_map[i].end()) {
+            V gain = Rule<R>::DOGFOOD_LOSS[level];
+            return std::make_tuple(false, gain, -gain, 0., 0.);
         }
-        auto& [count, status_score, e_gain, e_df_cost, success_rate,
-            e_score_gain] = dp_map[0][0];
+        auto& [count, status_score, e_gain, e_df_cost, success_rate, e_score_gain] = ite->second;
         return std::make_tuple(
             true,
             e_gain,
             e_df_cost,
             success_rate,
-            e_score_gain * 1. / SCORE_MULTIPLIER
+            e_score_gain * 1. / SCORE_MULTIPLIER<S>
         );
     }
 
+    /*
+    input: current weight w1 w2 w3 w4, affix score s1 s2 s3 s4, upgrade time N,
+           score bar S, gain G.
+           WARNING: it is recommended to call it with overload
+           (artifact, score_map, score_bar, gain), otherwise it can only deal with
+           4-sub artifacts.
+
+    output: whether upgrade, expected gain, expected dogfood cost,
+            success rate in current policy, expected score gain when success.
+    */
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    std::tuple<bool, dftype, dftype, double, double> calc(const std::vector<int>& weight, const std::vector<double>& score,
+        int upgrade_time, double score_bar, dftype gain, CalcStats* stats = nullptr) {
+        DPTable<S, V> dp_map;
+        calc_table<V, S, R>(weight, score, upgrade_time, score_bar, gain, dp_map, stats);
+        return table_result<V, S, R>(dp_map, 0, 0, Rule<R>::N - upgrade_time);
+    }
+
     /*
 
     deprecated version of calc, runs slower than current version
@@ -746,42 +1871,47 @@ namespace DP {
     output: whether upgrade, expected gain, expected dogfood cost,
             success rate in current policy, expected score gain when success.
     */
-    auto calc2(const std::vector<int>& weight, const std::vector<double>& score,
-        int upgrade_time, double score_bar, dftype gain) {
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    std::tuple<bool, dftype, dftype, double, double> calc2(const std::vector<int>& weight, const std::vector<double>& score,
+        int upgrade_time, double score_bar, dftype gain, CalcStats* stats = nullptr) {
 
-        init();
+        init<R>();
+        const bool debug = current_engine().debug;
 
-        if (weight.size() != DATA::AFFIX_NUM || score.size() != DATA::AFFIX_NUM)
-            throw std::runtime_error("w or s size not equal to DATA::AFFIX_NUM");
+        if (weight.size() != R::AFFIX_NUM || score.size() != R::AFFIX_NUM)
+            throw std::runtime_error("w or s size not equal to AFFIX_NUM");
 
         // multiply scores
-        stype SCORE_BAR = score_bar * SCORE_MULTIPLIER;
-        std::vector<stype> SCORE;
+        S SCORE_BAR = to_score<S>(score_bar);
+        std::vector<S> SCORE;
         for (auto& i : score)
-            SCORE.push_back(i * SCORE_MULTIPLIER);
-        for (int i = 0; i < DATA::AFFIX_NUM; i++)
+            SCORE.push_back(to_score<S>(i));
+        for (int i = 0; i < R::AFFIX_NUM; i++)
             SCORE_BAR -= weight[i] * SCORE[i];
 
         // status, count, score in current status, used to sort
-        std::vector<std::vector<std::tuple<int, int, stype>>> dp_cell;
+        std::vector<std::vector<std::tuple<int, int, S>>> dp_cell;
         // key status; value count, score in current status, 
         // expected gain, expected dogfood cost, success rate, 
         // expected score gain when success
         std::vector<std::unordered_map<
-            int, std::tuple<int, stype, dftype, dftype, double, stype>>> dp_map;
+            int, std::tuple<int, S, V, V, double, double>>> dp_map;
 
         dp_cell.resize(upgrade_time + 1);
         dp_map.resize(upgrade_time + 1);
-        auto max_increase = *std::max_element(SCORE.begin(), SCORE.end()) * DATA::AFFIX_UPDATE_MAX;
-        auto current_upgrade = N - upgrade_time;
+        auto max_increase = *std::max_element(SCORE.begin(), SCORE.end()) * R::AFFIX_UPDATE_MAX;
+        auto current_upgrade = Rule<R>::N - upgrade_time;
+        auto& tails = get_increase_tails<S, R>(SCORE);
+        CalcStats local_stats;
+        if (!stats) stats = &local_stats;
         for (int i = upgrade_time; i >= 0; i--) {
-            for (auto& [status, count] : cell[i])
+            for (auto& [status, count] : Rule<R>::cell[i])
                 dp_cell[i].push_back({
                     status,
                     count,
                     [SCORE](auto status) {
-                        stype res = 0;
-                        for (int i = 0; i < DATA::AFFIX_NUM; i++) {
+                        S res = 0;
+                        for (int i = 0; i < R::AFFIX_NUM; i++) {
                             res += (status % BASE) * SCORE[i];
                             status /= BASE;
                         }
@@ -795,26 +1925,27 @@ namespace DP {
                 }
             );
             auto current_score_bar = SCORE_BAR - max_increase * (upgrade_time - i) - EPS;
-            if (DEBUG) std::cout << format("time {}, current score bar {:.2f}\n", i, current_score_bar);
+            auto tail = prune_tail<S, R>(tails, SCORE, i, upgrade_time);
+            if (debug) std::cout << format("time {}, current score bar {:.2f}\n", i, current_score_bar);
             int for_count = 0;
             for (auto& [status, count, status_score] : dp_cell[i]) {
-                dftype e_gain = 0, e_df_cost = 0;
+                V e_gain = 0, e_df_cost = 0;
                 double success_rate = 0;
-                stype e_score_gain = 0;
+                double e_score_gain = 0;
                 for_count++;
                 if (status_score < current_score_bar) {
-                    if (DEBUG) std::cout << format("in upgrade time {}, early stop after {} elements, all is {}.\n", i, for_count, dp_cell[i].size(), status_score, current_score_bar);
+                    if (debug) std::cout << format("in upgrade time {}, early stop after {} elements, all is {}.\n", i, for_count, dp_cell[i].size(), status_score, current_score_bar);
                     break; // all below bar, no need to calc
                 }
                 if (i == upgrade_time) {
                     // full upgraded
                     success_rate = 1;
                     e_gain = gain;
-                    e_df_cost = SUCCESS_DOGFOOD_COST;
+                    e_df_cost = Rule<R>::SUCCESS_DOGFOOD_COST;
                     e_score_gain = status_score - SCORE_BAR;
-                    if (DEBUG)
+                    if (debug)
                         std::cout << format("DP {}: {} {} C:{} SS:{} EG:{} EDF:{} SR:{}, ESG:{}\n",
-                            i, status2str(status), e_gain > DOGFOOD_LOSS[current_upgrade + i] ? "SUCC" : "FAIL", count, status_score, e_gain, e_df_cost, success_rate, e_score_gain);
+                            i, status2str(status), e_gain > Rule<R>::DOGFOOD_LOSS[current_upgrade + i] ? "SUCC" : "FAIL", count, status_score, e_gain, e_df_cost, success_rate, e_score_gain);
 
                     dp_map[i][status] = {
                         count,
@@ -826,18 +1957,23 @@ namespace DP {
                     };
                 }
                 else {
+                    if (gain_bound_prune<R>(tail, SCORE_BAR - status_score, gain, current_upgrade + i)) {
+                        stats->pruned_gain++;
+                        continue;
+                    }
                     // partial upgraded, need DP
+                    stats->visited++;
                     auto current_base = 1;
-                    auto route_number = DATA::AFFIX_NUM * (1 + DATA::AFFIX_UPDATE_MAX
-                        - DATA::AFFIX_UPDATE_MIN);
-                    for (int a_idx = 0; a_idx < DATA::AFFIX_NUM; a_idx++) {
-                        for (int upd_w = DATA::AFFIX_UPDATE_MIN; upd_w <= DATA::AFFIX_UPDATE_MAX; upd_w++) {
+                    auto route_number = R::AFFIX_NUM * (1 + R::AFFIX_UPDATE_MAX
+                        - R::AFFIX_UPDATE_MIN);
+                    for (int a_idx = 0; a_idx < R::AFFIX_NUM; a_idx++) {
+                        for (int upd_w = R::AFFIX_UPDATE_MIN; upd_w <= R::AFFIX_UPDATE_MAX; upd_w++) {
                             auto new_status = status + upd_w * current_base;
                             auto target = dp_map[i + 1].find(new_status);
                             if (target == dp_map[i + 1].end()) {
                                 // not in map, default not needed
-                                e_gain += DOGFOOD_LOSS[current_upgrade + i + 1];
-                                e_df_cost -= DOGFOOD_LOSS[current_upgrade + i + 1];
+                                e_gain += Rule<R>::DOGFOOD_LOSS[current_upgrade + i + 1];
+                                e_df_cost -= Rule<R>::DOGFOOD_LOSS[current_upgrade + i + 1];
                             }
                             else {
                                 auto& [t_count, t_status_score, t_e_gain,
@@ -856,9 +1992,9 @@ namespace DP {
                     e_df_cost /= route_number;
                     success_rate /= route_number;
                     if (success_rate > 0) e_score_gain /= route_number * success_rate;
-                    if (DEBUG) std::cout << format("DP {}: {} {} C:{} SS:{} EG:{} EDF:{} SR:{}, ESG:{}\n",
-                        i, status2str(status), e_gain > DOGFOOD_LOSS[current_upgrade + i] ? "SUCC" : "FAIL", count, status_score, e_gain, e_df_cost, success_rate, e_score_gain);
-                    if (e_gain > DOGFOOD_LOSS[current_upgrade + i])
+                    if (debug) std::cout << format("DP {}: {} {} C:{} SS:{} EG:{} EDF:{} SR:{}, ESG:{}\n",
+                        i, status2str(status), e_gain > Rule<R>::DOGFOOD_LOSS[current_upgrade + i] ? "SUCC" : "FAIL", count, status_score, e_gain, e_df_cost, success_rate, e_score_gain);
+                    if (e_gain > Rule<R>::DOGFOOD_LOSS[current_upgrade + i])
                         dp_map[i][status] = {
                             count,
                             status_score,
@@ -871,16 +2007,16 @@ namespace DP {
             }
         }
         if (dp_map[0].find(0) == dp_map[0].end()) {
-            dftype gain = DOGFOOD_LOSS[current_upgrade];
-            dftype df_cost = -gain;
+            V gain = Rule<R>::DOGFOOD_LOSS[current_upgrade];
+            V df_cost = -gain;
             double s_rate = 0;
-            stype score_gain = 0;
+            double score_gain = 0;
             return std::make_tuple(
                 false,
                 gain,
                 df_cost,
                 s_rate,
-                score_gain * 1. / SCORE_MULTIPLIER
+                score_gain * 1. / SCORE_MULTIPLIER<S>
             );
         }
         auto& [count, status_score, e_gain, e_df_cost, success_rate,
@@ -890,17 +2026,277 @@ namespace DP {
             e_gain,
             e_df_cost,
             success_rate,
-            e_score_gain * 1. / SCORE_MULTIPLIER
+            e_score_gain * 1. / SCORE_MULTIPLIER<S>
+        );
+    }
+
+    /*
+    top-down version of calc. calc sweeps every status in Rule<R>::cell[], here start
+    from status 0 and only expand states reachable from it, with memo on
+    (level, status). a state is not expanded when score bounds already fix its
+    outcome: even max increase can not reach bar (fail), or even min increase
+    always reaches bar (success, all values have closed form).
+
+    input and output are same as calc. if stats is not null, state visits are
+    accumulated into it.
+    */
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    std::tuple<bool, dftype, dftype, double, double> calc_lazy(const std::vector<int>& weight, const std::vector<double>& score,
+        int upgrade_time, double score_bar, dftype gain, CalcStats* stats = nullptr) {
+
+        if (weight.size() != R::AFFIX_NUM || score.size() != R::AFFIX_NUM)
+            throw std::runtime_error("w or s size not equal to AFFIX_NUM");
+        const bool debug = current_engine().debug;
+
+        // multiply scores
+        S SCORE_BAR = to_score<S>(score_bar);
+        std::vector<S> SCORE;
+        for (auto& i : score)
+            SCORE.push_back(to_score<S>(i));
+        for (int i = 0; i < R::AFFIX_NUM; i++)
+            SCORE_BAR -= weight[i] * SCORE[i];
+
+        auto max_increase = *std::max_element(SCORE.begin(), SCORE.end()) * R::AFFIX_UPDATE_MAX;
+        auto min_increase = *std::min_element(SCORE.begin(), SCORE.end()) * R::AFFIX_UPDATE_MIN;
+        double mean_increase = 0;
+        for (auto& i : SCORE)
+            mean_increase += i;
+        mean_increase *= (R::AFFIX_UPDATE_MIN + R::AFFIX_UPDATE_MAX) / 2.0 / R::AFFIX_NUM;
+        auto current_upgrade = Rule<R>::N - upgrade_time;
+        auto route_number = R::AFFIX_NUM * (1 + R::AFFIX_UPDATE_MAX
+            - R::AFFIX_UPDATE_MIN);
+        auto& tails = get_increase_tails<S, R>(SCORE);
+
+        CalcStats local_stats;
+        if (!stats) stats = &local_stats;
+
+        // is upgraded, expected gain, expected dogfood cost, success rate,
+        // expected score gain when success
+        typedef std::tuple<bool, V, V, double, double> result_type;
+        std::vector<std::unordered_map<int, result_type>> memo;
+        memo.resize(upgrade_time + 1);
+
+        auto dfs = [&](auto& self, int i, int status, S status_score) -> result_type {
+            auto ite = memo[i].find(status);
+            if (ite != memo[i].end()) {
+                stats->memo_hit++;
+                return ite->second;
+            }
+            result_type res(false, 0, 0, 0, 0);
+            auto remain = upgrade_time - i;
+            if (status_score + max_increase * remain < SCORE_BAR - EPS) {
+                // can not reach bar, all states below are not upgraded
+                stats->pruned_fail++;
+            }
+            else if (status_score + min_increase * remain >= SCORE_BAR - EPS) {
+                // always reach bar, upgrade until full if worth it now
+                stats->pruned_success++;
+                if (i == upgrade_time || gain > Rule<R>::DOGFOOD_LOSS[current_upgrade + i])
+                    res = result_type(true, gain, Rule<R>::SUCCESS_DOGFOOD_COST, 1,
+                        status_score + mean_increase * remain - SCORE_BAR);
+            }
+            else if (gain_bound_prune<R>(prune_tail<S, R>(tails, SCORE, i, upgrade_time), SCORE_BAR - status_score, gain, current_upgrade + i)) {
+                // can not beat feeding now
+                stats->pruned_gain++;
+            }
+            else {
+                // partial upgraded, expand children
+                stats->visited++;
+                V e_gain = 0, e_df_cost = 0;
+                double success_rate = 0;
+                double e_score_gain = 0;
+                auto current_base = 1;
+                for (int a_idx = 0; a_idx < R::AFFIX_NUM; a_idx++) {
+                    for (int upd_w = R::AFFIX_UPDATE_MIN; upd_w <= R::AFFIX_UPDATE_MAX; upd_w++) {
+                        auto [t_upgrade, t_e_gain, t_e_df_cost, t_success_rate, t_e_score_gain]
+                            = self(self, i + 1, status + upd_w * current_base, status_score + upd_w * SCORE[a_idx]);
+                        if (!t_upgrade) {
+                            // not upgraded, feed it
+                            e_gain += Rule<R>::DOGFOOD_LOSS[current_upgrade + i + 1];
+                            e_df_cost -= Rule<R>::DOGFOOD_LOSS[current_upgrade + i + 1];
+                        }
+                        else {
+                            e_gain += t_e_gain;
+                            e_df_cost += t_e_df_cost;
+                            success_rate += t_success_rate;
+                            e_score_gain += t_success_rate * t_e_score_gain;
+                        }
+                    }
+                    current_base *= BASE;
+                }
+                e_gain /= route_number;
+                e_df_cost /= route_number;
+                success_rate /= route_number;
+                if (success_rate > 0) e_score_gain /= route_number * success_rate;
+                if (debug) std::cout << format("LAZY {}: {} {} SS:{} EG:{} EDF:{} SR:{}, ESG:{}\n",
+                    i, status2str(status), e_gain > Rule<R>::DOGFOOD_LOSS[current_upgrade + i] ? "SUCC" : "FAIL", status_score, e_gain, e_df_cost, success_rate, e_score_gain);
+                if (e_gain > Rule<R>::DOGFOOD_LOSS[current_upgrade + i])
+                    res = result_type(true, e_gain, e_df_cost, success_rate, e_score_gain);
+            }
+            memo[i][status] = res;
+            return res;
+        };
+
+        auto [upgrade, e_gain, e_df_cost, success_rate, e_score_gain] = dfs(dfs, 0, 0, 0);
+        if (!upgrade) {
+            V gain = Rule<R>::DOGFOOD_LOSS[current_upgrade];
+            return std::make_tuple(false, gain, -gain, 0., 0.);
+        }
+        return std::make_tuple(
+            true,
+            e_gain,
+            e_df_cost,
+            success_rate,
+            e_score_gain * 1. / SCORE_MULTIPLIER<S>
         );
     }
 
+    // features used by cost model. bar is relative to max score increase, so
+    // 0 means bar already reached and 1 means only max rolls can reach it.
+    struct EngineFeature {
+        int upgrade_time, nonzero, bar_bucket;
+    };
+
+    EngineFeature engine_feature(const std::vector<int>& weight, const std::vector<double>& score,
+        int upgrade_time, double score_bar) {
+        EngineFeature res = { upgrade_time, 0, 0 };
+        double max_score = 0;
+        for (int i = 0; i < DATA::AFFIX_NUM; i++) {
+            score_bar -= weight[i] * score[i];
+            if (score[i] != 0) res.nonzero++;
+            max_score = std::max(max_score, score[i]);
+        }
+        auto max_increase = max_score * DATA::AFFIX_UPDATE_MAX * upgrade_time;
+        // no increase left, e.g. all zero scores or full level, bar can not be divided
+        if (max_increase <= 0) res.bar_bucket = BAR_BUCKETS - 1;
+        else if (score_bar < 0) res.bar_bucket = 0;
+        else if (score_bar > max_increase) res.bar_bucket = BAR_BUCKETS - 1;
+        else res.bar_bucket = 1 + int(score_bar / max_increase * (BAR_BUCKETS - 2));
+        res.bar_bucket = std::clamp(res.bar_bucket, 0, BAR_BUCKETS - 1);
+        return res;
+    }
+
+    // fastest measured engine of the feature. calc_lazy if not measured.
+    ENGINE_NAMES choose_engine(const EngineFeature& f) {
+        auto& engine = current_engine();
+        if (engine.engine != ENGINE_NAMES::end) return engine.engine;
+        auto& cost = engine.engine_cost[f.upgrade_time][f.nonzero][f.bar_bucket];
+        auto res = ENGINE_NAMES::lazy;
+        double best = 0;
+        for (int i = 0; i < ENGINE_NUMBER; i++)
+            if (cost[i] > 0 && (best == 0 || cost[i] < best)) {
+                best = cost[i];
+                res = static_cast<ENGINE_NAMES>(i + 1);
+            }
+        return res;
+    }
+
+    // calc with engine chosen by cost model. input and output are same as calc.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    auto calc_auto(const std::vector<int>& weight, const std::vector<double>& score,
+        int upgrade_time, double score_bar, dftype gain, CalcStats* stats = nullptr) {
+        switch (choose_engine(engine_feature(weight, score, upgrade_time, score_bar))) {
+        case ENGINE_NAMES::calc:
+            return calc<V, S, R>(weight, score, upgrade_time, score_bar, gain, stats);
+        case ENGINE_NAMES::calc2:
+            return calc2<V, S, R>(weight, score, upgrade_time, score_bar, gain, stats);
+        default:
+            return calc_lazy<V, S, R>(weight, score, upgrade_time, score_bar, gain, stats);
+        }
+    }
+
+    // micro benchmark to fill engine_cost. for every upgrade time and non-zero
+    // score number, generate random upgraded weights and set bar into every
+    // bucket, then time all engines on same queries.
+    void calibrate_engines(int samples = 5, bool output = false) {
+        init();
+        auto& engine_cost = current_engine().engine_cost;
+        for (int ut = 1; ut <= N; ut++)
+            for (int nonzero = 1; nonzero <= DATA::AFFIX_NUM; nonzero++)
+                for (int bucket = 0; bucket < BAR_BUCKETS; bucket++) {
+                    double used_time[ENGINE_NUMBER] = {};
+                    for (int k = 0; k < samples; k++) {
+                        std::vector<double> score(DATA::AFFIX_NUM, 0);
+                        std::vector<int> weight;
+                        for (int i = 0; i < nonzero; i++)
+                            score[i] = 0.1 + 0.9 * DATA::rand();
+                        std::shuffle(score.begin(), score.end(), DATA::mt);
+                        double current = 0;
+                        for (int i = 0; i < DATA::AFFIX_NUM; i++) {
+                            weight.push_back(DATA::randint(DATA::AFFIX_UPDATE_MAX - DATA::AFFIX_UPDATE_MIN + 1) + DATA::AFFIX_UPDATE_MIN);
+                        }
+                        for (int i = ut; i < N; i++)
+                            weight[DATA::randint(DATA::AFFIX_NUM)] += DATA::randint(DATA::AFFIX_UPDATE_MAX - DATA::AFFIX_UPDATE_MIN + 1) + DATA::AFFIX_UPDATE_MIN;
+                        for (int i = 0; i < DATA::AFFIX_NUM; i++)
+                            current += weight[i] * score[i];
+                        // relative bar in middle of bucket
+                        double relative = (bucket - 0.5) / (BAR_BUCKETS - 2);
+                        if (bucket == 0) relative = -0.1;
+                        if (bucket == BAR_BUCKETS - 1) relative = 1.1;
+                        double bar = current + relative * *std::max_element(score.begin(), score.end()) * DATA::AFFIX_UPDATE_MAX * ut;
+                        dftype gain = std::pow(10, 3 + DATA::rand() * 5);
+                        for (int e = 0; e < ENGINE_NUMBER; e++) {
+                            auto start = std::chrono::steady_clock::now();
+                            if (e == 0) calc(weight, score, ut, bar, gain);
+                            else if (e == 1) calc2(weight, score, ut, bar, gain);
+                            else calc_lazy(weight, score, ut, bar, gain);
+                            used_time[e] += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+                        }
+                    }
+                    for (int e = 0; e < ENGINE_NUMBER; e++)
+                        engine_cost[ut][nonzero][bucket][e] = used_time[e] / samples;
+                    if (output) {
+                        auto& cost = engine_cost[ut][nonzero][bucket];
+                        std::cout << format("upgrade time {} nonzero {} bar bucket {}: calc {:.1f}us calc2 {:.1f}us lazy {:.1f}us\n",
+                            ut, nonzero, bucket, cost[0], cost[1], cost[2]);
+                    }
+                }
+    }
+
+    // profile file, one line per measured feature:
+    // upgrade_time nonzero bar_bucket cost_of_each_engine
+    bool save_engine_profile(const std::string& filename = ENGINE_PROFILE_FILE) {
+        std::ofstream output(filename, std::ios::out);
+        if (output.fail())
+            return false;
+        auto& engine_cost = current_engine().engine_cost;
+        for (int ut = 0; ut <= N; ut++)
+            for (int nonzero = 0; nonzero <= DATA::AFFIX_NUM; nonzero++)
+                for (int bucket = 0; bucket < BAR_BUCKETS; bucket++) {
+                    auto& cost = engine_cost[ut][nonzero][bucket];
+                    if (std::all_of(cost, cost + ENGINE_NUMBER, [](double c) { return c == 0; }))
+                        continue;
+                    output << ut << ' ' << nonzero << ' ' << bucket;
+                    for (int e = 0; e < ENGINE_NUMBER; e++)
+                        output << ' ' << cost[e];
+                    output << '\n';
+                }
+        return !output.fail();
+    }
+
+    bool load_engine_profile(const std::string& filename = ENGINE_PROFILE_FILE) {
+        std::ifstream input(filename, std::ios::in);
+        if (input.fail())
+            return false;
+        auto& engine_cost = current_engine().engine_cost;
+        int ut, nonzero, bucket;
+        while (input >> ut >> nonzero >> bucket) {
+            if (ut < 0 || ut > N || nonzero < 0 || nonzero > DATA::AFFIX_NUM || bucket < 0 || bucket >= BAR_BUCKETS)
+                return false;
+            for (int e = 0; e < ENGINE_NUMBER; e++)
+                input >> engine_cost[ut][nonzero][bucket][e];
+        }
+        return true;
+    }
+
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
     auto calc(const DATA::Artifact& art, const std::vector<double>& score,
         double score_bar, dftype gain) {
         std::vector<int> weight;
         for (auto& [t, w] : art.sub)
             weight.push_back(w);
         // freopen("r1.txt", "w", stdout);
-        auto res = calc(weight, score, N - art.level, score_bar, gain);
+        auto res = calc_auto<V, S, R>(weight, score, Rule<R>::N - art.level, score_bar, gain);
         // freopen("r2.txt", "w", stdout);
         // auto res2 = calc2(weight, score, N - art.level, score_bar, gain);
         // fflush(stdout);
@@ -920,43 +2316,62 @@ namespace DP {
         return res;
     }
 
-    // recommended calling version, have 3-sub support.
-    std::tuple<bool, DP::dftype, DP::dftype, double, double> calc(const DATA::Artifact& art,
+    // scores of subs of packed artifact, written into res
+    inline void select_sub_score(const DATA::PackedArtifact& art, const std::map<DATA::AFFIX_NAMES, double>& sub_scores, std::vector<double>& res) {
+        res.clear();
+        for (int i = 0; i < art.sub_number(); i++) {
+            auto ite = sub_scores.find(art.sub_type(i));
+            if (ite == sub_scores.end())
+                throw std::runtime_error("sub not found in sub_scores");
+            res.push_back(ite->second);
+        }
+    }
+
+    // recommended calling version, have 3-sub support. V and S choose value
+    // and score type of DP, default is double. R chooses artifact rules; when
+    // initial sub number is less than AFFIX_NUM, every upgrade adds one sub
+    // until AFFIX_NUM, which is enumerated here.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    std::tuple<bool, DP::dftype, DP::dftype, double, double> calc(const DATA::PackedArtifact& art,
         const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype gain) {
+        static_assert(R::AFFIX_NUM <= DATA::PackedArtifact::MAX_SUB, "rules have more subs than packed artifact");
 
-        if (art.sub.size() == 3) {
-            if (art.level != 0)
-                throw std::runtime_error("input 3 sub but level not zero artifact");
+        if (art.sub_number() < R::AFFIX_NUM) {
+            // every upgrade before has added one sub
+            DATA::get_weight_from_distribution(art.sub_number() - art.level(), R::INITIAL_AFFIX_NUM_WEIGHT);
             auto current_art = art;
-            current_art.level++;
-            std::vector<DATA::AFFIX_NAMES> current_sub;
-            for (auto& [t, w] : art.sub)
-                current_sub.push_back(t);
-            auto sub_dist = DATA::get_sub_distribution(art.main, current_sub);
-            auto sub_weight_sum = DATA::weighted_sum(sub_dist) * (DATA::AFFIX_UPDATE_MAX - DATA::AFFIX_UPDATE_MIN + 1);
+            current_art.set_level(art.level() + 1);
+            int used = 0;
+            for (int i = 0; i < art.sub_number(); i++)
+                used |= DATA::SUB_BIT[static_cast<int>(art.sub_type(i))];
+            auto& sub_dist = DATA::sub_cumulative(art.main(), used);
+            auto sub_weight_sum = sub_dist.sum() * (R::AFFIX_UPDATE_MAX - R::AFFIX_UPDATE_MIN + 1);
 
             dftype e_gain = 0, e_df_cost = 0;
             double success_rate = 0, e_score_gain = 0;
-            for (auto& [t, w] : sub_dist) {
-                for (int i = DATA::AFFIX_UPDATE_MIN; i <= DATA::AFFIX_UPDATE_MAX; i++) {
-                    current_art.sub.push_back({ t, i });
-                    auto ores = calc(current_art, sub_scores, score_bar, gain);
+            for (int ti = 0; ti < DATA::SUB_TYPES; ti++) {
+                auto t = DATA::SUB_PROB_WEIGHT_TABLE[ti].first;
+                int w = sub_dist.at(ti);
+                if (!w) continue;
+                for (int i = R::AFFIX_UPDATE_MIN; i <= R::AFFIX_UPDATE_MAX; i++) {
+                    current_art.push_sub(t, i);
+                    auto ores = calc<V, S, R>(current_art, sub_scores, score_bar, gain);
                     auto& [t_success, t_e_gain, t_e_df_cost, t_success_rate, t_e_score_gain] = ores;
                     e_gain += t_e_gain * w;
                     e_df_cost += t_e_df_cost * w;
                     success_rate += t_success_rate * w;
                     e_score_gain += t_success_rate * t_e_score_gain * w;
                     // std::cout << format("w {} upgrade? {} expected gain {} dogfood cost {} success rate above bar {} expected better score if success {}\n", w, t_success, t_e_gain, t_e_df_cost, t_success_rate, t_e_score_gain);
-                    current_art.sub.pop_back();
+                    current_art.pop_sub();
                 }
             }
             e_gain /= sub_weight_sum;
             e_df_cost /= sub_weight_sum;
             success_rate /= sub_weight_sum;
             if (success_rate > 0) e_score_gain /= sub_weight_sum * success_rate;
-            bool success = e_gain > DOGFOOD_LOSS[0];
+            bool success = e_gain > Rule<R>::DOGFOOD_LOSS[art.level()];
             if (!success) {
-                e_gain = DOGFOOD_LOSS[0];
+                e_gain = Rule<R>::DOGFOOD_LOSS[art.level()];
                 e_df_cost = -e_gain;
                 success_rate = 0;
                 e_score_gain = 0;
@@ -969,116 +2384,2344 @@ namespace DP {
                 e_score_gain
             );
         }
-        return calc(art, select_sub_score(art, sub_scores), score_bar, gain);
-    }
+        // reused per thread, so catalog sweeps do not allocate here
+        thread_local std::vector<int> weight;
+        thread_local std::vector<double> score;
+        weight.clear();
+        for (int i = 0; i < art.sub_number(); i++)
+            weight.push_back(art.sub_weight(i));
+        select_sub_score(art, sub_scores, score);
+        return calc_auto<V, S, R>(weight, score, Rule<R>::N - art.level(), score_bar, gain);
+    }
+
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    std::tuple<bool, DP::dftype, DP::dftype, double, double> calc(const DATA::Artifact& art,
+        const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype gain) {
+        return calc<V, S, R>(DATA::PackedArtifact(art), sub_scores, score_bar, gain);
+    }
+
+    // get artifact string as input
+    // std::tuple<bool, DP::dftype, DP::dftype, double, double> calc(const std::string &art_string,
+    //     const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype gain) {
+    //     auto art = DATA::Artifact(art_string);
+    //     return calc(art, sub_scores, score_bar, gain);
+    // }
+
+    // upgrade one artifact level by level. the DP of calc_table is run once
+    // when session opens and kept; every observed roll moves status in it, so
+    // decision after each roll is a lookup. when artifact has less than
+    // AFFIX_NUM subs, DP is run after the roll which adds the last sub.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    class UpgradeSession {
+        DATA::PackedArtifact art;
+        std::map<DATA::AFFIX_NAMES, double> sub_scores;
+        double score_bar;
+        dftype gain;
+        DPTable<S, V> dp_map;
+        int base_level = 0; // level when dp_map is built
+        int status = 0; // weight increase since base_level, digit per sub
+        int dp_runs = 0;
+        std::tuple<bool, dftype, dftype, double, double> missing_sub_result; // decision before all subs appear
+
+        void open() {
+            if (art.sub_number() < R::AFFIX_NUM) {
+                missing_sub_result = DP::calc<V, S, R>(art, sub_scores, score_bar, gain);
+                return;
+            }
+            std::vector<int> weight;
+            for (int i = 0; i < art.sub_number(); i++)
+                weight.push_back(art.sub_weight(i));
+            std::vector<double> score;
+            select_sub_score(art, sub_scores, score);
+            calc_table<V, S, R>(weight, score, Rule<R>::N - art.level(), score_bar, gain, dp_map);
+            base_level = art.level();
+            status = 0;
+            dp_runs++;
+        }
+
+    public:
+        UpgradeSession(const DATA::PackedArtifact& art, const std::map<DATA::AFFIX_NAMES, double>& sub_scores,
+            double score_bar, dftype gain) : art(art), sub_scores(sub_scores), score_bar(score_bar), gain(gain) {
+            open();
+        }
+
+        // same result as calc on current artifact
+        std::tuple<bool, dftype, dftype, double, double> decision() const {
+            if (art.sub_number() < R::AFFIX_NUM) return missing_sub_result;
+            return table_result<V, S, R>(dp_map, art.level() - base_level, status, art.level());
+        }
+
+        // apply one upgrade, which adds weight to sub type, or adds sub type
+        // if artifact has not got it yet.
+        void roll(DATA::AFFIX_NAMES type, int weight) {
+            if (art.level() >= Rule<R>::N)
+                throw std::runtime_error("artifact fully upgraded");
+            if (weight < R::AFFIX_UPDATE_MIN || weight > R::AFFIX_UPDATE_MAX)
+                throw std::runtime_error("affix weight wrong");
+            int idx = 0;
+            while (idx < art.sub_number() && art.sub_type(idx) != type) idx++;
+            // check everything before artifact changes, so a rejected roll
+            // leaves session as it was
+            if (idx == art.sub_number()) {
+                if (art.sub_number() >= R::AFFIX_NUM || type == art.main() || !DATA::SUB_BIT[static_cast<int>(type)])
+                    throw std::runtime_error("sub not valid");
+            }
+            else if (art.sub_number() < R::AFFIX_NUM)
+                throw std::runtime_error("sub number too few to upgrade existing sub");
+            art.set_level(art.level() + 1);
+            if (idx == art.sub_number()) {
+                art.push_sub(type, weight);
+                if (art.sub_number() == R::AFFIX_NUM) open();
+                else missing_sub_result = DP::calc<V, S, R>(art, sub_scores, score_bar, gain);
+                return;
+            }
+            art.set_sub_weight(idx, art.sub_weight(idx) + weight);
+            int base = 1;
+            for (int i = 0; i < idx; i++) base *= BASE;
+            status += weight * base;
+        }
+
+        const DATA::PackedArtifact& artifact() const {
+            return art;
+        }
+
+        // times DP is run, 1 for an artifact opened with all subs
+        int dp_run_number() const {
+            return dp_runs;
+        }
+    };
+
+    // upgrade policy of one sub score vector. every upgrade adds same score
+    // distribution whatever current weights are, so expected gain only
+    // depends on score and level, and grows with score. an artifact with all
+    // subs at level i is upgraded iff its score is at least cutoff of level i.
+    // at full level, cutoff is score bar, and not less means success.
+    struct ThresholdPolicy {
+        struct Level {
+            double cutoff = 0; // lowest score to upgrade, infinity if never
+            dftype upgrade_gain = 0, upgrade_df_cost = 0; // expected values upgrading at cutoff
+            double upgrade_success_rate = 0;
+            dftype below_gain = 0; // expected gain if upgrading just below cutoff anyway
+            dftype feed_gain = 0; // gain of feeding, DOGFOOD_LOSS of level
+        };
+        std::vector<Level> levels; // index is artifact level
+
+        bool upgrade(double score, int level) const {
+            return score >= levels[level].cutoff;
+        }
+    };
+
+    // build ThresholdPolicy with DP over scores instead of statuses. value of
+    // level i + 1 is a step function of score, so expected value after one
+    // upgrade only changes at breakpoints minus one increase, where it is
+    // evaluated. scores of same value are merged, which keeps breakpoints few.
+    template <class R = DATA::RULES_5STAR>
+    ThresholdPolicy extract_threshold_policy(const std::vector<double>& score, double score_bar, dftype gain) {
+        if (score.size() != R::AFFIX_NUM)
+            throw std::runtime_error("score size not equal to AFFIX_NUM");
+        struct Value {
+            dftype gain, df_cost;
+            double success_rate;
+            bool operator==(const Value& o) const { return gain == o.gain && df_cost == o.df_cost && success_rate == o.success_rate; }
+        };
+        // breakpoint minus increase plus increase may round below breakpoint,
+        // so compare with tolerance smaller than EPS of score bar
+        constexpr double TOLERANCE = 1e-9;
+        // value is low below x[0], v[p] in [x[p], x[p + 1])
+        struct Step {
+            Value low;
+            std::vector<double> x;
+            std::vector<Value> v;
+            const Value& at(double s) const {
+                auto p = std::upper_bound(x.begin(), x.end(), s + TOLERANCE) - x.begin();
+                return p ? v[p - 1] : low;
+            }
+        };
+        const int N = Rule<R>::N;
+        std::vector<double> increase;
+        for (int i = 0; i < R::AFFIX_NUM; i++)
+            for (int w = R::AFFIX_UPDATE_MIN; w <= R::AFFIX_UPDATE_MAX; w++)
+                increase.push_back(w * score[i]);
+        auto feed = [](int level) {
+            dftype loss = Rule<R>::DOGFOOD_LOSS[level];
+            return Value{ loss, -loss, 0 };
+        };
+
+        ThresholdPolicy res;
+        res.levels.resize(N + 1);
+        auto& full = res.levels[N];
+        full.cutoff = score_bar - EPS;
+        full.upgrade_gain = gain;
+        full.upgrade_df_cost = Rule<R>::SUCCESS_DOGFOOD_COST;
+        full.upgrade_success_rate = 1;
+        full.below_gain = full.feed_gain = feed(N).gain;
+        Step next{ feed(N), { full.cutoff }, { { gain, Rule<R>::SUCCESS_DOGFOOD_COST, 1 } } };
+
+        for (int level = N - 1; level >= 0; level--) {
+            // expected value of upgrading once from score s, same order as calc
+            auto upgrade_value = [&](double s) {
+                Value res = { 0, 0, 0 };
+                for (auto inc : increase) {
+                    auto& t = next.at(s + inc);
+                    res.gain += t.gain;
+                    res.df_cost += t.df_cost;
+                    res.success_rate += t.success_rate;
+                }
+                res.gain /= increase.size();
+                res.df_cost /= increase.size();
+                res.success_rate /= increase.size();
+                return res;
+            };
+            std::vector<double> candidate;
+            for (auto x : next.x)
+                for (auto inc : increase)
+                    candidate.push_back(x - inc);
+            std::sort(candidate.begin(), candidate.end());
+            candidate.erase(std::unique(candidate.begin(), candidate.end()), candidate.end());
+
+            // upgrade value grows with score, so first one beating feed is found by bisection
+            auto loss = feed(level);
+            auto first = std::partition_point(candidate.begin(), candidate.end(),
+                [&](double s) { return upgrade_value(s).gain <= loss.gain; }) - candidate.begin();
+            auto& current = res.levels[level];
+            current.feed_gain = loss.gain;
+            current.below_gain = first ? upgrade_value(candidate[first - 1]).gain : upgrade_value(-INFINITY).gain;
+            Step step{ loss, {}, {} };
+            if (first == candidate.size()) current.cutoff = INFINITY;
+            else {
+                current.cutoff = candidate[first] - TOLERANCE;
+                auto at_cutoff = upgrade_value(candidate[first]);
+                current.upgrade_gain = at_cutoff.gain;
+                current.upgrade_df_cost = at_cutoff.df_cost;
+                current.upgrade_success_rate = at_cutoff.success_rate;
+                if (level == 0) break; // no level uses value of level 0
+                for (auto p = first; p < candidate.size(); p++) {
+                    auto value = upgrade_value(candidate[p]);
+                    if (step.v.empty() || !(step.v.back() == value)) {
+                        step.x.push_back(candidate[p]);
+                        step.v.push_back(value);
+                    }
+                }
+            }
+            next = std::move(step);
+        }
+        return res;
+    }
+
+
+    // index in cell[i + 1] of every child of status in cell[i], in order of
+    // calc: sub index, then upgrade weight. built once per rules.
+    template <class R>
+    struct CellChildren {
+        static constexpr int ROUTES = R::AFFIX_NUM * (R::AFFIX_UPDATE_MAX - R::AFFIX_UPDATE_MIN + 1);
+        inline static std::once_flag INIT_FLAG;
+        inline static std::vector<int> child[Rule<R>::N]; // ROUTES per status
+
+        static void init() {
+            std::call_once(INIT_FLAG, [] {
+                DP::init<R>();
+                for (int i = 0; i < Rule<R>::N; i++) {
+                    std::unordered_map<unsigned int, int> index;
+                    for (int k = 0; k < Rule<R>::cell[i + 1].size(); k++)
+                        index[Rule<R>::cell[i + 1][k].first] = k;
+                    for (auto& [status, count] : Rule<R>::cell[i]) {
+                        int base = 1;
+                        for (int a_idx = 0; a_idx < R::AFFIX_NUM; a_idx++) {
+                            for (int upd_w = R::AFFIX_UPDATE_MIN; upd_w <= R::AFFIX_UPDATE_MAX; upd_w++)
+                                child[i].push_back(index.at(status + upd_w * base));
+                            base *= BASE;
+                        }
+                    }
+                }
+            });
+        }
+    };
+
+    const int PROFILE_LANES = 4; // profiles swept together, innermost dimension of DP arrays
+
+    // calc of same weights for many score vectors. score is row major, one
+    // row of AFFIX_NUM scores per profile. every level is swept once for
+    // PROFILE_LANES profiles, with states indexed by CellChildren instead of
+    // looked up in maps. no state is pruned, fed states get DOGFOOD_LOSS as
+    // calc does, so results equal calc.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    void calc_profiles(const std::vector<int>& weight, const std::vector<double>& score, int upgrade_time,
+        double score_bar, dftype gain, std::vector<std::tuple<bool, dftype, dftype, double, double>>& res) {
+        const int B = PROFILE_LANES, ROUTES = CellChildren<R>::ROUTES;
+        CellChildren<R>::init();
+        if (weight.size() != R::AFFIX_NUM || score.size() % R::AFFIX_NUM)
+            throw std::runtime_error("w or s size not match AFFIX_NUM");
+        int profiles = score.size() / R::AFFIX_NUM;
+        auto current_upgrade = Rule<R>::N - upgrade_time;
+        res.resize(profiles);
+        // e_gain, e_df_cost, success_rate, success_rate * e_score_gain of states, B lanes per state
+        std::vector<V> gain_now, gain_next, df_now, df_next;
+        std::vector<double> sr_now, sr_next, esg_now, esg_next;
+
+        for (int begin = 0; begin < profiles; begin += B) {
+            // unused lanes repeat first profile of block
+            S SCORE[B][R::AFFIX_NUM], SCORE_BAR[B];
+            for (int p = 0; p < B; p++) {
+                int row = begin + (begin + p < profiles ? p : 0);
+                SCORE_BAR[p] = to_score<S>(score_bar);
+                for (int i = 0; i < R::AFFIX_NUM; i++)
+                    SCORE[p][i] = to_score<S>(score[row * R::AFFIX_NUM + i]);
+                for (int i = 0; i < R::AFFIX_NUM; i++)
+                    SCORE_BAR[p] -= weight[i] * SCORE[p][i];
+            }
+            for (int i = upgrade_time; i >= 0; i--) {
+                auto& cell = Rule<R>::cell[i];
+                V loss = Rule<R>::DOGFOOD_LOSS[current_upgrade + i];
+                gain_now.resize(cell.size() * B);
+                df_now.resize(cell.size() * B);
+                sr_now.resize(cell.size() * B);
+                esg_now.resize(cell.size() * B);
+                for (int k = 0; k < cell.size(); k++) {
+                    auto at = k * B;
+                    if (i == upgrade_time) {
+                        S status_score[B] = {};
+                        for (int a = 0, j = cell[k].first; a < R::AFFIX_NUM; a++, j /= BASE)
+                            for (int p = 0; p < B; p++)
+                                status_score[p] += (j % BASE) * SCORE[p][a];
+                        // full upgraded, success if not below bar
+                        for (int p = 0; p < B; p++) {
+                            bool success = !(status_score[p] < SCORE_BAR[p] - EPS);
+                            gain_now[at + p] = success ? V(gain) : loss;
+                            df_now[at + p] = success ? V(Rule<R>::SUCCESS_DOGFOOD_COST) : -loss;
+                            sr_now[at + p] = success;
+                            esg_now[at + p] = success ? double(status_score[p] - SCORE_BAR[p]) : 0;
+                        }
+                        continue;
+                    }
+                    V e_gain[B] = {}, e_df_cost[B] = {};
+                    double success_rate[B] = {}, e_score_gain[B] = {};
+                    auto* child = &CellChildren<R>::child[i][k * ROUTES];
+                    for (int r = 0; r < ROUTES; r++) {
+                        auto from = child[r] * B;
+                        for (int p = 0; p < B; p++) {
+                            e_gain[p] += gain_next[from + p];
+                            e_df_cost[p] += df_next[from + p];
+                            success_rate[p] += sr_next[from + p];
+                            e_score_gain[p] += sr_next[from + p] * esg_next[from + p];
+                        }
+                    }
+                    for (int p = 0; p < B; p++) {
+                        e_gain[p] /= ROUTES;
+                        e_df_cost[p] /= ROUTES;
+                        success_rate[p] /= ROUTES;
+                        if (success_rate[p] > 0) e_score_gain[p] /= ROUTES * success_rate[p];
+                        bool upgrade = e_gain[p] > loss;
+                        gain_now[at + p] = upgrade ? e_gain[p] : loss;
+                        df_now[at + p] = upgrade ? e_df_cost[p] : -loss;
+                        sr_now[at + p] = upgrade ? success_rate[p] : 0;
+                        esg_now[at + p] = upgrade ? e_score_gain[p] : 0;
+                    }
+                }
+                std::swap(gain_now, gain_next);
+                std::swap(df_now, df_next);
+                std::swap(sr_now, sr_next);
+                std::swap(esg_now, esg_next);
+            }
+            V loss = Rule<R>::DOGFOOD_LOSS[current_upgrade];
+            for (int p = 0; p < B && begin + p < profiles; p++) {
+                // at full level calc reports success, otherwise whether to upgrade
+                bool success = upgrade_time ? gain_next[p] > loss : sr_next[p] > 0;
+                if (success)
+                    res[begin + p] = std::make_tuple(true, gain_next[p], df_next[p], sr_next[p], esg_next[p] * 1. / SCORE_MULTIPLIER<S>);
+                else
+                    res[begin + p] = std::make_tuple(false, loss, -loss, 0., 0.);
+            }
+        }
+    }
+
+    // result of every profile of calc_profiles, and profile of largest expected gain
+    struct ProfileResults {
+        std::vector<std::tuple<bool, dftype, dftype, double, double>> result;
+        int best = -1;
+    };
+
+    // calc of one artifact for every profile of sub scores. same as calling
+    // calc per profile, including artifacts which have less subs.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    ProfileResults calc_profiles(const DATA::PackedArtifact& art, const std::vector<std::map<DATA::AFFIX_NAMES, double>>& profiles,
+        double score_bar, dftype gain) {
+        ProfileResults res;
+        int P = profiles.size();
+        if (art.sub_number() < R::AFFIX_NUM) {
+            // same sum as missing sub path of calc, for all profiles
+            DATA::get_weight_from_distribution(art.sub_number() - art.level(), R::INITIAL_AFFIX_NUM_WEIGHT);
+            auto current_art = art;
+            current_art.set_level(art.level() + 1);
+            int used = 0;
+            for (int i = 0; i < art.sub_number(); i++)
+                used |= DATA::SUB_BIT[static_cast<int>(art.sub_type(i))];
+            auto& sub_dist = DATA::sub_cumulative(art.main(), used);
+            auto sub_weight_sum = sub_dist.sum() * (R::AFFIX_UPDATE_MAX - R::AFFIX_UPDATE_MIN + 1);
+            std::vector<dftype> e_gain(P), e_df_cost(P);
+            std::vector<double> success_rate(P), e_score_gain(P);
+            for (int ti = 0; ti < DATA::SUB_TYPES; ti++) {
+                auto t = DATA::SUB_PROB_WEIGHT_TABLE[ti].first;
+                int w = sub_dist.at(ti);
+                if (!w) continue;
+                for (int i = R::AFFIX_UPDATE_MIN; i <= R::AFFIX_UPDATE_MAX; i++) {
+                    current_art.push_sub(t, i);
+                    auto child = calc_profiles<V, S, R>(current_art, profiles, score_bar, gain);
+                    for (int p = 0; p < P; p++) {
+                        auto& [t_success, t_e_gain, t_e_df_cost, t_success_rate, t_e_score_gain] = child.result[p];
+                        e_gain[p] += t_e_gain * w;
+                        e_df_cost[p] += t_e_df_cost * w;
+                        success_rate[p] += t_success_rate * w;
+                        e_score_gain[p] += t_success_rate * t_e_score_gain * w;
+                    }
+                    current_art.pop_sub();
+                }
+            }
+            res.result.resize(P);
+            for (int p = 0; p < P; p++) {
+                e_gain[p] /= sub_weight_sum;
+                e_df_cost[p] /= sub_weight_sum;
+                success_rate[p] /= sub_weight_sum;
+                if (success_rate[p] > 0) e_score_gain[p] /= sub_weight_sum * success_rate[p];
+                if (e_gain[p] > Rule<R>::DOGFOOD_LOSS[art.level()])
+                    res.result[p] = std::make_tuple(true, e_gain[p], e_df_cost[p], success_rate[p], e_score_gain[p]);
+                else {
+                    dftype loss = Rule<R>::DOGFOOD_LOSS[art.level()];
+                    res.result[p] = std::make_tuple(false, loss, -loss, 0., 0.);
+                }
+            }
+        }
+        else {
+            std::vector<int> weight;
+            for (int i = 0; i < art.sub_number(); i++)
+                weight.push_back(art.sub_weight(i));
+            std::vector<double> score, row;
+            for (auto& sub_scores : profiles) {
+                select_sub_score(art, sub_scores, row);
+                score.insert(score.end(), row.begin(), row.end());
+            }
+            calc_profiles<V, S, R>(weight, score, Rule<R>::N - art.level(), score_bar, gain, res.result);
+        }
+        for (int p = 0; p < P; p++)
+            if (res.best < 0 || std::get<1>(res.result[p]) > std::get<1>(res.result[res.best]))
+                res.best = p;
+        return res;
+    }
+
+    // parameters of DualCost: sub scores in SUB_PROB_WEIGHT_TABLE order, score bar, gain
+    const int DUAL_BAR = DATA::SUB_TYPES, DUAL_GAIN = DATA::SUB_TYPES + 1;
+    typedef Dual<DATA::SUB_TYPES + 2> DualCost;
+
+    // widths of logistic kernels which replace decision steps in derivatives.
+    // derivatives are of the smoothed model, so they change with these widths
+    struct SmoothWidth {
+        double score = 1; // score bar test of full upgraded artifact, in score
+        double gain = 0.01; // upgrade test, relative to max(1, |gain|)
+    };
+
+    // logistic kernel is below 1e-16 of its peak out of this many widths
+    const double SMOOTH_RANGE = 37;
+
+    // derivative of step from 0 to 1 at m = 0, smoothed by logistic kernel of width h.
+    // value is 1 inside SMOOTH_RANGE, 0 outside where derivative is skipped.
+    template <int K>
+    Dual<K> smoothed_step(const Dual<K>& m, double h) {
+        Dual<K> res(std::abs(m.v) < SMOOTH_RANGE * h);
+        if (!res.v) return res;
+        double t = std::exp(-std::abs(m.v) / h);
+        double density = t / ((1 + t) * (1 + t)) / h;
+        for (int k = 0; k < K; k++)
+            res.d[k] = density * m.d[k];
+        return res;
+    }
+
+    // derivative of x when it jumps by jump at step
+    template <int K>
+    inline void add_jump(Dual<K>& x, double jump, const Dual<K>& step) {
+        if (!step.v) return;
+        for (int k = 0; k < K; k++)
+            x.d[k] += jump * step.d[k];
+    }
+
+    /*
+    calc with derivatives. expected gain, dogfood cost and success rate are
+    step functions of scores, bar and gain: scores only matter through
+    decisions, so exact derivatives are zero almost everywhere. values here
+    are exact and same as calc, while every decision adds its jump times
+    derivative of a logistic kernel of SmoothWidth, which is derivative of
+    DP with smoothed decisions. only gain has exact derivative inside a step.
+    states are swept densely as calc_profiles does.
+    output: whether upgrade, expected gain, expected dogfood cost, success rate.
+    */
+    template <class R = DATA::RULES_5STAR>
+    std::tuple<bool, DualCost, DualCost, DualCost> calc_dual(const std::vector<int>& weight, const std::vector<DualCost>& score,
+        int upgrade_time, const DualCost& score_bar, const DualCost& gain, const SmoothWidth& width = SmoothWidth()) {
+        const int ROUTES = CellChildren<R>::ROUTES;
+        CellChildren<R>::init();
+        if (weight.size() != R::AFFIX_NUM || score.size() != R::AFFIX_NUM)
+            throw std::runtime_error("w or s size not equal to AFFIX_NUM");
+        auto current_upgrade = Rule<R>::N - upgrade_time;
+        DualCost SCORE_BAR = score_bar;
+        for (int i = 0; i < R::AFFIX_NUM; i++)
+            SCORE_BAR -= weight[i] * score[i];
+        double gain_width = width.gain * std::max(1., std::abs(gain.v));
+        double success_cost = Rule<R>::SUCCESS_DOGFOOD_COST;
+        // e_gain, e_df_cost, success_rate of states
+        std::vector<DualCost> gain_now, gain_next, df_now, df_next, sr_now, sr_next;
+        for (int i = upgrade_time; i >= 0; i--) {
+            auto& cell = Rule<R>::cell[i];
+            double loss = Rule<R>::DOGFOOD_LOSS[current_upgrade + i];
+            gain_now.assign(cell.size(), 0);
+            df_now.assign(cell.size(), 0);
+            sr_now.assign(cell.size(), 0);
+            for (int k = 0; k < cell.size(); k++) {
+                if (i == upgrade_time) {
+                    DualCost status_score;
+                    for (int a = 0, j = cell[k].first; a < R::AFFIX_NUM; a++, j /= BASE)
+                        status_score += (j % BASE) * score[a];
+                    bool success = !(status_score.v < SCORE_BAR.v - EPS);
+                    auto step = smoothed_step(status_score - SCORE_BAR, width.score);
+                    gain_now[k] = success ? gain : DualCost(loss);
+                    df_now[k] = success ? success_cost : -loss;
+                    sr_now[k] = success;
+                    add_jump(gain_now[k], gain.v - loss, step);
+                    add_jump(df_now[k], success_cost + loss, step);
+                    add_jump(sr_now[k], 1, step);
+                    continue;
+                }
+                DualCost e_gain, e_df_cost, success_rate;
+                auto* child = &CellChildren<R>::child[i][k * ROUTES];
+                for (int r = 0; r < ROUTES; r++) {
+                    e_gain += gain_next[child[r]];
+                    e_df_cost += df_next[child[r]];
+                    success_rate += sr_next[child[r]];
+                }
+                e_gain /= ROUTES;
+                e_df_cost /= ROUTES;
+                success_rate /= ROUTES;
+                bool upgrade = e_gain.v > loss;
+                auto step = smoothed_step(e_gain - loss, gain_width);
+                if (upgrade) {
+                    gain_now[k] = e_gain;
+                    df_now[k] = e_df_cost;
+                    sr_now[k] = success_rate;
+                }
+                else {
+                    gain_now[k] = loss;
+                    df_now[k] = -loss;
+                }
+                add_jump(gain_now[k], e_gain.v - loss, step);
+                add_jump(df_now[k], e_df_cost.v + loss, step);
+                add_jump(sr_now[k], success_rate.v, step);
+            }
+            std::swap(gain_now, gain_next);
+            std::swap(df_now, df_next);
+            std::swap(sr_now, sr_next);
+        }
+        bool success = upgrade_time ? gain_next[0].v > Rule<R>::DOGFOOD_LOSS[current_upgrade] : sr_next[0].v > 0;
+        return std::make_tuple(success, gain_next[0], df_next[0], sr_next[0]);
+    }
+
+    // calc_dual of artifact, sub scores are parameters of their sub types.
+    // artifacts which have less subs sum over new subs as calc does.
+    template <class R = DATA::RULES_5STAR>
+    std::tuple<bool, DualCost, DualCost, DualCost> calc_dual(const DATA::PackedArtifact& art, const std::map<DATA::AFFIX_NAMES, double>& sub_scores,
+        const DualCost& score_bar, const DualCost& gain, const SmoothWidth& width = SmoothWidth()) {
+        if (art.sub_number() < R::AFFIX_NUM) {
+            DATA::get_weight_from_distribution(art.sub_number() - art.level(), R::INITIAL_AFFIX_NUM_WEIGHT);
+            auto current_art = art;
+            current_art.set_level(art.level() + 1);
+            int used = 0;
+            for (int i = 0; i < art.sub_number(); i++)
+                used |= DATA::SUB_BIT[static_cast<int>(art.sub_type(i))];
+            auto& sub_dist = DATA::sub_cumulative(art.main(), used);
+            double sub_weight_sum = sub_dist.sum() * (R::AFFIX_UPDATE_MAX - R::AFFIX_UPDATE_MIN + 1);
+            DualCost e_gain, e_df_cost, success_rate;
+            for (int ti = 0; ti < DATA::SUB_TYPES; ti++) {
+                int w = sub_dist.at(ti);
+                if (!w) continue;
+                for (int i = R::AFFIX_UPDATE_MIN; i <= R::AFFIX_UPDATE_MAX; i++) {
+                    current_art.push_sub(DATA::SUB_PROB_WEIGHT_TABLE[ti].first, i);
+                    auto [t_success, t_e_gain, t_e_df_cost, t_success_rate] = calc_dual<R>(current_art, sub_scores, score_bar, gain, width);
+                    e_gain += t_e_gain * w;
+                    e_df_cost += t_e_df_cost * w;
+                    success_rate += t_success_rate * w;
+                    current_art.pop_sub();
+                }
+            }
+            e_gain /= sub_weight_sum;
+            e_df_cost /= sub_weight_sum;
+            success_rate /= sub_weight_sum;
+            double loss = Rule<R>::DOGFOOD_LOSS[art.level()];
+            bool upgrade = e_gain.v > loss;
+            auto step = smoothed_step(e_gain - loss, width.gain * std::max(1., std::abs(gain.v)));
+            DualCost res_gain = upgrade ? e_gain : DualCost(loss), res_df_cost = upgrade ? e_df_cost : DualCost(-loss),
+                res_success_rate = upgrade ? success_rate : DualCost(0);
+            add_jump(res_gain, e_gain.v - loss, step);
+            add_jump(res_df_cost, e_df_cost.v + loss, step);
+            add_jump(res_success_rate, success_rate.v, step);
+            return std::make_tuple(upgrade, res_gain, res_df_cost, res_success_rate);
+        }
+        std::vector<int> weight;
+        std::vector<DualCost> score;
+        for (int i = 0; i < art.sub_number(); i++) {
+            auto type = art.sub_type(i);
+            auto ite = sub_scores.find(type);
+            if (ite == sub_scores.end())
+                throw std::runtime_error("sub not found in sub_scores");
+            int k = 0;
+            while (DATA::SUB_PROB_WEIGHT_TABLE[k].first != type) k++;
+            weight.push_back(art.sub_weight(i));
+            score.push_back(DualCost::variable(ite->second, k));
+        }
+        return calc_dual<R>(weight, score, Rule<R>::N - art.level(), score_bar, gain, width);
+    }
+
+    // outcome of one artifact when it is upgraded by decisions of calc
+    struct OutcomeDistribution {
+        bool upgrade = false; // decision of calc
+        dftype e_gain = 0;
+        double e_df_cost = 0, e_df_cost2 = 0; // first and second moment of dogfood cost
+        std::map<dftype, double> df_cost_pmf; // probability of every dogfood cost
+        double score_bin = 1; // bin i of score_hist is [i * score_bin, (i + 1) * score_bin)
+        std::vector<double> score_hist; // probability of artifact score when upgrading stops
+
+        double df_cost_variance() const {
+            return std::max(0., e_df_cost2 - e_df_cost * e_df_cost);
+        }
+
+        // smallest dogfood cost whose cumulative probability reaches q
+        dftype df_cost_quantile(double q) const {
+            double sum = 0;
+            for (auto& [cost, p] : df_cost_pmf)
+                if ((sum += p) >= q - EPS) return cost;
+            return df_cost_pmf.rbegin()->first;
+        }
+
+        // score quantile, uniform inside bins
+        double score_quantile(double q) const {
+            double sum = 0;
+            for (int i = 0; i < score_hist.size(); i++) {
+                if (score_hist[i] > 0 && sum + score_hist[i] >= q)
+                    return (i + (q - sum) / score_hist[i]) * score_bin;
+                sum += score_hist[i];
+            }
+            return score_hist.size() * score_bin;
+        }
+
+        void add_score(double score, double p) {
+            int bin = std::max(0, int(std::floor(score / score_bin)));
+            if (bin >= score_hist.size()) score_hist.resize(bin + 1);
+            score_hist[bin] += p;
+        }
+
+        // add outcome of another artifact with probability p
+        void add(const OutcomeDistribution& o, double p) {
+            e_gain += o.e_gain * p;
+            e_df_cost += o.e_df_cost * p;
+            e_df_cost2 += o.e_df_cost2 * p;
+            for (auto& [cost, q] : o.df_cost_pmf)
+                df_cost_pmf[cost] += q * p;
+            if (o.score_hist.size() > score_hist.size()) score_hist.resize(o.score_hist.size());
+            for (int i = 0; i < o.score_hist.size(); i++)
+                score_hist[i] += o.score_hist[i] * p;
+        }
+    };
+
+    /*
+    calc with distribution of outcome. backward sweep is same as calc_profiles
+    with one profile, and also carries second moment of dogfood cost and keeps
+    decisions of every state. forward sweep then spreads probability from
+    initial state along upgraded states, and collects dogfood cost and score of
+    every state where upgrading stops.
+    */
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    OutcomeDistribution calc_outcome(const std::vector<int>& weight, const std::vector<double>& score, int upgrade_time,
+        double score_bar, dftype gain, double score_bin = 1) {
+        const int ROUTES = CellChildren<R>::ROUTES;
+        CellChildren<R>::init();
+        if (weight.size() != R::AFFIX_NUM || score.size() != R::AFFIX_NUM)
+            throw std::runtime_error("w or s size not equal to AFFIX_NUM");
+        auto current_upgrade = Rule<R>::N - upgrade_time;
+        S SCORE[R::AFFIX_NUM], SCORE_BAR = to_score<S>(score_bar);
+        double base_score = 0;
+        for (int i = 0; i < R::AFFIX_NUM; i++) {
+            SCORE[i] = to_score<S>(score[i]);
+            SCORE_BAR -= weight[i] * SCORE[i];
+            base_score += weight[i] * score[i];
+        }
+        auto status_score = [&](int status) {
+            S res = 0;
+            for (int a = 0; a < R::AFFIX_NUM; a++, status /= BASE)
+                res += (status % BASE) * SCORE[a];
+            return res;
+        };
+        OutcomeDistribution res;
+        res.score_bin = score_bin;
+        // e_gain, e_df_cost, e_df_cost ^ 2 of states, and decisions of all levels
+        std::vector<std::vector<char>> upgrade(upgrade_time + 1);
+        std::vector<V> gain_now, gain_next, df_now, df_next;
+        std::vector<double> df2_now, df2_next;
+        for (int i = upgrade_time; i >= 0; i--) {
+            auto& cell = Rule<R>::cell[i];
+            V loss = Rule<R>::DOGFOOD_LOSS[current_upgrade + i];
+            gain_now.resize(cell.size());
+            df_now.resize(cell.size());
+            df2_now.resize(cell.size());
+            upgrade[i].assign(cell.size(), 0);
+            for (int k = 0; k < cell.size(); k++) {
+                if (i == upgrade_time) {
+                    bool success = !(status_score(cell[k].first) < SCORE_BAR - EPS);
+                    gain_now[k] = success ? V(gain) : loss;
+                    df_now[k] = success ? V(Rule<R>::SUCCESS_DOGFOOD_COST) : -loss;
+                    df2_now[k] = double(df_now[k]) * df_now[k];
+                    upgrade[i][k] = success;
+                    continue;
+                }
+                V e_gain = 0, e_df_cost = 0;
+                double e_df_cost2 = 0;
+                auto* child = &CellChildren<R>::child[i][k * ROUTES];
+                for (int r = 0; r < ROUTES; r++) {
+                    e_gain += gain_next[child[r]];
+                    e_df_cost += df_next[child[r]];
+                    e_df_cost2 += df2_next[child[r]];
+                }
+                e_gain /= ROUTES;
+                e_df_cost /= ROUTES;
+                e_df_cost2 /= ROUTES;
+                upgrade[i][k] = e_gain > loss;
+                gain_now[k] = upgrade[i][k] ? e_gain : loss;
+                df_now[k] = upgrade[i][k] ? e_df_cost : -loss;
+                df2_now[k] = upgrade[i][k] ? e_df_cost2 : double(loss) * loss;
+            }
+            std::swap(gain_now, gain_next);
+            std::swap(df_now, df_next);
+            std::swap(df2_now, df2_next);
+        }
+        // at full level calc reports success, otherwise whether to upgrade
+        res.upgrade = upgrade[0][0];
+        res.e_gain = gain_next[0];
+        res.e_df_cost = df_next[0];
+        res.e_df_cost2 = df2_next[0];
+        std::vector<double> prob_now(1, 1), prob_next;
+        for (int i = 0; i <= upgrade_time; i++) {
+            auto& cell = Rule<R>::cell[i];
+            dftype loss = Rule<R>::DOGFOOD_LOSS[current_upgrade + i];
+            prob_next.assign(i < upgrade_time ? Rule<R>::cell[i + 1].size() : 0, 0);
+            for (int k = 0; k < cell.size(); k++) {
+                double p = prob_now[k];
+                if (!p) continue;
+                if (i < upgrade_time && upgrade[i][k]) {
+                    auto* child = &CellChildren<R>::child[i][k * ROUTES];
+                    for (int r = 0; r < ROUTES; r++)
+                        prob_next[child[r]] += p / ROUTES;
+                    continue;
+                }
+                S current = status_score(cell[k].first);
+                bool success = i == upgrade_time && !(current < SCORE_BAR - EPS);
+                res.df_cost_pmf[success ? dftype(Rule<R>::SUCCESS_DOGFOOD_COST) : -loss] += p;
+                res.add_score(base_score + double(current) / SCORE_MULTIPLIER<S>, p);
+            }
+            std::swap(prob_now, prob_next);
+        }
+        return res;
+    }
+
+    // calc_outcome of artifact, artifacts which have less subs mix outcomes of
+    // new subs as calc does.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    OutcomeDistribution calc_outcome(const DATA::PackedArtifact& art, const std::map<DATA::AFFIX_NAMES, double>& sub_scores,
+        double score_bar, dftype gain, double score_bin = 1) {
+        std::vector<double> score;
+        select_sub_score(art, sub_scores, score);
+        if (art.sub_number() < R::AFFIX_NUM) {
+            DATA::get_weight_from_distribution(art.sub_number() - art.level(), R::INITIAL_AFFIX_NUM_WEIGHT);
+            auto current_art = art;
+            current_art.set_level(art.level() + 1);
+            int used = 0;
+            for (int i = 0; i < art.sub_number(); i++)
+                used |= DATA::SUB_BIT[static_cast<int>(art.sub_type(i))];
+            auto& sub_dist = DATA::sub_cumulative(art.main(), used);
+            double sub_weight_sum = sub_dist.sum() * (R::AFFIX_UPDATE_MAX - R::AFFIX_UPDATE_MIN + 1);
+            OutcomeDistribution res;
+            res.score_bin = score_bin;
+            for (int ti = 0; ti < DATA::SUB_TYPES; ti++) {
+                int w = sub_dist.at(ti);
+                if (!w) continue;
+                for (int i = R::AFFIX_UPDATE_MIN; i <= R::AFFIX_UPDATE_MAX; i++) {
+                    current_art.push_sub(DATA::SUB_PROB_WEIGHT_TABLE[ti].first, i);
+                    res.add(calc_outcome<V, S, R>(current_art, sub_scores, score_bar, gain, score_bin), w / sub_weight_sum);
+                    current_art.pop_sub();
+                }
+            }
+            dftype loss = Rule<R>::DOGFOOD_LOSS[art.level()];
+            res.upgrade = res.e_gain > loss;
+            if (!res.upgrade) {
+                double current = 0;
+                for (int i = 0; i < art.sub_number(); i++)
+                    current += art.sub_weight(i) * score[i];
+                res = OutcomeDistribution();
+                res.score_bin = score_bin;
+                res.e_gain = loss;
+                res.e_df_cost = -loss;
+                res.e_df_cost2 = loss * loss;
+                res.df_cost_pmf[-loss] = 1;
+                res.add_score(current, 1);
+            }
+            return res;
+        }
+        std::vector<int> weight;
+        for (int i = 0; i < art.sub_number(); i++)
+            weight.push_back(art.sub_weight(i));
+        return calc_outcome<V, S, R>(weight, score, Rule<R>::N - art.level(), score_bar, gain, score_bin);
+    }
+
+    // output cell data into yaml. key1=N, key2=second, [list of first]
+    void output_yaml() {
+        init();
+        // std::vector<std::map<int, int>> res;
+        for (int n = 1; n <= N; n++) {
+            // std::cout << n << ' ' << m.size() << ' ' << (1 << (4 * n)) 
+            //           << std::endl;
+            // for (auto i : m)
+            //     std::cout << i.first << ' ' << i.second << std::endl;
+            std::map<int, std::vector<int>> mm;
+            for (auto& [status, count] : cell[n])
+                mm[count] = std::vector<int>();
+            for (auto& [status, count] : cell[n])
+                mm[count].push_back(status);
+            mm[0] = { 1 << (DATA::AFFIX_NUM * n) }; // here save enumerate number
+            std::cout << n << ": \n";
+            for (auto& [status, count] : mm) {
+                std::cout << "  " << status << ": [ ";
+                for (auto j : count)
+                    std::cout << j << ',';
+                std::cout << "]\n";
+            }
+        }
+    }
+
+    void test_one_artifact(bool output_result = true, bool debug = false) {
+        current_engine().debug = debug;
+        std::vector<double> s = { 0, 0, 1, 1 };
+        std::vector<int> w = { 7, 9, 9, 10 };
+        int upgrade_time = 5;
+        dftype input_gain = 100000;
+        double score_bar = 51;
+        auto r = calc(w, s, upgrade_time, score_bar, input_gain);
+        auto& [do_upgrade, gain, dogfood_cost, success_rate, score_gain] = r;
+        if (output_result) {
+            std::cout << format("upgrade? {}\nexpected gain {}\ndogfood cost {}\nsuccess rate above bar {}\nexpected better score if success {}\n", do_upgrade, gain, dogfood_cost, success_rate, score_gain);
+            std::cout << do_upgrade << ' ' << gain << ' ' << dogfood_cost << ' '
+                << success_rate << ' ' << score_gain << std::endl;
+        }
+        // std::cout << r.do_upgrade << ' ' << r.dogfood_cost << ' ' 
+        //           << r.success_rate << ' ' << r.score_gain << std::endl;
+    }
+
+    auto test_sub_score(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype gain, double randnum = -1) {
+        if (randnum < 0)
+            randnum = DATA::rand();
+        auto art = DATA::get_packed_drop(randnum);
+        return calc(art, sub_scores, score_bar, gain);
+    }
+
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    dftype get_expected_dfcost(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, const std::vector<std::pair<DATA::PackedArtifact, double>>& allart, dftype gain) {
+        std::vector<std::vector<std::pair<double, double>>> results;
+        results.resize(allart.size());
+        // worker threads do not inherit binding of calling thread
+        auto& engine = current_engine();
+        // double results = 0;
+#pragma omp parallel for
+        for (int i = 0; i < allart.size(); i++) {
+            EngineScope scope(engine);
+            // TODO enumerate sub weight
+            auto [art, rate] = allart[i];
+            for (auto i = art.sub_number(); i--; ) rate /= R::AFFIX_UPDATE_MAX - R::AFFIX_UPDATE_MIN + 1;
+            while (1) {
+                bool addflag = false;
+                for (int i = 0; i < art.sub_number(); i++)
+                    if (art.sub_weight(i) == R::AFFIX_UPDATE_MAX) art.set_sub_weight(i, R::AFFIX_UPDATE_MIN);
+                    else {
+                        art.set_sub_weight(i, art.sub_weight(i) + 1);
+                        addflag = true;
+                        break;
+                    }
+                if (!addflag) break;
+                auto [success, e_gain, e_df_cost, success_rate, e_score_gain] = calc<V, S, R>(art, sub_scores, score_bar, gain);
+                results[i].push_back({ e_df_cost, rate });
+            }
+            if (engine.find_gain_debug && i % 10 == 0) std::cout << "art number " << i << '/' << allart.size() << "\r";
+            // std::cout << format("{} {} {} {} {} {}\n", rate, success, e_gain, e_df_cost, success_rate, e_score_gain);
+        }
+        double final_result = 0;
+        for (auto& result : results)
+            for (auto& [i, j] : result)
+                final_result += i * j;
+        if (engine.find_gain_debug) std::cout << "gain " << gain << " exp_df_cost " << final_result << std::endl;
+        return final_result;
+    }
+
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    dftype get_expected_dfcost(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, const std::vector<std::pair<DATA::Artifact, double>>& allart, dftype gain) {
+        std::vector<std::pair<DATA::PackedArtifact, double>> packed;
+        for (auto& [art, rate] : allart)
+            packed.push_back({ DATA::PackedArtifact(art), rate });
+        return get_expected_dfcost<V, S, R>(sub_scores, score_bar, packed, gain);
+    }
+
+    // catalogs of many sets merged by main and subs. calc does not read set,
+    // so artifact in several sets is calculated once. order[j] lists (entry,
+    // rate) in order of get_all_packed_artifacts_with_probs(sets[j]).
+    struct MergedCatalog {
+        std::vector<DATA::SET_NAMES> sets;
+        std::vector<DATA::PackedArtifact> art; // set of entries is cleared
+        std::vector<std::vector<std::pair<int, double>>> order;
+    };
+
+    template <class R = DATA::RULES_5STAR>
+    MergedCatalog merge_catalogs(const std::vector<DATA::SET_NAMES>& sets) {
+        MergedCatalog res;
+        res.sets = sets;
+        std::unordered_map<uint64_t, int> index;
+        for (auto set : sets) {
+            res.order.emplace_back();
+            for (auto& [art, rate] : DATA::get_all_packed_artifacts_with_probs<R>(set)) {
+                auto key = art;
+                key.put(0, 3, 0);
+                auto [ite, added] = index.emplace(key.code, res.art.size());
+                if (added) res.art.push_back(key);
+                res.order.back().push_back({ ite->second, rate });
+            }
+        }
+        return res;
+    }
+
+    // get_expected_dfcost of every set of catalog in one pass, sets[j] at
+    // gains[j]. every merged entry runs once per distinct gain of its sets,
+    // and every set sums in its own order, so results equal get_expected_dfcost.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    std::vector<dftype> get_expected_dfcost(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, const MergedCatalog& catalog,
+        const std::vector<dftype>& gains) {
+        if (gains.size() != catalog.sets.size())
+            throw std::runtime_error("gain number not equal to set number");
+        std::vector<dftype> distinct(gains);
+        std::sort(distinct.begin(), distinct.end());
+        distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+        std::vector<int> gain_index;
+        for (auto gain : gains)
+            gain_index.push_back(std::lower_bound(distinct.begin(), distinct.end(), gain) - distinct.begin());
+        // task of every used (entry, gain)
+        std::vector<int> task(catalog.art.size() * distinct.size(), -1);
+        std::vector<std::pair<int, int>> tasks;
+        for (int j = 0; j < catalog.order.size(); j++)
+            for (auto& [entry, rate] : catalog.order[j]) {
+                auto& t = task[entry * distinct.size() + gain_index[j]];
+                if (t < 0) {
+                    t = tasks.size();
+                    tasks.push_back({ entry, gain_index[j] });
+                }
+            }
+        std::vector<std::vector<double>> results(tasks.size());
+        auto& engine = current_engine();
+#pragma omp parallel for
+        for (int i = 0; i < tasks.size(); i++) {
+            EngineScope scope(engine);
+            auto art = catalog.art[tasks[i].first];
+            auto gain = distinct[tasks[i].second];
+            while (1) {
+                bool addflag = false;
+                for (int i = 0; i < art.sub_number(); i++)
+                    if (art.sub_weight(i) == R::AFFIX_UPDATE_MAX) art.set_sub_weight(i, R::AFFIX_UPDATE_MIN);
+                    else {
+                        art.set_sub_weight(i, art.sub_weight(i) + 1);
+                        addflag = true;
+                        break;
+                    }
+                if (!addflag) break;
+                results[i].push_back(std::get<2>(calc<V, S, R>(art, sub_scores, score_bar, gain)));
+            }
+        }
+        std::vector<dftype> res;
+        for (int j = 0; j < catalog.order.size(); j++) {
+            double final_result = 0;
+            for (auto& [entry, art_rate] : catalog.order[j]) {
+                auto rate = art_rate;
+                for (auto i = catalog.art[entry].sub_number(); i--; ) rate /= R::AFFIX_UPDATE_MAX - R::AFFIX_UPDATE_MIN + 1;
+                for (auto e_df_cost : results[task[entry * distinct.size() + gain_index[j]]])
+                    final_result += e_df_cost * rate;
+            }
+            if (engine.find_gain_debug) std::cout << "set " << j << " gain " << gains[j] << " exp_df_cost " << final_result << std::endl;
+            res.push_back(final_result);
+        }
+        return res;
+    }
+
+    // estimate of get_expected_dfcost
+    struct DfcostEstimate {
+        dftype value = 0;
+        dftype half_width = 0; // of confidence interval
+        int samples = 0;
+    };
+
+    /*
+    sampled get_expected_dfcost. catalog is split into strata of set, main and
+    sub number. in a stratum, artifact is sampled by its rate and weights
+    uniformly from combinations get_expected_dfcost enumerates, so samples
+    average to mean of stratum, which times rate sum of stratum is its part
+    of result. after pilot samples of every stratum, samples are added to
+    strata by rate times standard deviation, until half width of confidence
+    interval of z is within relative_error of value after min_samples, or
+    max_samples is used. strata of rare success may look constant in few
+    samples, so before min_samples constant strata still get samples by rate.
+    if target is not NaN, error is relative to it as well, and sampling also
+    stops when interval excludes target, which is all bisection needs.
+    every stratum draws from its own generator of seed, so estimates of
+    different gains start from same samples. sample numbers follow variance
+    at each gain, so estimates are not monotone in gain as exact one is.
+    */
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    DfcostEstimate get_expected_dfcost_sampled(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar,
+        const std::vector<std::pair<DATA::PackedArtifact, double>>& allart, dftype gain, double relative_error = 0.01,
+        dftype target = std::nan(""), double z = 1.96, int max_samples = 100000, unsigned seed = 0, int pilot = 8, int min_samples = 1000) {
+        const int W = R::AFFIX_UPDATE_MAX - R::AFFIX_UPDATE_MIN + 1;
+        struct Stratum {
+            std::vector<int> member;
+            std::vector<double> accumulated; // accumulated rate of members
+            std::mt19937 generator;
+            int n = 0;
+            double sum = 0, sum2 = 0;
+            double mass() const { return accumulated.back(); }
+            double mean() const { return sum / n; }
+            double variance() const { return n > 1 ? std::max(0., (sum2 - sum * sum / n) / (n - 1)) : 0; }
+        };
+        std::vector<Stratum> strata;
+        std::map<std::tuple<DATA::SET_NAMES, DATA::AFFIX_NAMES, int>, int> index;
+        for (int i = 0; i < allart.size(); i++) {
+            auto& [art, rate] = allart[i];
+            auto [ite, added] = index.emplace(std::make_tuple(art.set(), art.main(), art.sub_number()), strata.size());
+            if (added) {
+                strata.emplace_back();
+                strata.back().generator.seed(seed + 7919 * ite->second);
+            }
+            auto& stratum = strata[ite->second];
+            stratum.member.push_back(i);
+            stratum.accumulated.push_back(rate + (stratum.accumulated.size() ? stratum.accumulated.back() : 0));
+        }
+        DfcostEstimate res;
+        auto& engine = current_engine();
+        std::vector<std::pair<int, int>> want(strata.size());
+        for (int h = 0; h < strata.size(); h++)
+            want[h] = { h, pilot };
+        while (true) {
+            // draw samples in order of strata, then calc them in parallel
+            std::vector<std::pair<int, DATA::PackedArtifact>> batch;
+            for (auto [h, number] : want) {
+                auto& stratum = strata[h];
+                for (int k = 0; k < number; k++) {
+                    double r = std::uniform_real_distribution<double>(0, stratum.mass())(stratum.generator);
+                    int m = std::upper_bound(stratum.accumulated.begin(), stratum.accumulated.end(), r) - stratum.accumulated.begin();
+                    auto art = allart[stratum.member[std::min(m, int(stratum.member.size()) - 1)]].first;
+                    int combinations = 1;
+                    for (int i = 0; i < art.sub_number(); i++) combinations *= W;
+                    // combination 0 is all AFFIX_UPDATE_MIN, which is not enumerated
+                    int c = std::uniform_int_distribution<int>(1, combinations - 1)(stratum.generator);
+                    for (int i = 0; i < art.sub_number(); i++, c /= W)
+                        art.set_sub_weight(i, R::AFFIX_UPDATE_MIN + c % W);
+                    batch.push_back({ h, art });
+                }
+            }
+            std::vector<double> value(batch.size());
+#pragma omp parallel for
+            for (int i = 0; i < batch.size(); i++) {
+                EngineScope scope(engine);
+                auto& art = batch[i].second;
+                double combinations = 1;
+                for (int k = 0; k < art.sub_number(); k++) combinations *= W;
+                value[i] = std::get<2>(calc<V, S, R>(art, sub_scores, score_bar, gain)) * (combinations - 1) / combinations;
+            }
+            for (int i = 0; i < batch.size(); i++) {
+                auto& stratum = strata[batch[i].first];
+                stratum.n++;
+                stratum.sum += value[i];
+                stratum.sum2 += value[i] * value[i];
+            }
+            res.samples += batch.size();
+            double variance = 0, spread = 0, mass = 0;
+            res.value = 0;
+            for (auto& stratum : strata) {
+                res.value += stratum.mass() * stratum.mean();
+                variance += stratum.mass() * stratum.mass() * stratum.variance() / stratum.n;
+                spread += stratum.mass() * std::sqrt(stratum.variance());
+                mass += stratum.mass();
+            }
+            res.half_width = z * std::sqrt(variance);
+            bool enough = res.samples >= min_samples;
+            double scale = std::isnan(target) ? std::abs(res.value) : std::max(std::abs(res.value), std::abs(target));
+            bool precise = res.half_width <= relative_error * scale || spread == 0 || std::abs(res.value - target) > res.half_width;
+            if ((enough && precise) || res.samples >= max_samples)
+                break;
+            // double samples, divided by Neyman allocation, and by rate before min_samples
+            int total = std::min(res.samples, max_samples - res.samples);
+            want.clear();
+            for (int h = 0; h < strata.size(); h++) {
+                double share = spread > 0 ? strata[h].mass() * std::sqrt(strata[h].variance()) / spread : 0;
+                if (!enough) share = (share + strata[h].mass() / mass) / 2;
+                int number = std::round(total * share);
+                if (number) want.push_back({ h, number });
+            }
+            if (want.empty()) break;
+        }
+        if (engine.find_gain_debug) std::cout << "gain " << gain << " sampled exp_df_cost " << res.value << " +- " << res.half_width << std::endl;
+        return res;
+    }
+
+    // 变量：score bar, score map, set (including all set), dfcost。目标：找到给定dfcost的gain设置
+    // max_gain 最大可能价值，gain_accuracy二分到什么精度。一般不需要动
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    dftype find_gain(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost,
+        const std::vector<std::pair<DATA::PackedArtifact, double>>& allart, dftype max_gain = 100000000, dftype gain_precision = 1,
+        int* evaluations = nullptr) {
+        dftype min_gain = -Rule<R>::SUCCESS_DOGFOOD_COST;
+        if (evaluations) *evaluations = 0;
+        // result drops in [min_gain, max_gain)
+        while (max_gain - min_gain > gain_precision) {
+            auto mid = (max_gain + min_gain) / 2;
+            if (evaluations) ++*evaluations;
+            if (current_engine().find_gain_debug) std::cout << "current L M R " << min_gain << ' ' << mid << ' ' << max_gain << std::endl;
+            if (get_expected_dfcost<V, S, R>(sub_scores, score_bar, allart, mid) > dfcost)  max_gain = mid;
+            else min_gain = mid;
+        }
+        return (max_gain + min_gain) / 2;
+    }
+
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    dftype find_gain(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost, DATA::SET_NAMES set = DATA::SET_NAMES::end,
+        dftype max_gain = 100000000, dftype gain_precision = 1) {
+        // const std::vector<std::pair<DATA::Artifact, double>> &allart = set == DATA::SET_NAMES::end ? DATA::all_artifacts_accumulated : DATA::all_artifacts_accumulated_divided_by_set[set];
+        return find_gain<V, S, R>(sub_scores, score_bar, dfcost, DATA::get_all_packed_artifacts_with_probs<R>(set), max_gain, gain_precision);
+    }
+
+    // find_gain starting from bracket [low, high) proposed by caller. both ends
+    // are checked first, and an end on wrong side becomes the other end while
+    // bracket grows outward with doubling width, until it holds the result or
+    // reaches [-SUCCESS_DOGFOOD_COST, max_gain). fallbacks counts widenings.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    dftype find_gain_in_bracket(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost,
+        const std::vector<std::pair<DATA::PackedArtifact, double>>& allart, dftype low, dftype high,
+        dftype max_gain = 100000000, dftype gain_precision = 1, int* evaluations = nullptr, int* fallbacks = nullptr) {
+        dftype min_gain = -Rule<R>::SUCCESS_DOGFOOD_COST;
+        int evaluation = 0, fallback = 0;
+        auto above = [&](dftype gain) {
+            evaluation++;
+            return get_expected_dfcost<V, S, R>(sub_scores, score_bar, allart, gain) > dfcost;
+        };
+        low = std::max(low, min_gain);
+        high = std::min(high, max_gain);
+        if (high - low < gain_precision) high = std::min(low + gain_precision, max_gain);
+        dftype width = std::max(high - low, gain_precision);
+        // low is below result unless it is min_gain, high is above unless it is max_gain
+        while (low > min_gain && above(low)) {
+            fallback++;
+            high = low;
+            low = std::max(low - width, min_gain);
+            width *= 2;
+        }
+        while (high < max_gain && !above(high)) {
+            fallback++;
+            low = high;
+            high = std::min(high + width, max_gain);
+            width *= 2;
+        }
+        while (high - low > gain_precision) {
+            auto mid = (high + low) / 2;
+            if (above(mid)) high = mid;
+            else low = mid;
+        }
+        if (evaluations) *evaluations = evaluation;
+        if (fallbacks) *fallbacks = fallback;
+        return (high + low) / 2;
+    }
+
+    /*
+    find_gain seeded by predicted gain, such as nnresult of surrogate. bracket
+    starts at [predicted / ratio, predicted * ratio] with ratio 1 + spread, and
+    an end on wrong side moves out with ratio squared until dfcost - target
+    flips sign, or until it reaches -SUCCESS_DOGFOOD_COST or max_gain. bracket
+    is then refined by ITP method, which steps near regula falsi point of both
+    ends but keeps worst case of bisection, so result is within gain_precision
+    of crossing as find_gain. plain find_gain is used if predicted is not positive.
+    */
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    dftype find_gain_seeded(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost,
+        const std::vector<std::pair<DATA::PackedArtifact, double>>& allart, dftype predicted, double spread = 0.1,
+        dftype max_gain = 100000000, dftype gain_precision = 1, int* evaluations = nullptr) {
+        if (!(predicted > 0))
+            return find_gain<V, S, R>(sub_scores, score_bar, dfcost, allart, max_gain, gain_precision, evaluations);
+        dftype min_gain = -Rule<R>::SUCCESS_DOGFOOD_COST;
+        int evaluation = 0;
+        auto excess = [&](dftype gain) {
+            evaluation++;
+            return get_expected_dfcost<V, S, R>(sub_scores, score_bar, allart, gain) - dfcost;
+        };
+        double ratio = 1 + spread;
+        predicted = std::min(predicted, max_gain / ratio);
+        dftype low = predicted / ratio, high = predicted * ratio;
+        // excess of ends, NaN when end is min_gain or max_gain and not evaluated
+        dftype f_low = std::nan(""), f_high = std::nan("");
+        if (low < gain_precision) low = min_gain;
+        while (low > min_gain) {
+            f_low = excess(low);
+            if (f_low <= 0) break;
+            high = low, f_high = f_low;
+            ratio *= ratio;
+            low = predicted / ratio;
+            if (low < gain_precision) low = min_gain, f_low = std::nan("");
+        }
+        while (high < max_gain) {
+            if (std::isnan(f_high)) f_high = excess(high);
+            if (f_high > 0) break;
+            low = high, f_low = f_high;
+            ratio *= ratio;
+            high = std::min(predicted * ratio, max_gain);
+            f_high = std::nan("");
+        }
+        // ITP with k1 = 0.2 / width, k2 = 2 and n0 = 1
+        dftype width = high - low;
+        double k1 = 0.2 / width;
+        int n_max = std::ceil(std::log2(std::max(width / gain_precision, 1.))) + 1;
+        for (int j = 0; high - low > gain_precision; j++) {
+            dftype half = (low + high) / 2, x = half;
+            if (!std::isnan(f_low) && !std::isnan(f_high)) {
+                dftype r = gain_precision / 2 * std::pow(2., n_max - j) - (high - low) / 2;
+                dftype regula = (f_high * low - f_low * high) / (f_high - f_low);
+                dftype delta = k1 * (high - low) * (high - low);
+                dftype sigma = half > regula ? 1 : -1;
+                dftype t = delta <= std::abs(half - regula) ? regula + sigma * delta : half;
+                x = std::abs(t - half) <= r ? t : half - sigma * r;
+            }
+            auto f = excess(x);
+            if (f > 0) high = x, f_high = f;
+            else low = x, f_low = f;
+        }
+        if (evaluations) *evaluations = evaluation;
+        return (high + low) / 2;
+    }
+
+    // one solved find_gain query
+    struct SolvedQuery {
+        std::map<DATA::AFFIX_NAMES, double> sub_scores;
+        double score_bar = 0;
+        dftype dfcost = 0;
+        DATA::SET_NAMES set = DATA::SET_NAMES::end;
+        dftype gain = 0;
+        dftype prediction = std::nan(""); // nnresult of surrogate, NaN if absent
+    };
+
+    // read generated data, one query a line as 'hp:0.1 ... cd:1 bar:30 cost:12000
+    // set:flower result:20000 nnresult:19000', other fields are skipped.
+    // lines without set, or without result when it is required, are skipped.
+    std::vector<SolvedQuery> read_solved_queries(const std::string& filename, bool require_result = true) {
+        std::vector<SolvedQuery> res;
+        std::ifstream input(filename, std::ios::in);
+        std::string line;
+        while (std::getline(input, line)) {
+            SolvedQuery query;
+            bool has_set = false, has_result = false;
+            std::istringstream sin(line);
+            std::string ones;
+            while (sin >> ones) {
+                auto colon = ones.find(":");
+                if (colon == std::string::npos) break;
+                auto name = ones.substr(0, colon), value = ones.substr(colon + 1);
+                if (name == "bar") query.score_bar = std::stod(value);
+                else if (name == "cost") query.dfcost = std::stod(value);
+                else if (name == "result") query.gain = std::stod(value), has_result = true;
+                else if (name == "nnresult") query.prediction = std::stod(value);
+                else if (name == "set") {
+                    auto ite = DATA::string_to_set_names.find(value);
+                    if (ite == DATA::string_to_set_names.end()) break;
+                    query.set = ite->second;
+                    has_set = true;
+                }
+                else {
+                    auto ite = DATA::string_to_affix_names.find(name);
+                    if (ite != DATA::string_to_affix_names.end()) query.sub_scores[ite->second] = std::stod(value);
+                }
+            }
+            if (has_set && (has_result || !require_result)) res.push_back(std::move(query));
+        }
+        return res;
+    }
+
+    /*
+    kd-tree over solved queries, one tree each set, to propose a bracket for
+    find_gain_in_bracket. point is sub scores in SUB_PROB_WEIGHT_TABLE order,
+    bar / 10 and log2(dfcost), so 10 bar or doubled dfcost weighs as a full
+    sub score. bracket is [min, max] of gains of nearest queries, widened by
+    BRACKET_MARGIN times.
+    */
+    class GainIndex {
+    public:
+        static constexpr int DIM = DATA::SUB_TYPES + 2;
+        static constexpr double BRACKET_MARGIN = 1.5;
+        typedef std::array<double, DIM> Point;
+
+        static Point to_point(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost) {
+            Point res;
+            for (int i = 0; i < DATA::SUB_TYPES; i++) {
+                auto ite = sub_scores.find(DATA::SUB_PROB_WEIGHT_TABLE[i].first);
+                res[i] = ite == sub_scores.end() ? 0 : ite->second;
+            }
+            res[DATA::SUB_TYPES] = score_bar / 10;
+            res[DATA::SUB_TYPES + 1] = std::log2(std::max(dfcost, (dftype)1));
+            return res;
+        }
+
+        void add(const SolvedQuery& query) {
+            trees[query.set].points.push_back({ to_point(query.sub_scores, query.score_bar, query.dfcost), query.gain });
+            built = false;
+        }
+
+        // add all queries of file, return number added
+        int load(const std::string& filename) {
+            auto queries = read_solved_queries(filename);
+            for (auto& query : queries) add(query);
+            return queries.size();
+        }
+
+        size_t size() const {
+            size_t res = 0;
+            for (auto& [set, tree] : trees) res += tree.points.size();
+            return res;
+        }
+
+        // gains of k nearest queries of same set, nearest first
+        std::vector<dftype> nearest(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost,
+            DATA::SET_NAMES set, int k = 8) {
+            build();
+            std::vector<dftype> res;
+            auto ite = trees.find(set);
+            if (ite == trees.end() || ite->second.points.empty()) return res;
+            auto& tree = ite->second;
+            std::priority_queue<std::pair<double, int>> heap; // distance, point, farthest on top
+            tree.search(0, tree.points.size(), to_point(sub_scores, score_bar, dfcost), k, heap);
+            while (heap.size()) {
+                res.push_back(tree.points[heap.top().second].second);
+                heap.pop();
+            }
+            std::reverse(res.begin(), res.end());
+            return res;
+        }
+
+        // proposed [low, high), empty when no query of the set
+        std::optional<std::pair<dftype, dftype>> bracket(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar,
+            dftype dfcost, DATA::SET_NAMES set, int k = 8) {
+            auto gains = nearest(sub_scores, score_bar, dfcost, set, k);
+            if (gains.empty()) return std::nullopt;
+            auto [low, high] = std::minmax_element(gains.begin(), gains.end());
+            return std::make_pair(*low > 0 ? *low / BRACKET_MARGIN : *low * BRACKET_MARGIN,
+                *high > 0 ? *high * BRACKET_MARGIN : *high / BRACKET_MARGIN);
+        }
+
+    private:
+        struct Tree {
+            // points of [l, r) form a subtree, median at (l + r) / 2 splits it by dimension split
+            std::vector<std::pair<Point, dftype>> points;
+            std::vector<int> split;
+
+            void build(int l, int r) {
+                if (r - l <= 1) return;
+                int best = 0;
+                double best_spread = -1;
+                for (int d = 0; d < DIM; d++) {
+                    double lo = points[l].first[d], hi = lo;
+                    for (int i = l; i < r; i++) {
+                        lo = std::min(lo, points[i].first[d]);
+                        hi = std::max(hi, points[i].first[d]);
+                    }
+                    if (hi - lo > best_spread) best_spread = hi - lo, best = d;
+                }
+                int mid = (l + r) / 2;
+                std::nth_element(points.begin() + l, points.begin() + mid, points.begin() + r,
+                    [best](auto& x, auto& y) { return x.first[best] < y.first[best]; });
+                split[mid] = best;
+                build(l, mid);
+                build(mid + 1, r);
+            }
+
+            void search(int l, int r, const Point& target, int k, std::priority_queue<std::pair<double, int>>& heap) const {
+                if (l >= r) return;
+                int mid = (l + r) / 2;
+                double dist = 0;
+                for (int d = 0; d < DIM; d++)
+                    dist += (points[mid].first[d] - target[d]) * (points[mid].first[d] - target[d]);
+                if (heap.size() < k) heap.push({ dist, mid });
+                else if (dist < heap.top().first) {
+                    heap.pop();
+                    heap.push({ dist, mid });
+                }
+                if (r - l == 1) return;
+                double diff = target[split[mid]] - points[mid].first[split[mid]];
+                if (diff < 0) search(l, mid, target, k, heap);
+                else search(mid + 1, r, target, k, heap);
+                if (heap.size() < k || diff * diff < heap.top().first) {
+                    if (diff < 0) search(mid + 1, r, target, k, heap);
+                    else search(l, mid, target, k, heap);
+                }
+            }
+        };
+
+        std::map<DATA::SET_NAMES, Tree> trees;
+        bool built = true;
+
+        void build() {
+            if (built) return;
+            for (auto& [set, tree] : trees) {
+                tree.split.assign(tree.points.size(), 0);
+                tree.build(0, tree.points.size());
+            }
+            built = true;
+        }
+    };
+
+    // find_gain warm started by bracket of index, or full range when index has
+    // no query of the set.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    dftype find_gain_indexed(GainIndex& index, const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost,
+        const std::vector<std::pair<DATA::PackedArtifact, double>>& allart, DATA::SET_NAMES set, dftype max_gain = 100000000,
+        dftype gain_precision = 1, int* evaluations = nullptr, int* fallbacks = nullptr) {
+        auto bracket = index.bracket(sub_scores, score_bar, dfcost, set);
+        if (!bracket) {
+            if (fallbacks) *fallbacks = 0;
+            return find_gain<V, S, R>(sub_scores, score_bar, dfcost, allart, max_gain, gain_precision, evaluations);
+        }
+        return find_gain_in_bracket<V, S, R>(sub_scores, score_bar, dfcost, allart, bracket->first, bracket->second,
+            max_gain, gain_precision, evaluations, fallbacks);
+    }
+
+    // get_expected_dfcost with derivatives of calc_dual
+    template <class R = DATA::RULES_5STAR>
+    DualCost get_expected_dfcost_dual(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar,
+        const std::vector<std::pair<DATA::PackedArtifact, double>>& allart, dftype gain, const SmoothWidth& width = SmoothWidth()) {
+        std::vector<std::vector<std::pair<DualCost, double>>> results;
+        results.resize(allart.size());
+        auto bar_dual = DualCost::variable(score_bar, DUAL_BAR), gain_dual = DualCost::variable(gain, DUAL_GAIN);
+#pragma omp parallel for
+        for (int i = 0; i < allart.size(); i++) {
+            auto [art, rate] = allart[i];
+            for (auto i = art.sub_number(); i--; ) rate /= R::AFFIX_UPDATE_MAX - R::AFFIX_UPDATE_MIN + 1;
+            while (1) {
+                bool addflag = false;
+                for (int i = 0; i < art.sub_number(); i++)
+                    if (art.sub_weight(i) == R::AFFIX_UPDATE_MAX) art.set_sub_weight(i, R::AFFIX_UPDATE_MIN);
+                    else {
+                        art.set_sub_weight(i, art.sub_weight(i) + 1);
+                        addflag = true;
+                        break;
+                    }
+                if (!addflag) break;
+                auto res = calc_dual<R>(art, sub_scores, bar_dual, gain_dual, width);
+                results[i].push_back({ std::get<2>(res), rate });
+            }
+        }
+        DualCost final_result;
+        for (auto& result : results)
+            for (auto& [i, j] : result)
+                final_result += i * j;
+        return final_result;
+    }
+
+    struct GainDerivative {
+        dftype gain; // result of find_gain
+        DualCost dfcost; // expected dogfood cost at gain, with derivatives
+        std::array<double, DATA::SUB_TYPES> d_sub; // d gain / d sub score, SUB_PROB_WEIGHT_TABLE order
+        double d_bar; // d gain / d score bar
+        double d_dfcost; // d gain / d dfcost
+        SmoothWidth width; // kernel widths derivatives are taken with
+    };
+
+    // times find_gain_derivative widens kernels by 4 when no decision is near
+    const int SMOOTH_WIDEN = 4;
+
+    /*
+    find_gain and its derivatives. gain solves F(gain, scores, bar) = dfcost,
+    so by implicit function theorem d gain / d x = -(dF/dx) / (dF/d gain).
+    exact F is a step function, so these are derivatives of the model with
+    decisions smoothed by SmoothWidth, not of find_gain itself, and their
+    values depend on the widths; test_dual_derivatives finds gradient of F
+    in direction of central differences, in size within a factor of 3. if
+    no decision lies in kernel range and dF/d gain is 0, widths are
+    widened, and derivatives are NaN if that never helps.
+    */
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    GainDerivative find_gain_derivative(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost,
+        DATA::SET_NAMES set = DATA::SET_NAMES::end, const SmoothWidth& width = SmoothWidth(),
+        dftype max_gain = 100000000, dftype gain_precision = 1) {
+        GainDerivative res;
+        auto allart = DATA::get_all_packed_artifacts_with_probs<R>(set);
+        res.gain = find_gain<V, S, R>(sub_scores, score_bar, dfcost, allart, max_gain, gain_precision);
+        res.width = width;
+        for (int k = 0; ; k++) {
+            res.dfcost = get_expected_dfcost_dual<R>(sub_scores, score_bar, allart, res.gain, res.width);
+            if (res.dfcost.d[DUAL_GAIN] > 0 || k == SMOOTH_WIDEN) break;
+            res.width.score *= 4;
+            res.width.gain *= 4;
+        }
+        double d_gain = res.dfcost.d[DUAL_GAIN];
+        if (!(d_gain > 0)) d_gain = std::nan("");
+        for (int i = 0; i < DATA::SUB_TYPES; i++)
+            res.d_sub[i] = -res.dfcost.d[i] / d_gain;
+        res.d_bar = -res.dfcost.d[DUAL_BAR] / d_gain;
+        res.d_dfcost = 1 / d_gain;
+        return res;
+    }
+
+    // find_gain of every set, solved together. sets bisect in lockstep and
+    // every step is one get_expected_dfcost pass over merged catalog, so
+    // artifacts shared by sets are calculated once while their gains agree.
+    // results equal find_gain per set. SET_NAMES::end is the mixed catalog.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    std::vector<dftype> find_gain(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost,
+        const std::vector<DATA::SET_NAMES>& sets, dftype max_gain = 100000000, dftype gain_precision = 1) {
+        auto catalog = merge_catalogs<R>(sets);
+        std::vector<dftype> min_gain(sets.size(), -Rule<R>::SUCCESS_DOGFOOD_COST), max(sets.size(), max_gain), mid(sets.size());
+        // ranges halve together, but rounding may finish a set one step early
+        std::vector<char> active(sets.size(), max_gain + Rule<R>::SUCCESS_DOGFOOD_COST > gain_precision);
+        while (std::count(active.begin(), active.end(), 1)) {
+            for (int j = 0; j < sets.size(); j++)
+                mid[j] = (max[j] + min_gain[j]) / 2;
+            auto e_df_cost = get_expected_dfcost<V, S, R>(sub_scores, score_bar, catalog, mid);
+            for (int j = 0; j < sets.size(); j++) {
+                if (!active[j]) continue;
+                if (e_df_cost[j] > dfcost) max[j] = mid[j];
+                else min_gain[j] = mid[j];
+                active[j] = max[j] - min_gain[j] > gain_precision;
+            }
+        }
+        std::vector<dftype> res;
+        for (int j = 0; j < sets.size(); j++)
+            res.push_back((max[j] + min_gain[j]) / 2);
+        return res;
+    }
+
+    // find_gain by get_expected_dfcost_sampled, for sweeps where estimate of
+    // relative_error is enough. every mid samples only until it is clear on
+    // which side of dfcost it is. estimates are not monotone in gain, so
+    // bisection only moves on intervals which exclude dfcost; each such step
+    // is a decision on exact dfcost, which is monotone. a mid whose interval
+    // still holds dfcost is as close to crossing as estimate can tell, and is
+    // returned. samples returns number of calc used by all estimates.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    dftype find_gain_sampled(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost,
+        const std::vector<std::pair<DATA::PackedArtifact, double>>& allart, double relative_error = 0.01,
+        dftype max_gain = 100000000, dftype gain_precision = 1, unsigned seed = 0, long long* samples = nullptr) {
+        dftype min_gain = -Rule<R>::SUCCESS_DOGFOOD_COST;
+        if (samples) *samples = 0;
+        while (max_gain - min_gain > gain_precision) {
+            auto mid = (max_gain + min_gain) / 2;
+            auto estimate = get_expected_dfcost_sampled<V, S, R>(sub_scores, score_bar, allart, mid, relative_error, dfcost, 1.96, 100000, seed);
+            if (samples) *samples += estimate.samples;
+            if (std::abs(estimate.value - dfcost) <= estimate.half_width) return mid;
+            if (estimate.value > dfcost) max_gain = mid;
+            else min_gain = mid;
+        }
+        return (max_gain + min_gain) / 2;
+    }
+
+    // find_gain for many dfcost targets of one profile, bar and set. targets
+    // are solved in order of dfcost and share every get_expected_dfcost run:
+    // a target starts from tightest bracket of all evaluated gains, largest
+    // one with dfcost not above target and smallest one above it, and bisects
+    // it. all gains are then midpoints of bisection from full range, so later
+    // targets find most of their steps evaluated. results equal find_gain
+    // where dfcost grows with gain, and are within gain_precision of it
+    // otherwise. evaluations counts expected dfcost runs.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    std::vector<dftype> find_gains(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, const std::vector<dftype>& dfcosts,
+        const std::vector<std::pair<DATA::PackedArtifact, double>>& allart, dftype max_gain = 100000000, dftype gain_precision = 1,
+        int* evaluations = nullptr) {
+        std::map<dftype, dftype> evaluated;
+        std::vector<int> order(dfcosts.size());
+        for (int i = 0; i < order.size(); i++) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](int a, int b) { return dfcosts[a] < dfcosts[b]; });
+        std::vector<dftype> res(dfcosts.size());
+        for (auto i : order) {
+            auto dfcost = dfcosts[i];
+            dftype low = -Rule<R>::SUCCESS_DOGFOOD_COST, high = max_gain;
+            for (auto& [gain, value] : evaluated)
+                if (value <= dfcost) low = gain;
+            for (auto ite = evaluated.upper_bound(low); ite != evaluated.end(); ite++)
+                if (ite->second > dfcost) {
+                    high = ite->first;
+                    break;
+                }
+            while (high - low > gain_precision) {
+                auto mid = (high + low) / 2;
+                auto ite = evaluated.find(mid);
+                if (ite == evaluated.end())
+                    ite = evaluated.emplace(mid, get_expected_dfcost<V, S, R>(sub_scores, score_bar, allart, mid)).first;
+                if (ite->second > dfcost) high = mid;
+                else low = mid;
+            }
+            res[i] = (high + low) / 2;
+        }
+        if (evaluations) *evaluations = evaluated.size();
+        return res;
+    }
+
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    std::vector<dftype> find_gains(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, const std::vector<dftype>& dfcosts,
+        DATA::SET_NAMES set = DATA::SET_NAMES::end, dftype max_gain = 100000000, dftype gain_precision = 1, int* evaluations = nullptr) {
+        return find_gains<V, S, R>(sub_scores, score_bar, dfcosts, DATA::get_all_packed_artifacts_with_probs<R>(set), max_gain, gain_precision, evaluations);
+    }
+
+    const std::string RESULT_CACHE_FILE = "result_cache.bin";
+
+    /*
+    results of find_gain and calc kept on disk between processes. file is
+    append only, a header and then fixed size records, and last record of a
+    key wins. readers map the file and index records, and when a key is not
+    found they map again to see records appended since. writers append under
+    exclusive flock, and compact rewrites the file with last record of every
+    key and renames it over the old one under the same lock, so open caches
+    notice new inode and reopen. flock is only reliable on local filesystem.
+    without mmap (JS, Windows) cache keeps nothing and every lookup misses.
+    */
+    class ResultCache {
+    public:
+        enum KIND { FIND_GAIN = 1, CALC = 2 };
+
+        // canonical query, numbers are rounded to 1e-6. no padding, so keys
+        // compare and hash as bytes.
+        struct Key {
+            int32_t kind = 0;
+            uint32_t version = 0; // of rules and DP types, see version()
+            uint64_t artifact = 0; // PackedArtifact code for calc
+            int64_t score[DATA::SUB_TYPES] = {}; // SUB_PROB_WEIGHT_TABLE order, missing is 0
+            int64_t score_bar = 0;
+            int64_t target = 0; // dfcost of find_gain, gain of calc
+            int64_t precision = 0; // gain precision of find_gain
+            int64_t max_gain = 0; // of find_gain
+            int32_t set = 0;
+            int32_t reserved = 0;
+        };
+
+        struct Record {
+            Key key;
+            double result[5] = {}; // find_gain: gain; calc: its tuple
+            double seconds = 0; // time of solving
+            int32_t evaluations = 0; // get_expected_dfcost runs of find_gain
+            int32_t reserved = 0;
+            int64_t written = 0; // unix time
+        };
+
+        static constexpr char MAGIC[8] = { 'A', 'R', 'T', 'C', 'A', 'C', 'H', 'E' };
+        static constexpr uint32_t FORMAT = 1;
+        struct Header {
+            char magic[8];
+            uint32_t format;
+            uint32_t record_size;
+        };
+
+        static int64_t canonical(double x) {
+            return std::llround(x * 1e6);
+        }
+
+        // changes when rules, value and score type of DP change
+        template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+        static uint32_t version() {
+            uint32_t res = 2166136261u;
+            auto add = [&](int64_t x) {
+                for (int i = 0; i < 8; i++, x >>= 8)
+                    res = (res ^ (x & 255)) * 16777619u;
+            };
+            add(FORMAT);
+            add(sizeof(V) | std::is_integral<V>::value << 8 | sizeof(S) << 16 | std::is_integral<S>::value << 24);
+            add(R::AFFIX_NUM);
+            add(R::AFFIX_UPDATE_MIN);
+            add(R::AFFIX_UPDATE_MAX);
+            add(Rule<R>::SUCCESS_DOGFOOD_COST);
+            for (auto loss : Rule<R>::DOGFOOD_LOSS) add(loss);
+            for (auto& [number, weight] : R::INITIAL_AFFIX_NUM_WEIGHT_TABLE) add(number * 1000 + weight);
+            return res;
+        }
+
+        template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+        static Key make_key(KIND kind, const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype target,
+            DATA::SET_NAMES set = DATA::SET_NAMES::end, dftype precision = 0, dftype max_gain = 0,
+            DATA::PackedArtifact art = DATA::PackedArtifact()) {
+            Key key;
+            key.kind = kind;
+            key.version = version<V, S, R>();
+            key.artifact = art.code;
+            for (int i = 0; i < DATA::SUB_TYPES; i++) {
+                auto ite = sub_scores.find(DATA::SUB_PROB_WEIGHT_TABLE[i].first);
+                if (ite != sub_scores.end()) key.score[i] = canonical(ite->second);
+            }
+            key.score_bar = canonical(score_bar);
+            key.target = canonical(target);
+            key.precision = canonical(precision);
+            key.max_gain = canonical(max_gain);
+            key.set = static_cast<int>(set);
+            return key;
+        }
+
+        explicit ResultCache(const std::string& filename = RESULT_CACHE_FILE) : filename(filename) {}
+        ~ResultCache() { unmap(); }
+        ResultCache(const ResultCache&) = delete;
+        ResultCache& operator=(const ResultCache&) = delete;
+
+        // false if not in cache
+        bool lookup(const Key& key, Record& res) {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (int pass = 0; pass < 2; pass++) {
+                auto ite = index.find(key_bytes(key));
+                if (ite != index.end()) {
+                    res = records()[ite->second];
+                    return true;
+                }
+                if (pass == 0 && !refresh()) return false;
+            }
+            return false;
+        }
+
+        // append record. false if file can not be written
+        bool append(Record record) {
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+            return false;
+#else
+            record.written = std::time(nullptr);
+            while (true) {
+                int fd = open(filename.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644);
+                if (fd < 0) return false;
+                flock(fd, LOCK_EX);
+                // compact may have renamed a new file over the one opened
+                struct stat opened, current;
+                if (fstat(fd, &opened) < 0 || stat(filename.c_str(), &current) < 0 || opened.st_ino != current.st_ino) {
+                    flock(fd, LOCK_UN);
+                    close(fd);
+                    continue;
+                }
+                bool ok = true;
+                if (opened.st_size < sizeof(Header)) {
+                    // empty or torn header, which readers treat as empty file
+                    Header header;
+                    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+                    header.format = FORMAT;
+                    header.record_size = sizeof(Record);
+                    ok = ftruncate(fd, 0) == 0 && write(fd, &header, sizeof(header)) == sizeof(header);
+                }
+                else if ((opened.st_size - sizeof(Header)) % sizeof(Record))
+                    // drop torn record of a writer which died while writing
+                    ok = ftruncate(fd, opened.st_size - (opened.st_size - sizeof(Header)) % sizeof(Record)) == 0;
+                ok = ok && write(fd, &record, sizeof(record)) == sizeof(record);
+                flock(fd, LOCK_UN);
+                close(fd);
+                return ok;
+            }
+#endif
+        }
+
+        // keep last record of every key. return record number after compaction, -1 if failed
+        static long long compact(const std::string& filename = RESULT_CACHE_FILE) {
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+            return -1;
+#else
+            int fd;
+            struct stat st;
+            while (true) {
+                fd = open(filename.c_str(), O_RDWR);
+                if (fd < 0) return -1;
+                flock(fd, LOCK_EX);
+                // another compact may have renamed a new file over the one opened
+                struct stat current;
+                if (fstat(fd, &st) < 0 || stat(filename.c_str(), &current) < 0) {
+                    flock(fd, LOCK_UN);
+                    close(fd);
+                    return -1;
+                }
+                if (st.st_ino == current.st_ino) break;
+                flock(fd, LOCK_UN);
+                close(fd);
+            }
+            std::vector<Record> all;
+            if (st.st_size >= sizeof(Header)) {
+                all.resize((st.st_size - sizeof(Header)) / sizeof(Record));
+                if (pread(fd, all.data(), all.size() * sizeof(Record), sizeof(Header)) != all.size() * sizeof(Record))
+                    all.clear();
+            }
+            std::unordered_map<std::string, size_t> last;
+            for (size_t i = 0; i < all.size(); i++)
+                last[key_bytes(all[i].key)] = i;
+            std::vector<Record> kept;
+            for (size_t i = 0; i < all.size(); i++)
+                if (last[key_bytes(all[i].key)] == i)
+                    kept.push_back(all[i]);
+            auto temp = filename + ".compact";
+            int out = open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            bool ok = out >= 0;
+            if (ok) {
+                Header header;
+                memcpy(header.magic, MAGIC, sizeof(MAGIC));
+                header.format = FORMAT;
+                header.record_size = sizeof(Record);
+                ok = write(out, &header, sizeof(header)) == sizeof(header)
+                    && write(out, kept.data(), kept.size() * sizeof(Record)) == kept.size() * sizeof(Record)
+                    && fsync(out) == 0;
+                close(out);
+                ok = ok && rename(temp.c_str(), filename.c_str()) == 0;
+            }
+            flock(fd, LOCK_UN);
+            close(fd);
+            return ok ? kept.size() : -1;
+#endif
+        }
+
+        size_t size() {
+            std::lock_guard<std::mutex> lock(mutex);
+            refresh();
+            return record_number;
+        }
+
+    private:
+        std::string filename;
+        std::mutex mutex; // one cache may be shared by threads
+        std::unordered_map<std::string, size_t> index; // key bytes to last record
+        const char* data = nullptr;
+        size_t mapped = 0, record_number = 0;
+        uint64_t inode = 0;
+
+        static std::string key_bytes(const Key& key) {
+            return std::string(reinterpret_cast<const char*>(&key), sizeof(key));
+        }
+
+        const Record* records() const {
+            return reinterpret_cast<const Record*>(data + sizeof(Header));
+        }
+
+        void unmap() {
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+            if (data) munmap(const_cast<char*>(data), mapped);
+#endif
+            data = nullptr;
+            mapped = 0;
+        }
+
+        // map file again and index new records. false if nothing changed
+        bool refresh() {
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+            return false;
+#else
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) < 0) {
+                close(fd);
+                return false;
+            }
+            size_t number = st.st_size >= sizeof(Header) ? (st.st_size - sizeof(Header)) / sizeof(Record) : 0;
+            if (st.st_ino == inode && number == record_number) {
+                close(fd);
+                return false;
+            }
+            if (st.st_ino != inode) {
+                // new file after compact
+                index.clear();
+                record_number = 0;
+                inode = st.st_ino;
+            }
+            unmap();
+            size_t size = sizeof(Header) + number * sizeof(Record);
+            if (number) {
+                void* p = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+                if (p != MAP_FAILED) {
+                    data = static_cast<const char*>(p);
+                    mapped = size;
+                }
+            }
+            close(fd);
+            auto header = reinterpret_cast<const Header*>(data);
+            if (!data || memcmp(header->magic, MAGIC, sizeof(MAGIC)) || header->format != FORMAT || header->record_size != sizeof(Record)) {
+                unmap();
+                index.clear();
+                record_number = 0;
+                return false;
+            }
+            for (size_t i = record_number; i < number; i++)
+                index[key_bytes(records()[i].key)] = i;
+            record_number = number;
+            return true;
+#endif
+        }
+    };
+
+    // find_gain through cache. solved result is appended to cache.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    dftype find_gain_cached(ResultCache& cache, const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost,
+        DATA::SET_NAMES set = DATA::SET_NAMES::end, dftype max_gain = 100000000, dftype gain_precision = 1) {
+        ResultCache::Record record;
+        record.key = ResultCache::make_key<V, S, R>(ResultCache::FIND_GAIN, sub_scores, score_bar, dfcost, set, gain_precision, max_gain);
+        if (cache.lookup(record.key, record))
+            return record.result[0];
+        auto cc = std::chrono::steady_clock::now();
+        record.result[0] = find_gain<V, S, R>(sub_scores, score_bar, dfcost, DATA::get_all_packed_artifacts_with_probs<R>(set),
+            max_gain, gain_precision, &record.evaluations);
+        record.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+        cache.append(record);
+        return record.result[0];
+    }
+
+    // calc through cache. solved result is appended to cache.
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    std::tuple<bool, dftype, dftype, double, double> calc_cached(ResultCache& cache, const DATA::PackedArtifact& art,
+        const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype gain) {
+        ResultCache::Record record;
+        record.key = ResultCache::make_key<V, S, R>(ResultCache::CALC, sub_scores, score_bar, gain, art.set(), 0, 0, art);
+        if (!cache.lookup(record.key, record)) {
+            auto cc = std::chrono::steady_clock::now();
+            auto [success, e_gain, e_df_cost, success_rate, e_score_gain] = calc<V, S, R>(art, sub_scores, score_bar, gain);
+            record.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            record.result[0] = success;
+            record.result[1] = e_gain;
+            record.result[2] = e_df_cost;
+            record.result[3] = success_rate;
+            record.result[4] = e_score_gain;
+            cache.append(record);
+        }
+        return std::make_tuple(record.result[0] != 0, record.result[1], record.result[2], record.result[3], record.result[4]);
+    }
+
+    // grid of gain atlas. bars and costs are interpolated and need at least
+    // two points each; profiles and sets are matched exactly.
+    struct AtlasGrid {
+        std::vector<std::map<DATA::AFFIX_NAMES, double>> profiles;
+        std::vector<double> bars;
+        std::vector<dftype> costs;
+        std::vector<DATA::SET_NAMES> sets;
+    };
+
+    // answer of gain atlas. error is estimated bound of interpolation, 0 when exact
+    struct AtlasAnswer {
+        dftype gain = 0;
+        dftype error = 0;
+        bool exact = false;
+    };
+
+    /*
+    find_gain precomputed on AtlasGrid, answered by bilinear interpolation on
+    bar and cost. builder also solves the center of every cell, and distance
+    between it and interpolation, plus gain precision, is error bound of the
+    cell. it is an estimate which assumes gain is smooth inside a cell. query
+    of a cell whose bound exceeds tolerance, or outside grid, is solved
+    exactly by find_gain_in_bracket, bracketed by corners when possible.
+
+    file is a header, profile scores, bars, costs, sets, gains of
+    [profile][set][bar][cost] and errors of [profile][set][bar - 1][cost - 1],
+    all 8 byte fields, and is mapped into memory when possible.
+    */
+    class GainAtlas {
+    public:
+        static constexpr char MAGIC[8] = { 'A', 'R', 'T', 'A', 'T', 'L', 'A', 'S' };
+        static constexpr uint32_t FORMAT = 1;
+        struct Header {
+            char magic[8];
+            uint32_t format;
+            uint32_t version; // ResultCache::version of rules and DP types
+            int64_t profiles, bars, costs, sets;
+            double max_gain, gain_precision;
+        };
+
+        template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+        static void build(AtlasGrid grid, const std::string& filename, dftype max_gain = 100000000, dftype gain_precision = 1) {
+            std::sort(grid.bars.begin(), grid.bars.end());
+            std::sort(grid.costs.begin(), grid.costs.end());
+            if (grid.profiles.empty() || grid.sets.empty() || grid.bars.size() < 2 || grid.costs.size() < 2)
+                throw std::runtime_error("atlas grid needs profiles, sets and at least two bars and costs");
+            int B = grid.bars.size(), C = grid.costs.size();
+            std::vector<dftype> center_costs;
+            for (int j = 0; j + 1 < C; j++)
+                center_costs.push_back((grid.costs[j] + grid.costs[j + 1]) / 2);
+            std::vector<double> gains, errors;
+            for (auto& profile : grid.profiles)
+                for (auto set : grid.sets) {
+                    auto allart = DATA::get_all_packed_artifacts_with_probs<R>(set);
+                    auto offset = gains.size();
+                    for (auto bar : grid.bars)
+                        for (auto gain : find_gains<V, S, R>(profile, bar, grid.costs, allart, max_gain, gain_precision))
+                            gains.push_back(gain);
+                    for (int i = 0; i + 1 < B; i++) {
+                        auto center = find_gains<V, S, R>(profile, (grid.bars[i] + grid.bars[i + 1]) / 2, center_costs,
+                            allart, max_gain, gain_precision);
+                        for (int j = 0; j + 1 < C; j++) {
+                            auto g = gains.begin() + offset + i * C + j;
+                            auto interpolated = (g[0] + g[1] + g[C] + g[C + 1]) / 4;
+                            errors.push_back(std::abs(center[j] - interpolated) + gain_precision);
+                        }
+                    }
+                }
+            Header header;
+            memcpy(header.magic, MAGIC, sizeof(MAGIC));
+            header.format = FORMAT;
+            header.version = ResultCache::version<V, S, R>();
+            header.profiles = grid.profiles.size();
+            header.bars = B;
+            header.costs = C;
+            header.sets = grid.sets.size();
+            header.max_gain = max_gain;
+            header.gain_precision = gain_precision;
+            std::ofstream output(filename, std::ios::binary);
+            auto put = [&](const void* data, size_t size) { output.write(static_cast<const char*>(data), size); };
+            put(&header, sizeof(header));
+            for (auto& profile : grid.profiles)
+                for (int i = 0; i < DATA::SUB_TYPES; i++) {
+                    auto ite = profile.find(DATA::SUB_PROB_WEIGHT_TABLE[i].first);
+                    double score = ite == profile.end() ? 0 : ite->second;
+                    put(&score, sizeof(score));
+                }
+            put(grid.bars.data(), B * sizeof(double));
+            put(grid.costs.data(), C * sizeof(double));
+            for (auto set : grid.sets) {
+                int64_t code = static_cast<int>(set);
+                put(&code, sizeof(code));
+            }
+            put(gains.data(), gains.size() * sizeof(double));
+            put(errors.data(), errors.size() * sizeof(double));
+            if (!output) throw std::runtime_error("can not write atlas " + filename);
+        }
+
+        GainAtlas() = default;
+        ~GainAtlas() { unload(); }
+        GainAtlas(const GainAtlas&) = delete;
+        GainAtlas& operator=(const GainAtlas&) = delete;
+
+        // return false if file can not be read or is not an atlas of these rules
+        template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+        bool load(const std::string& filename) {
+            unload();
+#if defined(_WIN32) || defined(__EMSCRIPTEN__)
+            std::ifstream fin(filename, std::ios::binary);
+            if (!fin) return false;
+            buffer.assign((std::istreambuf_iterator<char>(fin)), std::istreambuf_iterator<char>());
+            data = buffer.data();
+            size = buffer.size();
+#else
+            int fd = open(filename.c_str(), O_RDONLY);
+            if (fd < 0) return false;
+            struct stat st;
+            if (fstat(fd, &st) < 0 || st.st_size < sizeof(Header)) {
+                close(fd);
+                return false;
+            }
+            void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED) return false;
+            data = static_cast<const char*>(p);
+            size = st.st_size;
+            mapped = true;
+#endif
+            if (size < sizeof(Header)) return unload(), false;
+            header = reinterpret_cast<const Header*>(data);
+            auto P = header->profiles, B = header->bars, C = header->costs, T = header->sets;
+            // same precondition as build, locate reads cell i + 1 of bars and costs.
+            // table of gains is bounded by file size first, so size check can not overflow
+            int64_t most = size / sizeof(double);
+            if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) || header->format != FORMAT || header->version != ResultCache::version<V, S, R>()
+                || P < 1 || T < 1 || B < 2 || C < 2 || P > most || T > most / P || B > most / (P * T) || C > most / (P * T * B)
+                || size != sizeof(Header) + sizeof(double) * (P * DATA::SUB_TYPES + B + C + T + P * T * B * C + P * T * (B - 1) * (C - 1)))
+                return unload(), false;
+            auto field = reinterpret_cast<const double*>(data + sizeof(Header));
+            scores = field;
+            bars = scores + P * DATA::SUB_TYPES;
+            costs = bars + B;
+            sets = reinterpret_cast<const int64_t*>(costs + C);
+            gains = reinterpret_cast<const double*>(sets + T);
+            errors = gains + P * T * B * C;
+            for (int p = 0; p < P; p++) {
+                std::vector<int64_t> key;
+                for (int i = 0; i < DATA::SUB_TYPES; i++)
+                    key.push_back(ResultCache::canonical(scores[p * DATA::SUB_TYPES + i]));
+                profile_index[key] = p;
+            }
+            return true;
+        }
+
+        // interpolated gain, or exact one when bound of cell exceeds tolerance
+        // times gain, when outside grid or when profile or set is not in atlas.
+        template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+        AtlasAnswer query(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost,
+            DATA::SET_NAMES set = DATA::SET_NAMES::end, double tolerance = 0.01) const {
+            AtlasAnswer res;
+            dftype max_gain = header ? header->max_gain : 100000000, gain_precision = header ? header->gain_precision : 1;
+            dftype low = -Rule<R>::SUCCESS_DOGFOOD_COST, high = max_gain;
+            auto cell = locate(sub_scores, score_bar, dfcost, set);
+            if (cell) {
+                auto [g, C, t, u, error] = *cell;
+                res.gain = (1 - t) * (1 - u) * g[0] + (1 - t) * u * g[1] + t * (1 - u) * g[C] + t * u * g[C + 1];
+                res.error = error;
+                if (error <= tolerance * std::abs(res.gain)) return res;
+                // gain grows with cost and drops with bar
+                low = g[C] - gain_precision;
+                high = g[1] + gain_precision;
+            }
+            res.gain = find_gain_in_bracket<V, S, R>(sub_scores, score_bar, dfcost, DATA::get_all_packed_artifacts_with_probs<R>(set),
+                low, high, max_gain, gain_precision);
+            res.error = 0;
+            res.exact = true;
+            return res;
+        }
+
+        size_t points() const {
+            return header ? header->profiles * header->sets * header->bars * header->costs : 0;
+        }
+
+    private:
+        const char* data = nullptr;
+        size_t size = 0;
+        bool mapped = false;
+        std::string buffer;
+        const Header* header = nullptr;
+        const double *scores = nullptr, *bars = nullptr, *costs = nullptr, *gains = nullptr, *errors = nullptr;
+        const int64_t* sets = nullptr;
+        std::map<std::vector<int64_t>, int> profile_index;
+
+        void unload() {
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+            if (mapped) munmap(const_cast<char*>(data), size);
+#endif
+            buffer.clear();
+            data = nullptr;
+            size = 0;
+            mapped = false;
+            header = nullptr;
+            profile_index.clear();
+        }
+
+        // corner gains of cell (g[0], g[1] are bar i, g[C], g[C + 1] bar i + 1),
+        // row length, position inside cell on bar and cost, and error bound
+        std::optional<std::tuple<const double*, int, double, double, double>> locate(
+            const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost, DATA::SET_NAMES set) const {
+            if (!header) return std::nullopt;
+            int B = header->bars, C = header->costs, T = header->sets;
+            std::vector<int64_t> key;
+            for (int i = 0; i < DATA::SUB_TYPES; i++) {
+                auto ite = sub_scores.find(DATA::SUB_PROB_WEIGHT_TABLE[i].first);
+                key.push_back(ResultCache::canonical(ite == sub_scores.end() ? 0 : ite->second));
+            }
+            auto profile = profile_index.find(key);
+            if (profile == profile_index.end()) return std::nullopt;
+            int set_index = std::find(sets, sets + T, static_cast<int>(set)) - sets;
+            if (set_index == T) return std::nullopt;
+            if (score_bar < bars[0] || score_bar > bars[B - 1] || dfcost < costs[0] || dfcost > costs[C - 1]) return std::nullopt;
+            int i = std::min<int>(std::upper_bound(bars, bars + B, score_bar) - bars - 1, B - 2);
+            int j = std::min<int>(std::upper_bound(costs, costs + C, dfcost) - costs - 1, C - 2);
+            long long table = static_cast<long long>(profile->second) * T + set_index;
+            return std::make_tuple(gains + (table * B + i) * C + j, C,
+                (score_bar - bars[i]) / (bars[i + 1] - bars[i]), (dfcost - costs[j]) / (costs[j + 1] - costs[j]),
+                errors[(table * (B - 1) + i) * (C - 1) + j]);
+        }
+    };
+
+    /*
+    native inference of MLP and MLPSetEmb of train/model.py, loaded from text
+    written by train/export.py. input follows data_clean of train/main.py:
+    sub scores in SUB_PROB_WEIGHT_TABLE order, bar / bar_max,
+    (cost - cost_min) / (cost_max - cost_min), then index of set for MLP or
+    its embedding for MLPSetEmb. output is log gain. batch is kept feature
+    major, so inner loops run over queries and are vectorized.
+    */
+    class SurrogateModel {
+    public:
+        // return false if file can not be read or is not a model of these inputs
+        bool load(const std::string& filename) {
+            *this = SurrogateModel();
+            std::ifstream fin(filename);
+            std::string name;
+            if (!(fin >> name >> bar_max >> cost_min >> cost_max) || (name != "MLP" && name != "MLPSetEmb")) return false;
+            int input = DATA::SUB_TYPES + 3;
+            if (name == "MLPSetEmb") {
+                if (!(fin >> set_number >> embedding_dim) || set_number <= 0 || embedding_dim <= 0) return false;
+                embedding.resize(set_number * embedding_dim);
+                for (auto& x : embedding)
+                    if (!(fin >> x)) return false;
+                input += embedding_dim - 1;
+            }
+            int layer_number;
+            if (!(fin >> layer_number) || layer_number <= 0) return false;
+            layers.resize(layer_number);
+            for (auto& layer : layers) {
+                if (!(fin >> layer.in >> layer.out) || layer.in != input || layer.out <= 0) return layers.clear(), false;
+                layer.weight.resize(layer.in * layer.out);
+                layer.bias.resize(layer.out);
+                for (auto& x : layer.weight)
+                    if (!(fin >> x)) return layers.clear(), false;
+                for (auto& x : layer.bias)
+                    if (!(fin >> x)) return layers.clear(), false;
+                input = layer.out;
+            }
+            if (input != 1) return layers.clear(), false;
+            return true;
+        }
+
+        bool loaded() const { return !layers.empty(); }
+
+        // query is inside range model is trained on
+        bool covers(double score_bar, dftype dfcost, DATA::SET_NAMES set) const {
+            int index = static_cast<int>(set) - 1;
+            return score_bar >= 0 && score_bar <= bar_max && dfcost >= cost_min && dfcost <= cost_max
+                && index >= 0 && index < (embedding_dim ? set_number : DATA::SET_NUMBER);
+        }
+
+        // predicted gains of queries, gain of query is ignored
+        std::vector<dftype> predict(const std::vector<SolvedQuery>& queries) const {
+            if (!loaded()) throw std::runtime_error("surrogate model is not loaded");
+            size_t n = queries.size();
+            std::vector<float> x(layers[0].in * n), y;
+            for (size_t q = 0; q < n; q++) {
+                auto& query = queries[q];
+                int k = 0;
+                for (; k < DATA::SUB_TYPES; k++) {
+                    auto ite = query.sub_scores.find(DATA::SUB_PROB_WEIGHT_TABLE[k].first);
+                    x[k * n + q] = ite == query.sub_scores.end() ? 0 : ite->second;
+                }
+                x[k++ * n + q] = query.score_bar / bar_max;
+                x[k++ * n + q] = (query.dfcost - cost_min) / (cost_max - cost_min);
+                int set = static_cast<int>(query.set) - 1;
+                if (!embedding_dim) x[k * n + q] = set;
+                else if (set >= 0 && set < set_number)
+                    for (int e = 0; e < embedding_dim; e++)
+                        x[(k + e) * n + q] = embedding[set * embedding_dim + e];
+            }
+            for (size_t l = 0; l < layers.size(); l++) {
+                auto& layer = layers[l];
+                bool relu = l + 1 < layers.size();
+                y.assign(layer.out * n, 0);
+                for (int o = 0; o < layer.out; o++) {
+                    float* out = y.data() + o * n;
+                    for (int k = 0; k < layer.in; k++) {
+                        float w = layer.weight[o * layer.in + k];
+                        const float* in = x.data() + k * n;
+#pragma omp simd
+                        for (size_t q = 0; q < n; q++) out[q] += w * in[q];
+                    }
+                    float b = layer.bias[o];
+#pragma omp simd
+                    for (size_t q = 0; q < n; q++) out[q] = relu ? std::max(out[q] + b, 0.f) : out[q] + b;
+                }
+                std::swap(x, y);
+            }
+            std::vector<dftype> res(n);
+            for (size_t q = 0; q < n; q++) res[q] = std::exp(x[q]);
+            return res;
+        }
 
-    // get artifact string as input
-    // std::tuple<bool, DP::dftype, DP::dftype, double, double> calc(const std::string &art_string,
-    //     const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype gain) {
-    //     auto art = DATA::Artifact(art_string);
-    //     return calc(art, sub_scores, score_bar, gain);
-    // }
+    private:
+        struct Layer {
+            int in = 0, out = 0;
+            std::vector<float> weight; // out rows of in
+            std::vector<float> bias;
+        };
+        double bar_max = 0, cost_min = 0, cost_max = 0;
+        int set_number = 0, embedding_dim = 0; // embedding_dim is 0 for MLP
+        std::vector<float> embedding;
+        std::vector<Layer> layers;
+    };
 
-    // output cell data into yaml. key1=N, key2=second, [list of first]
-    void output_yaml() {
-        init();
-        // std::vector<std::map<int, int>> res;
-        for (int n = 1; n <= N; n++) {
-            // std::cout << n << ' ' << m.size() << ' ' << (1 << (4 * n)) 
-            //           << std::endl;
-            // for (auto i : m)
-            //     std::cout << i.first << ' ' << i.second << std::endl;
-            std::map<int, std::vector<int>> mm;
-            for (auto& [status, count] : cell[n])
-                mm[count] = std::vector<int>();
-            for (auto& [status, count] : cell[n])
-                mm[count].push_back(status);
-            mm[0] = { 1 << (DATA::AFFIX_NUM * n) }; // here save enumerate number
-            std::cout << n << ": \n";
-            for (auto& [status, count] : mm) {
-                std::cout << "  " << status << ": [ ";
-                for (auto j : count)
-                    std::cout << j << ',';
-                std::cout << "]\n";
+    // gain of find_gain_surrogate, exact when it is solved by find_gain
+    struct SurrogateAnswer {
+        dftype gain = 0;
+        bool exact = false;
+        int samples = 0; // calc runs of sampled check
+    };
+
+    /*
+    find_gain of queries by surrogate with exact fallback. prediction p is
+    accepted when model covers query and, if confirm, sampled
+    get_expected_dfcost puts dfcost of p * (1 - tolerance) below target and
+    of p * (1 + tolerance) above it, each outside confidence interval of z =
+    1.96. as dfcost grows with gain, result is then within tolerance of p
+    unless one of two intervals misses, which each may with about 5%
+    probability; it is not a guarantee. each check is at least min_samples
+    calc runs and more when dfcost is near target: on 4 dataset queries both
+    checks cost 0.03 to 0.45 of one exact get_expected_dfcost, seconds to
+    minutes, see compare_surrogate. without confirm only coverage is
+    checked and prediction is returned unchecked. other queries are solved
+    exactly, by find_gain_seeded from prediction if model covers them, else
+    by find_gain.
+    */
+    template <class V = dftype, class S = stype, class R = DATA::RULES_5STAR>
+    std::vector<SurrogateAnswer> find_gain_surrogate(const SurrogateModel& model, const std::vector<SolvedQuery>& queries,
+        double tolerance = 0.05, bool confirm = true, dftype max_gain = 100000000, dftype gain_precision = 1) {
+        auto predictions = model.predict(queries);
+        std::vector<SurrogateAnswer> res(queries.size());
+        for (int i = 0; i < queries.size(); i++) {
+            auto& query = queries[i];
+            dftype low = predictions[i] * (1 - tolerance), high = predictions[i] * (1 + tolerance);
+            bool covered = model.covers(query.score_bar, query.dfcost, query.set);
+            bool accepted = covered && high < max_gain;
+            if (accepted && !confirm) {
+                res[i].gain = predictions[i];
+                continue;
+            }
+            auto allart = DATA::get_all_packed_artifacts_with_probs<R>(query.set);
+            auto estimate = [&](dftype gain) {
+                auto e = get_expected_dfcost_sampled<V, S, R>(query.sub_scores, query.score_bar, allart, gain, 0.01, query.dfcost);
+                res[i].samples += e.samples;
+                return e;
+            };
+            if (accepted) {
+                auto e = estimate(low);
+                accepted = e.value + e.half_width < query.dfcost;
+            }
+            if (accepted) {
+                auto e = estimate(high);
+                accepted = e.value - e.half_width > query.dfcost;
+            }
+            if (accepted) res[i].gain = predictions[i];
+            else {
+                res[i].gain = covered
+                    ? find_gain_seeded<V, S, R>(query.sub_scores, query.score_bar, query.dfcost, allart, predictions[i], 0.1, max_gain, gain_precision)
+                    : find_gain<V, S, R>(query.sub_scores, query.score_bar, query.dfcost, allart, max_gain, gain_precision);
+                res[i].exact = true;
             }
         }
+        return res;
     }
 
-    void test_one_artifact(bool output_result = true, bool debug = false) {
-        DEBUG = debug;
-        std::vector<double> s = { 0, 0, 1, 1 };
-        std::vector<int> w = { 7, 9, 9, 10 };
-        int upgrade_time = 5;
-        dftype input_gain = 100000;
-        double score_bar = 51;
-        auto r = calc(w, s, upgrade_time, score_bar, input_gain);
-        auto& [do_upgrade, gain, dogfood_cost, success_rate, score_gain] = r;
-        if (output_result) {
-            std::cout << format("upgrade? {}\nexpected gain {}\ndogfood cost {}\nsuccess rate above bar {}\nexpected better score if success {}\n", do_upgrade, gain, dogfood_cost, success_rate, score_gain);
-            std::cout << do_upgrade << ' ' << gain << ' ' << dogfood_cost << ' '
-                << success_rate << ' ' << score_gain << std::endl;
-        }
-        // std::cout << r.do_upgrade << ' ' << r.dogfood_cost << ' ' 
-        //           << r.success_rate << ' ' << r.score_gain << std::endl;
+    template <class V, class S, class R>
+    std::tuple<bool, dftype, dftype, double, double> Engine::calc(const DATA::PackedArtifact& art,
+        const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype gain) {
+        EngineScope scope(*this);
+        return DP::calc<V, S, R>(art, sub_scores, score_bar, gain);
     }
 
-    auto test_sub_score(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype gain, double randnum = -1) {
-        if (randnum < 0)
-            randnum = DATA::rand();
-        DATA::Artifact art = DATA::get_drop(randnum);
-        return calc(art, sub_scores, score_bar, gain);
+    template <class V, class S, class R>
+    dftype Engine::get_expected_dfcost(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar,
+        const std::vector<std::pair<DATA::PackedArtifact, double>>& allart, dftype gain) {
+        EngineScope scope(*this);
+        return DP::get_expected_dfcost<V, S, R>(sub_scores, score_bar, allart, gain);
     }
 
-    bool FIND_GAIN_DEBUG = false;
+    template <class V, class S, class R>
+    dftype Engine::find_gain(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost,
+        DATA::SET_NAMES set, dftype max_gain, dftype gain_precision) {
+        EngineScope scope(*this);
+        return DP::find_gain<V, S, R>(sub_scores, score_bar, dfcost, set, max_gain, gain_precision);
+    }
 
-    dftype get_expected_dfcost(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, const std::vector<std::pair<DATA::Artifact, double>>& allart, dftype gain) {
-        std::vector<std::vector<std::pair<double, double>>> results;
-        results.resize(allart.size());
-        // double results = 0;
-#pragma omp parallel for
-        for (int i = 0; i < allart.size(); i++) {
-            // TODO enumerate sub weight
-            auto [art, rate] = allart[i];
-            for (auto i = art.sub.size(); i--; ) rate /= DATA::AFFIX_UPDATE_MAX - DATA::AFFIX_UPDATE_MIN + 1;
-            while (1) {
-                bool addflag = false;
-                for (int i = 0; i < art.sub.size(); i++)
-                    if (art.sub[i].second == DATA::AFFIX_UPDATE_MAX) art.sub[i].second = DATA::AFFIX_UPDATE_MIN;
-                    else {
-                        art.sub[i].second++;
-                        addflag = true;
-                        break;
-                    }
-                if (!addflag) break;
-                auto [success, e_gain, e_df_cost, success_rate, e_score_gain] = calc(art, sub_scores, score_bar, gain);
-                results[i].push_back({ e_df_cost, rate });
-            }
-            if (FIND_GAIN_DEBUG && i % 10 == 0) std::cout << "art number " << i << '/' << allart.size() << "\r";
-            // std::cout << format("{} {} {} {} {} {}\n", rate, success, e_gain, e_df_cost, success_rate, e_score_gain);
-        }
-        double final_result = 0;
-        for (auto& result : results)
-            for (auto& [i, j] : result)
-                final_result += i * j;
-        if (FIND_GAIN_DEBUG) std::cout << "gain " << gain << " exp_df_cost " << final_result << std::endl;
-        return final_result;
+    void Engine::calibrate_engines(int samples, bool output) {
+        EngineScope scope(*this);
+        DP::calibrate_engines(samples, output);
     }
 
-    // 变量：score bar, score map, set (including all set), dfcost。目标：找到给定dfcost的gain设置
-    // max_gain 最大可能价值，gain_accuracy二分到什么精度。一般不需要动
-    dftype find_gain(const std::map<DATA::AFFIX_NAMES, double>& sub_scores, double score_bar, dftype dfcost, DATA::SET_NAMES set = DATA::SET_NAMES::end,
-        dftype max_gain = 100000000, dftype gain_precision = 1) {
-        // const std::vector<std::pair<DATA::Artifact, double>> &allart = set == DATA::SET_NAMES::end ? DATA::all_artifacts_accumulated : DATA::all_artifacts_accumulated_divided_by_set[set];
-        auto allart = DATA::get_all_artifacts_with_probs(set);
-        dftype min_gain = -SUCCESS_DOGFOOD_COST;
-        // result drops in [min_gain, max_gain)
-        while (max_gain - min_gain > gain_precision) {
-            auto mid = (max_gain + min_gain) / 2;
-            if (FIND_GAIN_DEBUG) std::cout << "current L M R " << min_gain << ' ' << mid << ' ' << max_gain << std::endl;
-            if (get_expected_dfcost(sub_scores, score_bar, allart, mid) > dfcost)  max_gain = mid;
-            else min_gain = mid;
-        }
-        return (max_gain + min_gain) / 2;
+    bool Engine::save_engine_profile(const std::string& filename) {
+        EngineScope scope(*this);
+        return DP::save_engine_profile(filename);
+    }
+
+    bool Engine::load_engine_profile(const std::string& filename) {
+        EngineScope scope(*this);
+        return DP::load_engine_profile(filename);
     }
 
     /*
@@ -1138,6 +4781,729 @@ namespace DP {
         return { sub_scores, score_bar, dfcost, set };
     }
 
+    // compare calc_lazy with calc on random 4-sub artifacts, which are upgraded
+    // randomly to every level. output average states touched by both engines
+    // and max result difference.
+    void compare_lazy_calc(int times = 1000, dftype gain = 1000000) {
+        init();
+        for (int level = 0; level < N; level++) {
+            auto upgrade_time = N - level;
+            long long sweep_states = 0;
+            for (int i = 0; i <= upgrade_time; i++)
+                sweep_states += cell[i].size();
+            CalcStats stats;
+            double max_diff = 0, sweep_time = 0, lazy_time = 0;
+            for (int k = 0; k < times; k++) {
+                auto [ss, bar, df, set] = generate_random_gain_input();
+                auto art = DATA::random_one_artifact(set, DATA::AFFIX_NAMES::end, DATA::AFFIX_NUM);
+                for (int i = 0; i < level; i++)
+                    art.sub[DATA::randint(DATA::AFFIX_NUM)].second += DATA::randint(DATA::AFFIX_UPDATE_MAX - DATA::AFFIX_UPDATE_MIN + 1) + DATA::AFFIX_UPDATE_MIN;
+                std::vector<int> weight;
+                for (auto& [t, w] : art.sub)
+                    weight.push_back(w);
+                auto score = select_sub_score(art, ss);
+                auto cc = clock();
+                auto r1 = calc(weight, score, upgrade_time, bar, gain);
+                sweep_time += clock() - cc;
+                cc = clock();
+                auto r2 = calc_lazy(weight, score, upgrade_time, bar, gain, &stats);
+                lazy_time += clock() - cc;
+                if (std::get<0>(r1) != std::get<0>(r2))
+                    throw std::runtime_error("calc_lazy upgrade decision differs from calc");
+                max_diff = std::max({ max_diff,
+                    std::abs(std::get<1>(r1) - std::get<1>(r2)) / std::max(1., std::abs(std::get<1>(r1))),
+                    std::abs(std::get<2>(r1) - std::get<2>(r2)) / std::max(1., std::abs(std::get<2>(r1))),
+                    std::abs(std::get<3>(r1) - std::get<3>(r2)),
+                    std::abs(std::get<4>(r1) - std::get<4>(r2)) });
+            }
+            std::cout << format("upgrade time {}: sweep states {} lazy visited {:.1f} memo hit {:.1f} pruned fail {:.1f} pruned success {:.1f}, time {:.3f}s vs {:.3f}s, max diff {:.3g}\n",
+                upgrade_time, sweep_states, stats.visited * 1. / times, stats.memo_hit * 1. / times,
+                stats.pruned_fail * 1. / times, stats.pruned_success * 1. / times,
+                sweep_time / CLOCKS_PER_SEC, lazy_time / CLOCKS_PER_SEC, max_diff);
+        }
+    }
+
+    // measure GAIN_PRUNE over score bar range of generate_random_gain_input.
+    // every query sweeps all sub weights of a random 4-sub artifact like
+    // get_expected_dfcost does, with and without the expected gain bound.
+    void compare_gain_prune(int times = 10) {
+        init();
+        Engine engines[2] = { current_engine(), current_engine() };
+        engines[0].gain_prune = false;
+        engines[1].gain_prune = true;
+        for (int bar = 0; bar <= 60; bar += 10) {
+            CalcStats stats[2][2];
+            double used_time[2][2] = { { 0, 0 }, { 0, 0 } };
+            for (int k = 0; k < times; k++) {
+                auto [ss, _bar, df, set] = generate_random_gain_input(std::map<DATA::AFFIX_NAMES, double>(), bar);
+                auto art = DATA::random_one_artifact(set, DATA::AFFIX_NAMES::end, DATA::AFFIX_NUM);
+                auto score = select_sub_score(art, ss);
+                dftype gain = std::pow(10, 3 + DATA::rand() * 5);
+                std::vector<std::tuple<bool, dftype, dftype, double, double>> results[2][2];
+                for (int prune = 0; prune < 2; prune++) {
+                    EngineScope scope(engines[prune]);
+                    for (int engine = 0; engine < 2; engine++) {
+                        auto cc = clock();
+                        for (int code = 0; code < 1 << (2 * DATA::AFFIX_NUM); code++) {
+                            std::vector<int> weight;
+                            for (int i = 0; i < DATA::AFFIX_NUM; i++)
+                                weight.push_back(DATA::AFFIX_UPDATE_MIN + (code >> (2 * i) & 3));
+                            results[prune][engine].push_back(engine
+                                ? calc_lazy(weight, score, N, bar, gain, &stats[prune][engine])
+                                : calc(weight, score, N, bar, gain, &stats[prune][engine]));
+                        }
+                        used_time[prune][engine] += clock() - cc;
+                    }
+                }
+                for (int engine = 0; engine < 2; engine++)
+                    for (int i = 0; i < results[0][engine].size(); i++)
+                        if (std::get<0>(results[0][engine][i]) != std::get<0>(results[1][engine][i])
+                            || std::abs(std::get<1>(results[0][engine][i]) - std::get<1>(results[1][engine][i])) > 1e-6
+                            || std::abs(std::get<2>(results[0][engine][i]) - std::get<2>(results[1][engine][i])) > 1e-6)
+                            throw std::runtime_error("GAIN_PRUNE changes calc result");
+            }
+            std::cout << format("bar {}: calc expanded {} -> {} pruned {}, time {:.3f}s -> {:.3f}s, speedup {:.2f}; "
+                "calc_lazy expanded {} -> {} pruned {}, time {:.3f}s -> {:.3f}s, speedup {:.2f}\n", bar,
+                stats[0][0].visited, stats[1][0].visited, stats[1][0].pruned_gain,
+                used_time[0][0] / CLOCKS_PER_SEC, used_time[1][0] / CLOCKS_PER_SEC, used_time[0][0] / used_time[1][0],
+                stats[0][1].visited, stats[1][1].visited, stats[1][1].pruned_gain,
+                used_time[0][1] / CLOCKS_PER_SEC, used_time[1][1] / CLOCKS_PER_SEC, used_time[0][1] / used_time[1][1]);
+        }
+    }
+
+    // run engines with different options at same time, one per thread, and
+    // compare with running them one by one. results should be same and
+    // options of default engine untouched.
+    void test_engines(int sample_every = 100, dftype gain = 100000) {
+        const ENGINE_NAMES NAMES[] = { ENGINE_NAMES::calc, ENGINE_NAMES::calc2, ENGINE_NAMES::lazy, ENGINE_NAMES::end };
+        const int ENGINES = 2 * std::size(NAMES);
+        std::vector<Engine> engines(ENGINES, current_engine());
+        for (int i = 0; i < ENGINES; i++) {
+            engines[i].engine = NAMES[i / 2];
+            engines[i].gain_prune = i % 2;
+        }
+        auto [ss, bar, df, set] = generate_random_gain_input();
+        std::vector<std::pair<DATA::PackedArtifact, double>> allart;
+        auto all = DATA::get_all_packed_artifacts_with_probs(set);
+        for (int i = 0; i < all.size(); i += sample_every)
+            allart.push_back(all[i]);
+        auto old_prune = GAIN_PRUNE;
+
+        // no score increase left and bar exactly reached, bar bucket must stay in range
+        std::vector<double> zero(DATA::AFFIX_NUM, 0);
+        for (int ut = 0; ut <= N; ut++) {
+            auto f = engine_feature(std::vector<int>(DATA::AFFIX_NUM, DATA::AFFIX_UPDATE_MAX), zero, ut, 0);
+            if (f.bar_bucket < 0 || f.bar_bucket >= BAR_BUCKETS)
+                throw std::runtime_error("bar bucket out of range");
+        }
+        auto zero_drop = DATA::PackedArtifact(DATA::random_one_artifact(set, DATA::AFFIX_NAMES::end, DATA::AFFIX_NUM));
+        std::map<DATA::AFFIX_NAMES, double> zero_scores;
+        for (auto& [name, w] : DATA::SUB_PROB_WEIGHT_TABLE)
+            zero_scores[name] = 0;
+        calc(zero_drop, zero_scores, 0., 10000.);
+
+        auto cc = std::chrono::steady_clock::now();
+        std::vector<dftype> serial(ENGINES), parallel(ENGINES);
+        for (int i = 0; i < ENGINES; i++)
+            serial[i] = engines[i].get_expected_dfcost(ss, bar, allart, gain);
+        double serial_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+
+        cc = std::chrono::steady_clock::now();
+#pragma omp parallel for
+        for (int i = 0; i < ENGINES; i++)
+            parallel[i] = engines[i].get_expected_dfcost(ss, bar, allart, gain);
+        double parallel_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+
+        double max_diff = 0;
+        for (int i = 0; i < ENGINES; i++) {
+            max_diff = std::max(max_diff, std::abs(serial[i] - serial[0]));
+            if (serial[i] != parallel[i])
+                throw std::runtime_error("engine result differs when run concurrently");
+        }
+        if (GAIN_PRUNE != old_prune)
+            throw std::runtime_error("engine changed default engine");
+        std::cout << format("{} engines on {} artifacts, bar {:.1f}: one by one {:.3f}s, concurrent {:.3f}s, max diff between engines {:.3e}\n",
+            ENGINES, allart.size(), bar, serial_time, parallel_time, max_diff);
+    }
+
+    // roll random drops to full level with UpgradeSession, and compare its
+    // decision after every roll with calc on the upgraded artifact.
+    void test_upgrade_session(int times = 200) {
+        int decisions = 0, dp_runs = 0;
+        double max_diff = 0, session_time = 0, decision_time = 0, calc_time = 0;
+        for (int k = 0; k < times; k++) {
+            auto [ss, bar, df, set] = generate_random_gain_input();
+            dftype gain = std::pow(10, 3 + DATA::rand() * 5);
+            auto cc = std::chrono::steady_clock::now();
+            UpgradeSession<> session(DATA::get_packed_drop(DATA::rand()), ss, bar, gain);
+            session_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            while (true) {
+                auto& art = session.artifact();
+                cc = std::chrono::steady_clock::now();
+                auto res = session.decision();
+                decision_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+                cc = std::chrono::steady_clock::now();
+                auto expect = calc(art, ss, bar, gain);
+                calc_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+                if (std::get<0>(res) != std::get<0>(expect))
+                    throw std::runtime_error("session decision differs from calc: " + art.to_artifact().to_string());
+                max_diff = std::max({ max_diff, std::abs(std::get<1>(res) - std::get<1>(expect)), std::abs(std::get<2>(res) - std::get<2>(expect)) });
+                decisions++;
+                if (art.level() == N) break;
+                DATA::AFFIX_NAMES type;
+                if (art.sub_number() < DATA::AFFIX_NUM) {
+                    int used = 0;
+                    for (int i = 0; i < art.sub_number(); i++)
+                        used |= DATA::SUB_BIT[static_cast<int>(art.sub_type(i))];
+                    auto& dist = DATA::sub_cumulative(art.main(), used);
+                    type = dist.pick(DATA::randint(dist.sum()));
+                }
+                else type = art.sub_type(DATA::randint(art.sub_number()));
+                // rejected rolls must leave session unchanged
+                std::vector<DATA::AFFIX_NAMES> invalid = { art.main() };
+                if (art.sub_number() < DATA::AFFIX_NUM && art.sub_number() > 0) invalid.push_back(art.sub_type(0));
+                for (auto bad : invalid) {
+                    auto before = art.to_artifact().to_string();
+                    try {
+                        session.roll(bad, DATA::AFFIX_UPDATE_MAX);
+                        throw std::logic_error("invalid roll accepted");
+                    }
+                    catch (std::runtime_error&) {}
+                    if (art.to_artifact().to_string() != before || std::get<0>(session.decision()) != std::get<0>(res))
+                        throw std::runtime_error("rejected roll changed session: " + before);
+                }
+                cc = std::chrono::steady_clock::now();
+                session.roll(type, DATA::randint(DATA::AFFIX_UPDATE_MAX - DATA::AFFIX_UPDATE_MIN + 1) + DATA::AFFIX_UPDATE_MIN);
+                session_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            }
+            dp_runs += session.dp_run_number();
+        }
+        std::cout << format("{} artifacts, {} decisions, {} DP runs: session DP {:.3f}s + decisions {:.6f}s, calc every level {:.3f}s, max diff {:.3e}\n",
+            times, decisions, dp_runs, session_time, decision_time, calc_time, max_diff);
+    }
+
+    // extract ThresholdPolicy for random drops with all subs, then compare
+    // its decision with calc on random upgraded weights of every level.
+    void test_threshold_policy(int times = 20, int checks = 500) {
+        int differ = 0;
+        double extract_time = 0, policy_time = 0, calc_time = 0;
+        size_t policy_bytes = 0;
+        for (int k = 0; k < times; k++) {
+            auto [ss, bar, df, set] = generate_random_gain_input();
+            dftype gain = std::pow(10, 3 + DATA::rand() * 5);
+            auto art = DATA::get_packed_drop(DATA::rand());
+            while (art.sub_number() < DATA::AFFIX_NUM)
+                art = DATA::get_packed_drop(DATA::rand());
+            std::vector<double> score;
+            select_sub_score(art, ss, score);
+            auto cc = std::chrono::steady_clock::now();
+            auto policy = extract_threshold_policy(score, bar, gain);
+            extract_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            policy_bytes = policy.levels.size() * sizeof(ThresholdPolicy::Level);
+            for (int c = 0; c < checks; c++) {
+                int level = DATA::randint(N + 1);
+                std::vector<int> weight;
+                for (int i = 0; i < art.sub_number(); i++)
+                    weight.push_back(art.sub_weight(i));
+                for (int i = 0; i < level; i++)
+                    weight[DATA::randint(DATA::AFFIX_NUM)] += DATA::randint(DATA::AFFIX_UPDATE_MAX - DATA::AFFIX_UPDATE_MIN + 1) + DATA::AFFIX_UPDATE_MIN;
+                double current = 0;
+                for (int i = 0; i < DATA::AFFIX_NUM; i++)
+                    current += weight[i] * score[i];
+                cc = std::chrono::steady_clock::now();
+                bool decision = policy.upgrade(current, level);
+                policy_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+                cc = std::chrono::steady_clock::now();
+                auto expect = calc(weight, score, N - level, bar, gain);
+                calc_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+                differ += decision != std::get<0>(expect);
+            }
+        }
+        std::cout << format("{} policies ({} bytes each) extracted in {:.3f}s, {} decisions: policy {:.6f}s, calc {:.3f}s, {} differ\n",
+            times, policy_bytes, extract_time, times * checks, policy_time, calc_time, differ);
+    }
+
+    // find_gains on evenly spaced dfcost targets in range of
+    // generate_random_gain_input, against find_gain per target. catalog is
+    // subsampled by sample_every to keep it short.
+    void compare_gain_curve(int times = 2, int targets = 24, int sample_every = 10, dftype gain_precision = 1) {
+        for (int k = 0; k < times; k++) {
+            auto [ss, bar, df, set] = generate_random_gain_input();
+            auto full = DATA::get_all_packed_artifacts_with_probs(set);
+            std::vector<std::pair<DATA::PackedArtifact, double>> allart;
+            for (int i = 0; i < full.size(); i += sample_every)
+                allart.push_back({ full[i].first, full[i].second * sample_every });
+            std::vector<dftype> dfcosts;
+            for (int i = 0; i < targets; i++)
+                dfcosts.push_back(10000 + 4000. * i / std::max(1, targets - 1));
+            int evaluations = 0;
+            auto cc = std::chrono::steady_clock::now();
+            auto curve = find_gains(ss, bar, dfcosts, allart, 100000000, gain_precision, &evaluations);
+            double curve_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            cc = std::chrono::steady_clock::now();
+            int differ = 0;
+            for (int i = 0; i < targets; i++)
+                differ += std::abs(find_gain(ss, bar, dfcosts[i], allart, 100000000, gain_precision) - curve[i]) > gain_precision;
+            double single_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            std::cout << format("bar {:.1f}: gain {:.1f} to {:.1f}, {} targets by {} evaluations {:.3f}s, find_gain per target {:.3f}s, {} differ\n",
+                bar, curve.front(), curve.back(), targets, evaluations, curve_time, single_time, differ);
+        }
+    }
+
+    // get_expected_dfcost of all five sets and mixed catalog by one merged
+    // pass, against one call per set. merged entries are subsampled by
+    // sample_every, which keeps sharing between sets.
+    void compare_multi_set(int times = 3, int sample_every = 10) {
+        std::vector<DATA::SET_NAMES> sets;
+        for (int i = static_cast<int>(DATA::SET_NAMES::start) + 1; i <= static_cast<int>(DATA::SET_NAMES::end); i++)
+            sets.push_back(static_cast<DATA::SET_NAMES>(i));
+        auto catalog = merge_catalogs(sets);
+        int total = 0, merged_number = (catalog.art.size() + sample_every - 1) / sample_every;
+        for (auto& order : catalog.order) {
+            std::vector<std::pair<int, double>> sampled;
+            for (auto& [entry, rate] : order)
+                if (entry % sample_every == 0)
+                    sampled.push_back({ entry, rate * sample_every });
+            order = std::move(sampled);
+            total += order.size();
+        }
+        for (int k = 0; k < times; k++) {
+            auto [ss, bar, df, set] = generate_random_gain_input();
+            dftype gain = std::pow(10, 3 + DATA::rand() * 4);
+            auto cc = std::chrono::steady_clock::now();
+            auto merged = get_expected_dfcost(ss, bar, catalog, std::vector<dftype>(sets.size(), gain));
+            double merged_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            cc = std::chrono::steady_clock::now();
+            int differ = 0;
+            for (int j = 0; j < sets.size(); j++) {
+                std::vector<std::pair<DATA::PackedArtifact, double>> allart;
+                for (auto& [entry, rate] : catalog.order[j])
+                    allart.push_back({ catalog.art[entry], rate });
+                differ += get_expected_dfcost(ss, bar, allart, gain) != merged[j];
+            }
+            double single_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            std::cout << format("bar {:.1f} gain {:.1f}: {} set artifacts, {} merged, one pass {:.3f}s, per set {:.3f}s, {} differ\n",
+                bar, gain, total, merged_number, merged_time, single_time, differ);
+        }
+    }
+
+    // get_expected_dfcost_sampled against exact one on catalog subsampled by
+    // sample_every, and find_gain_sampled against find_gain. a sampled gain
+    // is close if exact dfcost there is within twice relative_error of target,
+    // half width of its estimate plus error of estimate.
+    void compare_sampled_dfcost(int times = 5, int sample_every = 1, double relative_error = 0.01, dftype gain_precision = 100) {
+        int covered = 0, close = 0;
+        for (int k = 0; k < times; k++) {
+            auto [ss, bar, df, set] = generate_random_gain_input();
+            dftype gain = std::pow(10, 3 + DATA::rand() * 4);
+            auto full = DATA::get_all_packed_artifacts_with_probs(set);
+            std::vector<std::pair<DATA::PackedArtifact, double>> allart;
+            for (int i = 0; i < full.size(); i += sample_every)
+                allart.push_back({ full[i].first, full[i].second * sample_every });
+            auto cc = std::chrono::steady_clock::now();
+            auto exact = get_expected_dfcost(ss, bar, allart, gain);
+            double exact_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            cc = std::chrono::steady_clock::now();
+            auto estimate = get_expected_dfcost_sampled(ss, bar, allart, gain, relative_error);
+            double sampled_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            covered += std::abs(estimate.value - exact) <= estimate.half_width;
+            cc = std::chrono::steady_clock::now();
+            long long samples = 0;
+            auto sampled_gain = find_gain_sampled(ss, bar, df, allart, relative_error, 100000000, gain_precision, 0, &samples);
+            double sampled_gain_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            cc = std::chrono::steady_clock::now();
+            auto exact_gain = find_gain(ss, bar, df, allart, 100000000, gain_precision);
+            double exact_gain_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            auto sampled_dfcost = get_expected_dfcost(ss, bar, allart, sampled_gain);
+            close += std::abs(sampled_dfcost - df) <= 2 * relative_error * df || std::abs(sampled_gain - exact_gain) <= gain_precision;
+            std::cout << format("bar {:.1f} gain {:.1f}: dfcost {:.1f} estimate {:.1f} +- {:.1f} by {} samples, {:.3f}s vs {:.3f}s; "
+                "find_gain {:.1f} sampled {:.1f} (dfcost {:.1f} for {:.1f}) by {} samples, {:.3f}s vs {:.3f}s\n",
+                bar, gain, exact, estimate.value, estimate.half_width, estimate.samples, sampled_time, exact_time,
+                exact_gain, sampled_gain, sampled_dfcost, df, samples, sampled_gain_time, exact_gain_time);
+        }
+        std::cout << format("{} of {} confidence intervals cover exact dfcost, {} of {} sampled gains close\n", covered, times, close, times);
+    }
+
+    // gain atlas built on small grid of random profiles, queried inside grid
+    // against find_gain. catalog of whole grid is one set, and max_gain is
+    // lowered to keep building short.
+    void test_gain_atlas(int profiles = 1, int times = 3, DATA::SET_NAMES set = DATA::SET_NAMES::flower,
+        dftype gain_precision = 10, double tolerance = 0.05, dftype max_gain = 1000000, const std::string& filename = "gain_atlas_test.bin") {
+        AtlasGrid grid;
+        for (int i = 0; i < profiles; i++)
+            grid.profiles.push_back(std::get<0>(generate_random_gain_input()));
+        grid.bars = { 20, 30 };
+        grid.costs = { 10000, 14000 };
+        grid.sets = { set };
+        auto cc = std::chrono::steady_clock::now();
+        GainAtlas::build(grid, filename, max_gain, gain_precision);
+        double build_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+        GainAtlas atlas;
+        if (!atlas.load(filename)) throw std::runtime_error("can not load atlas " + filename);
+        std::cout << format("{} points built in {:.3f}s\n", atlas.points(), build_time);
+        int covered = 0;
+        for (int k = 0; k < times; k++) {
+            auto& ss = grid.profiles[DATA::randint(profiles)];
+            double bar = 20 + DATA::rand() * 10;
+            dftype dfcost = 10000 + DATA::randint(4000);
+            cc = std::chrono::steady_clock::now();
+            auto answer = atlas.query(ss, bar, dfcost, set, tolerance);
+            double query_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            auto exact = find_gain(ss, bar, dfcost, set, max_gain, gain_precision);
+            covered += std::abs(answer.gain - exact) <= answer.error + gain_precision;
+            std::cout << format("bar {:.1f} cost {:.0f}: atlas {:.1f} +- {:.1f}{} by {:.6f}s, find_gain {:.1f}\n",
+                bar, dfcost, answer.gain, answer.error, answer.exact ? " exact" : "", query_time, exact);
+        }
+        std::cout << format("{} of {} answers within bound\n", covered, times);
+        std::remove(filename.c_str());
+    }
+
+    // atlas files whose size matches header but whose grid is degenerate or
+    // overflows must not load.
+    void test_gain_atlas_load(const std::string& filename = "gain_atlas_test.bin") {
+        std::vector<std::array<int64_t, 4>> grids = { { 1, 1, 2, 2 }, { 1, 1, 1, 2 }, { 1, 1, 2, 1 }, { 1, 1, 1, 1 },
+            { 0, 1, 2, 2 }, { 1, 0, 2, 2 }, { 1, 1, -1, 2 }, { 1, 1, int64_t(1) << 32, int64_t(1) << 32 } };
+        for (auto [P, T, B, C] : grids) {
+            GainAtlas::Header header;
+            memcpy(header.magic, GainAtlas::MAGIC, sizeof(GainAtlas::MAGIC));
+            header.format = GainAtlas::FORMAT;
+            header.version = ResultCache::version<dftype, stype, DATA::RULES_5STAR>();
+            header.profiles = P;
+            header.bars = B;
+            header.costs = C;
+            header.sets = T;
+            header.max_gain = 100000000;
+            header.gain_precision = 1;
+            // ascending grid values, so a file that loads can also be queried
+            double fields = double(P) * DATA::SUB_TYPES + B + C + T + double(P) * T * B * C + double(P) * T * (B - 1) * (C - 1);
+            std::vector<double> data(static_cast<size_t>(std::clamp<double>(fields, 0, 1000)));
+            for (size_t i = 0; i < data.size(); i++) data[i] = i;
+            {
+                std::ofstream output(filename, std::ios::binary);
+                output.write(reinterpret_cast<const char*>(&header), sizeof(header));
+                output.write(reinterpret_cast<const char*>(data.data()), data.size() * sizeof(double));
+            }
+            GainAtlas atlas;
+            bool valid = P >= 1 && T >= 1 && B >= 2 && C >= 2 && fields <= 1000;
+            if (atlas.load(filename) != valid)
+                throw std::runtime_error(format("atlas of {} profiles {} sets {} bars {} costs {}", P, T, B, C, valid ? "not loaded" : "loaded"));
+        }
+        std::remove(filename.c_str());
+        std::cout << format("{} atlas headers checked\n", grids.size());
+    }
+
+    // surrogate predictions of whole dataset against its results, then
+    // find_gain_surrogate on a few of covered queries, timed against one exact
+    // get_expected_dfcost, which is one of about 27 steps of find_gain.
+    void compare_surrogate(const std::string& model_file = "surrogate.txt", const std::string& filename = "train/result.txt",
+        int times = 3, double tolerance = 0.05) {
+        SurrogateModel model;
+        if (!model.load(model_file)) throw std::runtime_error("can not load surrogate model " + model_file);
+        auto queries = read_solved_queries(filename);
+        std::vector<SolvedQuery> covered;
+        for (auto& query : queries)
+            if (model.covers(query.score_bar, query.dfcost, query.set)) covered.push_back(query);
+        if (covered.empty()) throw std::runtime_error("no covered query in " + filename);
+        auto cc = std::chrono::steady_clock::now();
+        auto predictions = model.predict(covered);
+        double predict_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+        double error = 0;
+        for (int i = 0; i < covered.size(); i++)
+            error += std::abs(predictions[i] - covered[i].gain) / covered[i].gain;
+        std::cout << format("{} of {} queries covered, predicted in {:.3f}us each, mean relative error {:.4f}\n",
+            covered.size(), queries.size(), predict_time / covered.size() * 1e6, error / covered.size());
+        std::shuffle(covered.begin(), covered.end(), DATA::mt);
+        covered.resize(std::min<int>(times, covered.size()));
+        int within = 0, accepted = 0;
+        double surrogate_time = 0, evaluation_time = 0;
+        for (auto& query : covered) {
+            cc = std::chrono::steady_clock::now();
+            auto answer = find_gain_surrogate(model, { query }, tolerance)[0];
+            double query_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            auto allart = DATA::get_all_packed_artifacts_with_probs(query.set);
+            long long enumerated = 0;
+            for (auto& [art, rate] : allart)
+                enumerated += std::pow(DATA::AFFIX_UPDATE_MAX - DATA::AFFIX_UPDATE_MIN + 1, art.sub_number()) - 1;
+            cc = std::chrono::steady_clock::now();
+            get_expected_dfcost(query.sub_scores, query.score_bar, allart, query.gain);
+            double exact_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            within += std::abs(answer.gain - query.gain) <= tolerance * query.gain + 1;
+            accepted += !answer.exact;
+            if (!answer.exact) surrogate_time += query_time, evaluation_time += exact_time;
+            std::cout << format("bar {:.1f} cost {:.0f}: surrogate {:.1f}{} by {:.3f}s and {} samples, dataset {:.1f}, "
+                "one exact evaluation {:.3f}s and {} calc\n", query.score_bar, query.dfcost, answer.gain, answer.exact ? " exact" : "",
+                query_time, answer.samples, query.gain, exact_time, enumerated);
+        }
+        std::cout << format("{} of {} answers within tolerance, {} accepted by check costing {:.2f} exact evaluations each\n",
+            within, covered.size(), accepted, accepted ? surrogate_time / evaluation_time : 0.);
+    }
+
+    // find_gain_seeded by nnresult of dataset against find_gain, evaluations
+    // of get_expected_dfcost are counted. catalog is subsampled by sample_every.
+    void compare_seeded_gain(const std::string& filename = "train/result.txt", int times = 5, int sample_every = 1,
+        dftype gain_precision = 1, double spread = 0.1) {
+        std::vector<SolvedQuery> queries;
+        for (auto& query : read_solved_queries(filename))
+            if (query.prediction > 0) queries.push_back(query);
+        if (queries.size() < times) throw std::runtime_error("not enough queries with nnresult in " + filename);
+        std::shuffle(queries.begin(), queries.end(), DATA::mt);
+        int full_evaluations = 0, seeded_evaluations = 0, differ = 0;
+        for (int k = 0; k < times; k++) {
+            auto& query = queries[k];
+            auto full = DATA::get_all_packed_artifacts_with_probs(query.set);
+            std::vector<std::pair<DATA::PackedArtifact, double>> allart;
+            for (int i = 0; i < full.size(); i += sample_every)
+                allart.push_back({ full[i].first, full[i].second * sample_every });
+            int evaluations = 0;
+            auto cc = std::chrono::steady_clock::now();
+            auto gain = find_gain(query.sub_scores, query.score_bar, query.dfcost, allart, 100000000, gain_precision, &evaluations);
+            double full_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            full_evaluations += evaluations;
+            cc = std::chrono::steady_clock::now();
+            auto seeded = find_gain_seeded(query.sub_scores, query.score_bar, query.dfcost, allart, query.prediction, spread,
+                100000000, gain_precision, &evaluations);
+            double seeded_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            seeded_evaluations += evaluations;
+            differ += std::abs(gain - seeded) > gain_precision;
+            std::cout << format("bar {:.1f} cost {:.0f}: nnresult {:.1f}, find_gain {:.1f} by {:.3f}s, seeded {:.1f} by {} evaluations {:.3f}s\n",
+                query.score_bar, query.dfcost, query.prediction, gain, full_time, seeded, evaluations, seeded_time);
+        }
+        std::cout << format("evaluations per query {:.1f} seeded against {:.1f}, {} differ\n",
+            seeded_evaluations * 1. / times, full_evaluations * 1. / times, differ);
+    }
+
+    // find_gain_indexed against find_gain on queries held out of dataset,
+    // index is built by the rest. catalog is subsampled by sample_every.
+    void compare_gain_index(const std::string& filename = "artifacts/result.txt", int times = 5, int sample_every = 1,
+        dftype gain_precision = 1) {
+        auto queries = read_solved_queries(filename);
+        if (queries.size() <= times) throw std::runtime_error("not enough solved queries in " + filename);
+        std::shuffle(queries.begin(), queries.end(), DATA::mt);
+        GainIndex index;
+        for (int i = times; i < queries.size(); i++)
+            index.add(queries[i]);
+        int full_evaluations = 0, indexed_evaluations = 0, differ = 0;
+        for (int k = 0; k < times; k++) {
+            auto& query = queries[k];
+            auto full = DATA::get_all_packed_artifacts_with_probs(query.set);
+            std::vector<std::pair<DATA::PackedArtifact, double>> allart;
+            for (int i = 0; i < full.size(); i += sample_every)
+                allart.push_back({ full[i].first, full[i].second * sample_every });
+            int evaluations = 0, fallbacks = 0;
+            auto cc = std::chrono::steady_clock::now();
+            auto gain = find_gain(query.sub_scores, query.score_bar, query.dfcost, allart, 100000000, gain_precision, &evaluations);
+            double full_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            full_evaluations += evaluations;
+            auto bracket = index.bracket(query.sub_scores, query.score_bar, query.dfcost, query.set);
+            cc = std::chrono::steady_clock::now();
+            auto indexed = find_gain_indexed(index, query.sub_scores, query.score_bar, query.dfcost, allart, query.set,
+                100000000, gain_precision, &evaluations, &fallbacks);
+            double indexed_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            indexed_evaluations += evaluations;
+            differ += std::abs(gain - indexed) > gain_precision;
+            std::cout << format("bar {:.1f} cost {:.0f}: dataset {:.1f}, find_gain {:.1f} by {:.3f}s, bracket [{:.1f}, {:.1f}] "
+                "indexed {:.1f} by {} evaluations {} fallbacks {:.3f}s\n", query.score_bar, query.dfcost, query.gain, gain,
+                full_time, bracket->first, bracket->second, indexed, evaluations, fallbacks, indexed_time);
+        }
+        std::cout << format("{} queries indexed, evaluations {} against {}, {} differ\n",
+            index.size(), indexed_evaluations, full_evaluations, differ);
+    }
+
+    // calc_cached on random artifacts written from several caches at once,
+    // checked against calc by a reader, then compacted under that reader.
+    void test_result_cache(int times = 64, int repeat = 3, const std::string& filename = "result_cache_test.bin") {
+        std::remove(filename.c_str());
+        std::vector<std::tuple<DATA::PackedArtifact, std::map<DATA::AFFIX_NAMES, double>, double, dftype>> inputs;
+        for (int k = 0; k < times; k++) {
+            auto [ss, bar, df, set] = generate_random_gain_input();
+            auto art = DATA::PackedArtifact(DATA::random_one_artifact(set));
+            inputs.push_back({ art, ss, bar, std::pow(10, 3 + DATA::rand() * 4) });
+        }
+        auto cc = std::chrono::steady_clock::now();
+        #pragma omp parallel for
+        for (int k = 0; k < times * repeat; k++) {
+            // one cache each, as different processes
+            ResultCache cache(filename);
+            auto& [art, ss, bar, gain] = inputs[k % times];
+            ResultCache::Record record;
+            record.key = ResultCache::make_key(ResultCache::CALC, ss, bar, gain, art.set(), 0, 0, art);
+            auto [success, e_gain, e_df_cost, success_rate, e_score_gain] = calc(art, ss, bar, gain);
+            record.result[0] = success;
+            record.result[1] = e_gain;
+            record.result[2] = e_df_cost;
+            record.result[3] = success_rate;
+            record.result[4] = e_score_gain;
+            cache.append(record);
+        }
+        double miss_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count() / (times * repeat);
+        ResultCache reader(filename);
+        int wrong = 0;
+        double hit_time = 0;
+        auto check = [&]() {
+            for (auto& [art, ss, bar, gain] : inputs) {
+                auto cc = std::chrono::steady_clock::now();
+                auto cached = calc_cached(reader, art, ss, bar, gain);
+                hit_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count() / times;
+                wrong += cached != calc(art, ss, bar, gain);
+            }
+        };
+        check();
+        size_t before = reader.size();
+        auto kept = ResultCache::compact(filename);
+        hit_time = 0;
+        check();
+        std::cout << format("{} records, {} after compact, {} after reader reopened, {} wrong; calc {:.6f}s, cache hit {:.6f}s\n",
+            before, kept, reader.size(), wrong, miss_time, hit_time);
+
+        // compactions racing with each other and with appends of new keys,
+        // no appended record may be lost
+        const int WRITERS = 4, COMPACTORS = 4, APPENDS = 50;
+        std::vector<std::thread> threads;
+        for (int w = 0; w < WRITERS; w++)
+            threads.emplace_back([&, w]() {
+                ResultCache cache(filename);
+                for (int k = 0; k < APPENDS; k++) {
+                    ResultCache::Record record;
+                    record.key = ResultCache::make_key(ResultCache::FIND_GAIN, {}, w, k);
+                    cache.append(record);
+                }
+            });
+        for (int c = 0; c < COMPACTORS; c++)
+            threads.emplace_back([&]() {
+                for (int k = 0; k < APPENDS / 5; k++)
+                    ResultCache::compact(filename);
+            });
+        for (auto& thread : threads)
+            thread.join();
+        ResultCache after(filename);
+        int lost = 0;
+        for (int w = 0; w < WRITERS; w++)
+            for (int k = 0; k < APPENDS; k++) {
+                ResultCache::Record record;
+                lost += !after.lookup(ResultCache::make_key(ResultCache::FIND_GAIN, {}, w, k), record);
+            }
+        std::cout << format("{} of {} records appended during concurrent compactions lost\n", lost, WRITERS * APPENDS);
+        if (lost) throw std::runtime_error("result cache lost records in concurrent compaction");
+        std::remove(filename.c_str());
+    }
+
+    // compare calc_outcome of random drops with Monte Carlo of the same
+    // decisions, which rolls the artifact and asks calc after every roll.
+    void test_outcome_distribution(int times = 10, int samples = 2000) {
+        double outcome_time = 0, sample_time = 0, max_diff = 0;
+        for (int k = 0; k < times; k++) {
+            auto [ss, bar, df, set] = generate_random_gain_input();
+            dftype gain = std::pow(10, 3 + DATA::rand() * 5);
+            auto art = DATA::get_packed_drop(DATA::rand());
+            auto cc = std::chrono::steady_clock::now();
+            auto dist = calc_outcome(art, ss, bar, gain);
+            outcome_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            auto expect = calc(art, ss, bar, gain);
+            if (dist.upgrade != std::get<0>(expect))
+                throw std::runtime_error("outcome decision differs from calc: " + art.to_artifact().to_string());
+            double pmf_mean = 0, pmf_mean2 = 0;
+            for (auto& [cost, p] : dist.df_cost_pmf) {
+                pmf_mean += cost * p;
+                pmf_mean2 += cost * cost * p;
+            }
+            max_diff = std::max({ max_diff, std::abs(dist.e_df_cost - std::get<2>(expect)),
+                std::abs(pmf_mean - dist.e_df_cost), std::abs(pmf_mean2 - dist.e_df_cost2) / std::max(1., dist.e_df_cost2) });
+            cc = std::chrono::steady_clock::now();
+            std::vector<double> cost(samples), final_score(samples);
+            for (int s = 0; s < samples; s++) {
+                auto a = art;
+                while (true) {
+                    bool upgrade = std::get<0>(calc(a, ss, bar, gain));
+                    if (a.level() == N || !upgrade) {
+                        cost[s] = a.level() == N && upgrade ? SUCCESS_DOGFOOD_COST : -DOGFOOD_LOSS[a.level()];
+                        break;
+                    }
+                    int w = DATA::randint(DATA::AFFIX_UPDATE_MAX - DATA::AFFIX_UPDATE_MIN + 1) + DATA::AFFIX_UPDATE_MIN;
+                    a.set_level(a.level() + 1);
+                    if (a.sub_number() < DATA::AFFIX_NUM) {
+                        int used = 0;
+                        for (int i = 0; i < a.sub_number(); i++)
+                            used |= DATA::SUB_BIT[static_cast<int>(a.sub_type(i))];
+                        auto& sub_dist = DATA::sub_cumulative(a.main(), used);
+                        a.push_sub(sub_dist.pick(DATA::randint(sub_dist.sum())), w);
+                    }
+                    else {
+                        int idx = DATA::randint(a.sub_number());
+                        a.set_sub_weight(idx, a.sub_weight(idx) + w);
+                    }
+                }
+                for (int i = 0; i < a.sub_number(); i++)
+                    final_score[s] += a.sub_weight(i) * ss[a.sub_type(i)];
+            }
+            sample_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            double mean = 0, mean2 = 0;
+            for (auto c : cost) {
+                mean += c / samples;
+                mean2 += c * c / samples;
+            }
+            std::sort(final_score.begin(), final_score.end());
+            std::cout << format("bar {:.1f} gain {:.1f}: dogfood mean {:.1f} / {:.1f}, sd {:.1f} / {:.1f}, score q10 q50 q90 {:.1f} {:.1f} {:.1f} / {:.1f} {:.1f} {:.1f}\n",
+                bar, gain, dist.e_df_cost, mean, std::sqrt(dist.df_cost_variance()), std::sqrt(std::max(0., mean2 - mean * mean)),
+                dist.score_quantile(0.1), dist.score_quantile(0.5), dist.score_quantile(0.9),
+                final_score[samples / 10], final_score[samples / 2], final_score[samples * 9 / 10]);
+        }
+        std::cout << format("{} artifacts: calc_outcome {:.3f}s, {} samples each {:.3f}s, max diff of moments {:.3e}\n",
+            times, outcome_time, samples, sample_time, max_diff);
+    }
+
+    // check calc_dual values against calc on a subsampled catalog, and its
+    // derivatives against central differences of expected dogfood cost. dual
+    // is derivative of smoothed model and difference is of steps, so single
+    // parameters may differ. changes over difference step of all parameters
+    // must point same way, cosine at least min_cosine, and their norms must be
+    // within max_ratio of each other.
+    void test_dual_derivatives(int times = 3, int sample_every = 50, double min_cosine = 0.95, double max_ratio = 3) {
+        for (int k = 0; k < times; k++) {
+            auto [ss, bar, df, set] = generate_random_gain_input();
+            dftype gain = std::pow(10, 3 + DATA::rand() * 4);
+            auto full = DATA::get_all_packed_artifacts_with_probs(set);
+            std::vector<std::pair<DATA::PackedArtifact, double>> allart;
+            for (int i = 0; i < full.size(); i += sample_every)
+                allart.push_back(full[i]);
+            auto cc = std::chrono::steady_clock::now();
+            auto value = get_expected_dfcost<double, double>(ss, bar, allart, gain);
+            double plain_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            cc = std::chrono::steady_clock::now();
+            auto dual = get_expected_dfcost_dual(ss, bar, allart, gain);
+            double dual_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            std::cout << format("bar {:.1f} gain {:.1f}: dfcost {:.6f} dual {:.6f}, plain {:.3f}s dual {:.3f}s\n",
+                bar, gain, value, dual.v, plain_time, dual_time);
+            if (dual.v != value)
+                throw std::runtime_error("calc_dual value differs from calc");
+            auto shifted = [&](int x, double h) {
+                auto s2 = ss;
+                double b2 = bar, g2 = gain;
+                if (x < DATA::SUB_TYPES) s2[DATA::SUB_PROB_WEIGHT_TABLE[x].first] += h;
+                else if (x == DUAL_BAR) b2 += h;
+                else g2 += h;
+                return get_expected_dfcost<double, double>(s2, b2, allart, g2);
+            };
+            double dot = 0, dual_norm = 0, diff_norm = 0;
+            for (int x = 0; x < DATA::SUB_TYPES + 2; x++) {
+                std::string name = x < DATA::SUB_TYPES ? DATA::type_to_string(DATA::string_to_affix_names, DATA::SUB_PROB_WEIGHT_TABLE[x].first)
+                    : x == DUAL_BAR ? "bar" : "gain";
+                double h = x == DUAL_GAIN ? gain * 0.02 : x == DUAL_BAR ? 0.5 : 0.05;
+                double diff = (shifted(x, h) - shifted(x, -h)) / (2 * h);
+                dot += dual.d[x] * diff * h * h;
+                dual_norm += dual.d[x] * dual.d[x] * h * h;
+                diff_norm += diff * diff * h * h;
+                std::cout << format("  {:5} dual {:+.6e} difference {:+.6e}\n", name, dual.d[x], diff);
+            }
+            dual_norm = std::sqrt(dual_norm);
+            diff_norm = std::sqrt(diff_norm);
+            if (dual_norm == 0 && diff_norm == 0) continue;
+            double cosine = dot / (dual_norm * diff_norm), ratio = dual_norm / diff_norm;
+            std::cout << format("  cosine {:.3f}, norm ratio {:.3f}\n", cosine, ratio);
+            if (!(cosine >= min_cosine && ratio <= max_ratio && ratio >= 1 / max_ratio))
+                throw std::runtime_error("dual derivatives differ from central difference");
+        }
+    }
+
     auto read_existing_weight(const std::string filename) {
         std::map<std::string, std::map<DATA::AFFIX_NAMES, double>> sub_scores;
         std::vector<std::string> order = {
@@ -1173,6 +5539,239 @@ namespace DP {
         return sub_scores;
     }
 
+    // accuracy of float and fixed point DP. for every profile in weights file
+    // with random bar, dfcost and set, compare find_gain of float and int score
+    // DP with double. max_profiles < 0 means all profiles. catalog is
+    // subsampled by sample_every, same catalog for all precisions.
+    void compare_precision(const std::string& filename = "weights.txt", int max_profiles = -1, dftype gain_precision = 1,
+        int sample_every = 1) {
+        auto profiles = read_existing_weight(filename);
+        const int PRECISION_NUMBER = 3;
+        const std::string names[PRECISION_NUMBER] = { "double", "float", "int" };
+        double max_error[PRECISION_NUMBER] = {}, sum_error[PRECISION_NUMBER] = {}, used_time[PRECISION_NUMBER] = {};
+        int differ[PRECISION_NUMBER] = {}; // results more than gain_precision away from double
+        int count = 0;
+        for (auto& [note, data] : profiles) {
+            if (max_profiles >= 0 && count >= max_profiles) break;
+            auto [ss, bar, df, set] = generate_random_gain_input(data);
+            auto full = DATA::get_all_packed_artifacts_with_probs(set);
+            std::vector<std::pair<DATA::PackedArtifact, double>> allart;
+            for (int i = 0; i < full.size(); i += sample_every)
+                allart.push_back({ full[i].first, full[i].second * sample_every });
+            dftype result[PRECISION_NUMBER];
+            for (int p = 0; p < PRECISION_NUMBER; p++) {
+                auto cc = clock();
+                if (p == 0) result[p] = find_gain<double, double>(ss, bar, df, allart, 100000000, gain_precision);
+                else if (p == 1) result[p] = find_gain<float, float>(ss, bar, df, allart, 100000000, gain_precision);
+                else result[p] = find_gain<float, int>(ss, bar, df, allart, 100000000, gain_precision);
+                used_time[p] += clock() - cc;
+                differ[p] += std::abs(result[p] - result[0]) > gain_precision;
+            }
+            std::string s = format("{} bar:{:.2f} cost:{} set:{} {}:{:.2f}", note, bar, df,
+                DATA::type_to_string(DATA::string_to_set_names, set), names[0], result[0]);
+            for (int p = 1; p < PRECISION_NUMBER; p++) {
+                auto error = std::abs(result[p] - result[0]) / std::max<dftype>(1, std::abs(result[0]));
+                max_error[p] = std::max(max_error[p], error);
+                sum_error[p] += error;
+                s += format(" {}:{:.2f}({:.2e})", names[p], result[p], error);
+            }
+            std::cout << s << std::endl;
+            count++;
+        }
+        for (int p = 0; p < PRECISION_NUMBER; p++)
+            std::cout << format("{}: time {:.2f}s max relative error {:.3e} mean relative error {:.3e}, {} of {} differ by more than gain_precision\n",
+                names[p], used_time[p] / CLOCKS_PER_SEC, max_error[p], sum_error[p] / std::max(1, count), differ[p], count);
+    }
+
+    // calc_profiles on random drops against calc per profile of weights file.
+    // calc sweep is forced so results should be same.
+    void compare_profiles(const std::string& filename = "weights.txt", int times = 20) {
+        std::vector<std::map<DATA::AFFIX_NAMES, double>> profiles;
+        for (auto& [note, data] : read_existing_weight(filename))
+            profiles.push_back(data);
+        if (profiles.empty())
+            throw std::runtime_error("no profile in " + filename);
+        Engine engine = current_engine();
+        engine.engine = ENGINE_NAMES::calc;
+        EngineScope scope(engine);
+        double batch_time = 0, single_time = 0, max_diff = 0;
+        int differ = 0;
+        for (int k = 0; k < times; k++) {
+            auto art = DATA::get_packed_drop(DATA::rand());
+            for (int i = DATA::randint(N + 1 - art.level()); i--; ) {
+                if (art.sub_number() < DATA::AFFIX_NUM) break;
+                auto idx = DATA::randint(art.sub_number());
+                art.set_sub_weight(idx, art.sub_weight(idx) + DATA::AFFIX_UPDATE_MIN + DATA::randint(DATA::AFFIX_UPDATE_MAX - DATA::AFFIX_UPDATE_MIN + 1));
+                art.set_level(art.level() + 1);
+            }
+            auto [ss, bar, df, set] = generate_random_gain_input();
+            dftype gain = std::pow(10, 3 + DATA::rand() * 5);
+            auto cc = std::chrono::steady_clock::now();
+            auto batch = calc_profiles(art, profiles, bar, gain);
+            batch_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            cc = std::chrono::steady_clock::now();
+            int best = -1;
+            dftype best_gain = 0;
+            for (int p = 0; p < profiles.size(); p++) {
+                auto single = calc(art, profiles[p], bar, gain);
+                if (best < 0 || std::get<1>(single) > best_gain) {
+                    best = p;
+                    best_gain = std::get<1>(single);
+                }
+                differ += std::get<0>(single) != std::get<0>(batch.result[p]);
+                max_diff = std::max({ max_diff, std::abs(std::get<1>(single) - std::get<1>(batch.result[p])),
+                    std::abs(std::get<2>(single) - std::get<2>(batch.result[p])), std::abs(std::get<3>(single) - std::get<3>(batch.result[p])) });
+            }
+            single_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - cc).count();
+            differ += best != batch.best;
+        }
+        std::cout << format("{} artifacts x {} profiles: calc_profiles {:.3f}s, calc per profile {:.3f}s, {} decisions differ, max diff {:.3e}\n",
+            times, profiles.size(), batch_time, single_time, differ, max_diff);
+    }
+
+    // check compile time cell[] and catalog of rule R against runtime builders.
+    // throw if states differ or any artifact rate differs.
+    template <class R>
+    void check_embedded_tables(const std::string& name) {
+        std::vector<std::pair<unsigned int, int>> runtime_cell[Rule<R>::N + 1];
+        auto cc = clock();
+        build_cell<R>(runtime_cell);
+        auto cell_time = clock() - cc;
+        using E = EmbeddedCell<R>;
+        for (int n = 0; n <= Rule<R>::N; n++) {
+            if (runtime_cell[n].size() != E::BEGIN[n + 1] - E::BEGIN[n])
+                throw std::runtime_error(format("{}: state number of upgrade time {} differs", name, n));
+            for (int i = 0; i < runtime_cell[n].size(); i++) {
+                auto& state = E::TABLE[E::BEGIN[n] + i];
+                if (runtime_cell[n][i].first != state.status || runtime_cell[n][i].second != state.count)
+                    throw std::runtime_error(format("{}: state {} of upgrade time {} differs", name, i, n));
+            }
+        }
+
+        cc = clock();
+        auto runtime_arts = DATA::build_all_artifacts_with_probs<R>();
+        auto catalog_time = clock() - cc;
+        using C = DATA::EmbeddedCatalog<R>;
+        if (runtime_arts.size() != C::SIZE)
+            throw std::runtime_error(format("{}: catalog size differs", name));
+        std::unordered_map<std::string, double> rates;
+        for (auto& [art, rate] : runtime_arts)
+            rates[art.to_string()] = rate;
+        double max_diff = 0;
+        for (auto& entry : C::TABLE) {
+            auto ite = rates.find(entry.to_artifact().to_string());
+            if (ite == rates.end())
+                throw std::runtime_error(format("{}: {} not in runtime catalog", name, entry.to_artifact().to_string()));
+            max_diff = std::max(max_diff, std::abs(ite->second - entry.rate));
+        }
+        if (max_diff > EPS * EPS)
+            throw std::runtime_error(format("{}: catalog rate differs by {}", name, max_diff));
+        std::cout << format("{}: {} states and {} artifacts same as runtime, max rate diff {:.3g}, total rate {:.15f}, runtime build {:.3f}s + {:.3f}s\n",
+            name, E::BEGIN[Rule<R>::N + 1], C::SIZE, max_diff, C::TABLE[C::SIZE - 1].accumulated,
+            cell_time * 1. / CLOCKS_PER_SEC, catalog_time * 1. / CLOCKS_PER_SEC);
+    }
+
+    // compare catalog generation by materialized sub orders with subset_rates
+    // on rule R, then time subset_rates on larger hypothetical sub pools whose
+    // weights repeat SUB_PROB_WEIGHT. memory is peak bytes of orders or rates
+    // held for one main.
+    template <class R = DATA::RULES_5STAR>
+    void compare_catalog_generation(int max_pool = 30) {
+        typedef std::pair<std::vector<DATA::AFFIX_NAMES>, double> SubOrder;
+        auto cc = clock();
+        size_t order_number = 0, order_bytes = 0;
+        double max_diff = 0;
+        for (int setn = int(DATA::SET_NAMES::start) + 1; setn < int(DATA::SET_NAMES::end); setn++) {
+            for (auto& [main, main_weight] : DATA::get_main_distribution(DATA::SET_NAMES(setn))) {
+                auto sub_dist = DATA::get_sub_distribution(main, std::vector<DATA::AFFIX_NAMES>());
+                std::vector<int> sub_weight;
+                for (auto& [sub, weight] : sub_dist)
+                    sub_weight.push_back(weight);
+                int sub_number = sub_dist.size();
+                std::vector<double> rate(DATA::subset_offset(sub_number, R::AFFIX_NUM + 1));
+                DATA::subset_rates(sub_weight.data(), sub_number, R::AFFIX_NUM, rate.data());
+                for (auto& [initial, initial_weight] : R::INITIAL_AFFIX_NUM_WEIGHT) {
+                    auto orders = DATA::generate_all_possible_sub_orders(initial, main);
+                    order_number += orders.size();
+                    order_bytes = std::max(order_bytes, orders.size() * (sizeof(SubOrder) + initial * sizeof(DATA::AFFIX_NAMES)));
+                    for (auto& i : orders)
+                        std::sort(i.first.begin(), i.first.end());
+                    std::sort(orders.begin(), orders.end());
+                    std::vector<SubOrder> merged;
+                    for (auto& [i, w] : orders) {
+                        if (merged.size() && merged.rbegin()->first == i)
+                            merged.rbegin()->second += w;
+                        else
+                            merged.push_back({ i, w });
+                    }
+                    for (auto& [subs, w] : merged) {
+                        std::vector<int> pos;
+                        for (auto sub : subs)
+                            pos.push_back(std::find_if(sub_dist.begin(), sub_dist.end(), [&](auto& x) { return x.first == sub; }) - sub_dist.begin());
+                        auto r = rate[DATA::subset_offset(sub_number, initial) + DATA::subset_rank(pos.data(), initial)];
+                        max_diff = std::max(max_diff, std::abs(r - w) / w);
+                    }
+                }
+            }
+        }
+        auto order_time = clock() - cc;
+        cc = clock();
+        auto arts = DATA::build_all_artifacts_with_probs<R>();
+        auto subset_time = clock() - cc;
+        std::cout << format("current pool: {} artifacts, orders {:.3f}s {} orders peak {} bytes, subset rates {:.3f}s peak {} bytes, max relative diff {:.3g}\n",
+            arts.size(), order_time * 1. / CLOCKS_PER_SEC, order_number, order_bytes,
+            subset_time * 1. / CLOCKS_PER_SEC, DATA::subset_offset(DATA::SUB_PROB_WEIGHT.size(), R::AFFIX_NUM + 1) * sizeof(double), max_diff);
+
+        for (int pool = DATA::SUB_PROB_WEIGHT.size(); pool <= max_pool; pool += 2) {
+            std::vector<int> weight;
+            for (int i = 0; i < pool; i++)
+                weight.push_back(DATA::SUB_PROB_WEIGHT[i % DATA::SUB_PROB_WEIGHT.size()].second);
+            cc = clock();
+            std::vector<double> rate(DATA::subset_offset(pool, R::AFFIX_NUM + 1));
+            DATA::subset_rates(weight.data(), pool, R::AFFIX_NUM, rate.data());
+            auto used = clock() - cc;
+            // orders one main would materialize, and how many sets they merge into
+            double orders = 0, sets = 0, total = 0;
+            for (auto& [initial, initial_weight] : R::INITIAL_AFFIX_NUM_WEIGHT) {
+                double o = 1, c = 1;
+                for (int i = 0; i < initial; i++) {
+                    o *= pool - i;
+                    c = c * (pool - i) / (i + 1);
+                }
+                orders = std::max(orders, o * (sizeof(SubOrder) + initial * sizeof(DATA::AFFIX_NAMES)));
+                sets += c;
+            }
+            for (int i = DATA::subset_offset(pool, R::AFFIX_NUM); i < rate.size(); i++)
+                total += rate[i];
+            std::cout << format("pool {:2d}: {:.0f} sets, subset rates {:.3f}s peak {} bytes, orders would peak {:.0f} bytes, {}-sub rate sum {:.12f}\n",
+                pool, sets, used * 1. / CLOCKS_PER_SEC, rate.size() * sizeof(double), orders, R::AFFIX_NUM, total);
+        }
+    }
+
+    // output catalog size of every set and calc result of random fresh
+    // artifacts under rule R, to check rules other than 5-star.
+    template <class R>
+    void test_rules(const std::string& name, int times = 3, dftype gain = 100000) {
+        init<R>();
+        std::cout << format("{}: sub {} upgrade {} success dogfood {} states {}\n", name,
+            R::AFFIX_NUM, Rule<R>::N, Rule<R>::SUCCESS_DOGFOOD_COST, Rule<R>::cell[Rule<R>::N].size());
+        for (int i = int(DATA::SET_NAMES::start) + 1; i < int(DATA::SET_NAMES::end); i++) {
+            auto set = DATA::SET_NAMES(i);
+            auto arts = DATA::get_all_artifacts_with_probs<R>(set);
+            double total = 0;
+            for (auto& [art, p] : arts)
+                total += p;
+            std::cout << format("    {}: {} artifacts, total rate {:.6f}\n", DATA::type_to_string(DATA::string_to_set_names, set), arts.size(), total);
+        }
+        for (int k = 0; k < times; k++) {
+            auto [ss, bar, df, set] = generate_random_gain_input();
+            auto art = DATA::random_one_artifact<R>(set);
+            auto [success, e_gain, e_dfcost, rate, e_score] = calc<dftype, stype, R>(art, ss, bar, gain);
+            std::cout << format("    {} sub, bar {:.1f}: {} {:.3f} {:.3f} {:.6f} {:.3f}\n",
+                art.sub.size(), bar, success, e_gain, e_dfcost, rate, e_score);
+        }
+    }
+
 }
 
 #ifdef __clang__ // clang is compiled to JS, define interface
@@ -1186,11 +5785,8 @@ auto get_string_to_affix_names() {
     return map;
 }
 
-// interface for javascript, input as string, output double vector
-auto calc(const std::string &art_str, const std::string sub_scores_json, 
-    double score_bar, DP::dftype gain) {
-
-    auto art = DATA::Artifact(art_str);
+// sub scores from json as {"atk": 0.5, ...}
+std::map<DATA::AFFIX_NAMES, double> parse_sub_scores_json(const std::string& sub_scores_json) {
     std::map<std::string, double> sub_str_scores;
     std::string name, number;
     int pos = 0, status = 0; // status 0 name, status 1 number
@@ -1219,6 +5815,15 @@ auto calc(const std::string &art_str, const std::string sub_scores_json,
     std::map<DATA::AFFIX_NAMES, double> sub_scores;
     for (auto &[i, j] : sub_str_scores)
         sub_scores[DATA::string_to_affix_names.find(i)->second] = j;
+    return sub_scores;
+}
+
+// interface for javascript, input as string, output double vector
+auto calc(const std::string &art_str, const std::string sub_scores_json, 
+    double score_bar, DP::dftype gain) {
+
+    auto art = DATA::Artifact(art_str);
+    auto sub_scores = parse_sub_scores_json(sub_scores_json);
 
     auto [a, b, c, d, e] = DP::calc(art, sub_scores, score_bar, gain);
     std::vector<double> res;
@@ -1230,6 +5835,26 @@ auto calc(const std::string &art_str, const std::string sub_scores_json,
     return res;
 }
 
+DP::SurrogateModel surrogate_model;
+
+// load exported surrogate model from file system of module
+bool load_surrogate(const std::string& filename) {
+    return surrogate_model.load(filename);
+}
+
+// find_gain by loaded surrogate, output gain and 1 if it is solved exactly.
+// without confirm prediction is returned unchecked, which is instant
+auto find_gain_surrogate(const std::string sub_scores_json, double score_bar, DP::dftype dfcost,
+    const std::string& set, double tolerance, bool confirm) {
+    DP::SolvedQuery query;
+    query.sub_scores = parse_sub_scores_json(sub_scores_json);
+    query.score_bar = score_bar;
+    query.dfcost = dfcost;
+    query.set = DATA::string_to_set_names.at(set);
+    auto answer = DP::find_gain_surrogate(surrogate_model, { query }, tolerance, confirm)[0];
+    return std::vector<double>{ answer.gain, double(answer.exact) };
+}
+
 EMSCRIPTEN_BINDINGS(my_module) {
     // function("get_string_to_affix_names", &get_string_to_affix_names);
     // register_map<std::string, DATA::AFFIX_NAMES>("map<string, affix_names>");
@@ -1243,17 +5868,117 @@ EMSCRIPTEN_BINDINGS(my_module) {
     //     end,
     // };
 
-    function("find_gain", &DP::find_gain);
+    function("find_gain", &DP::find_gain<>);
     // auto (&choose_calc)(const DATA::Artifact&, const std::map<DATA::AFFIX_NAMES, double> &, double, DP::dftype) = DP::calc;
     function("calc", &calc);
+    function("load_surrogate", &load_surrogate);
+    function("find_gain_surrogate", &find_gain_surrogate);
     register_vector<double>("vector<double>");
 }
 
 #else
-int main() {
+int main(int argc, char** argv) {
     // OMP_THREADS_MAX omp_set_num_threads(1024);
+    if (argc >= 2 && std::string(argv[1]) == "calibrate") {
+        // calibrate [file]: measure engines and save profile used by calc_auto
+        DP::calibrate_engines(5, true);
+        if (!DP::save_engine_profile(argc >= 3 ? argv[2] : DP::ENGINE_PROFILE_FILE)) {
+            std::cerr << "can not save engine profile" << std::endl;
+            return 1;
+        }
+        return 0;
+    }
+    if (argc >= 2 && std::string(argv[1]) == "check-rules") {
+        // check-rules: embedded tables against runtime ones, for 5-star and
+        // synthetic rule which keeps rule templating exercised
+        DP::check_embedded_tables<DATA::RULES_5STAR>("5-star");
+        DP::check_embedded_tables<DATA::RULES_SYNTHETIC>("synthetic");
+        DP::test_rules<DATA::RULES_SYNTHETIC>("synthetic", 1);
+        return 0;
+    }
+    // without profile, calc_auto uses calc_lazy
+    DP::load_engine_profile();
+    if (argc >= 2 && std::string(argv[1]) == "compact") {
+        // compact [file]: keep last record of every key in result cache
+        auto kept = DP::ResultCache::compact(argc >= 3 ? argv[2] : DP::RESULT_CACHE_FILE);
+        if (kept < 0) {
+            std::cerr << "can not compact result cache" << std::endl;
+            return 1;
+        }
+        std::cout << "result cache compacted, " << kept << " records" << std::endl;
+        return 0;
+    }
+    if (argc >= 4 && std::string(argv[1]) == "surrogate") {
+        // surrogate model queries [tolerance] [confirm]: gains of queries in dataset
+        // format, by surrogate when it is confirmed, otherwise by find_gain.
+        // confirm 0 returns predictions of covered queries unchecked
+        DP::SurrogateModel model;
+        if (!model.load(argv[2])) {
+            std::cerr << "can not load surrogate model " << argv[2] << std::endl;
+            return 1;
+        }
+        auto queries = DP::read_solved_queries(argv[3], false);
+        auto answers = DP::find_gain_surrogate(model, queries, argc >= 5 ? std::stod(argv[4]) : 0.05, argc >= 6 ? std::stoi(argv[5]) != 0 : true);
+        for (int i = 0; i < queries.size(); i++) {
+            auto& query = queries[i];
+            for (int k = 0; k < DATA::SUB_TYPES; k++) {
+                auto name = DATA::SUB_PROB_WEIGHT_TABLE[k].first;
+                auto ite = query.sub_scores.find(name);
+                std::cout << format("{}:{} ", DATA::type_to_string(DATA::string_to_affix_names, name), ite == query.sub_scores.end() ? 0 : ite->second);
+            }
+            std::cout << format("bar:{} cost:{} set:{} result:{} exact:{}\n", query.score_bar, query.dfcost,
+                DATA::type_to_string(DATA::string_to_set_names, query.set), answers[i].gain, int(answers[i].exact));
+        }
+        return 0;
+    }
     // DP::output_yaml();
     DP::test_one_artifact(false);
+    // compare states touched by top-down calc_lazy and full sweep calc
+    // DP::compare_lazy_calc();
+    // measure expected gain pruning over score bar range
+    // DP::compare_gain_prune();
+    // engines with different options running concurrently
+    // DP::test_engines();
+    // upgrade session decisions against calc after every roll
+    // DP::test_upgrade_session();
+    // per level cutoff policy against calc
+    // DP::test_threshold_policy();
+    // gains of many dfcost targets sharing evaluations against find_gain
+    // DP::compare_gain_curve();
+    // dogfood cost of all sets by one pass over merged catalog
+    // DP::compare_multi_set();
+    // stratified sampled dogfood cost and find_gain against exact ones
+    // DP::compare_sampled_dfcost();
+    // find_gain warm started by nearest solved queries of dataset
+    // DP::compare_gain_index();
+    // surrogate inference against dataset and find_gain, needs exported model
+    // DP::compare_surrogate();
+    // find_gain seeded by nnresult of dataset against find_gain
+    // DP::compare_seeded_gain();
+    // precomputed gain atlas interpolation against find_gain
+    // DP::test_gain_atlas();
+    // DP::test_gain_atlas_load();
+    // result cache written concurrently, read back and compacted
+    // DP::test_result_cache();
+    // dogfood cost variance and score quantiles against Monte Carlo
+    // DP::test_outcome_distribution();
+    // smoothed derivatives of dogfood cost against finite differences
+    // DP::test_dual_derivatives();
+    // one artifact against all profiles of weights file at once
+    // DP::compare_profiles();
+    // find_gain accuracy of float and fixed point DP against double
+    // DP::compare_precision();
+    // catalog and calc check of synthetic rule
+    // DP::test_rules<DATA::RULES_SYNTHETIC>("synthetic");
+    // compile time tables against runtime builders
+    // DP::check_embedded_tables<DATA::RULES_5STAR>("5-star");
+    // DP::check_embedded_tables<DATA::RULES_SYNTHETIC>("synthetic");
+    // catalog generation by sub orders against subset rates
+    // DP::compare_catalog_generation();
+    // artifact string formatter and bulk parser
+    // DATA::test_artifact_parser();
+    // batched appear rate of inventory against one by one
+    // DATA::test_appear_rate();
     /*
     int current = clock();
     for (int i = 0; i < 10; i++)
@@ -1402,6 +6127,27 @@ int main() {
     }
     */
 
+    /*
+    // random generate input with many dfcost of every profile
+    for (auto i = 100; i--; ) {
+        auto [ss, bar, df, set] = DP::generate_random_gain_input();
+        std::vector<DP::dftype> dfs;
+        for (int j = 0; j < 20; j++)
+            dfs.push_back(DATA::randint(4000) + 10000);
+        std::sort(dfs.begin(), dfs.end());
+        auto results = DP::find_gains(ss, bar, dfs, set);
+        for (int j = 0; j < dfs.size(); j++) {
+            std::string s = "";
+            for (auto& [affix, w] : DATA::SUB_PROB_WEIGHT) {
+                auto name = DATA::type_to_string(DATA::string_to_affix_names, affix);
+                s += format("{}:{} ", name, ss[affix]);
+            }
+            s += format(" bar:{} cost:{} set:{} result:{}", bar, dfs[j], DATA::type_to_string(DATA::string_to_set_names, set), results[j]);
+            std::cout << s << std::endl;
+        }
+    }
+    */
+
     /*
     // read generated data and check data cost and real cost
     std::string result_file = "result.txt";
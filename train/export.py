@@ -0,0 +1,51 @@
+import argparse
+
+import torch
+
+from model import MLP, MLPSetEmb
+
+
+def export(model, save, bar_max = 70, cost_min = 10000, cost_max = 14000):
+    """
+    write model as text for DP::SurrogateModel of main.cpp. file is
+
+    MLP|MLPSetEmb bar_max cost_min cost_max
+    set_number set_emb_dim, then set_number rows of embedding (MLPSetEmb)
+    layer number, then every linear layer as
+    in out, out rows of in weights, out biases
+
+    input and normalization must follow data_clean, output is log result.
+    """
+    linears = [x for x in model.mlps if isinstance(x, torch.nn.Linear)]
+    lines = [f'{type(model).__name__} {bar_max} {cost_min} {cost_max}']
+    if isinstance(model, MLPSetEmb):
+        emb = model.emb.weight.detach().cpu()
+        lines.append(f'{emb.shape[0]} {emb.shape[1]}')
+        lines += [' '.join(f'{x:.9g}' for x in row.tolist()) for row in emb]
+    lines.append(f'{len(linears)}')
+    for linear in linears:
+        weight = linear.weight.detach().cpu()
+        bias = linear.bias.detach().cpu()
+        lines.append(f'{weight.shape[1]} {weight.shape[0]}')
+        lines += [' '.join(f'{x:.9g}' for x in row.tolist())
+                  for row in weight]
+        lines.append(' '.join(f'{x:.9g}' for x in bias.tolist()))
+    open(save, 'w').write('\n'.join(lines) + '\n')
+
+
+def read_args():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('model', help = 'model class name')
+    parser.add_argument('hidden', help = 'hidden layer number and size')
+    parser.add_argument('load', help = 'saved state dict')
+    parser.add_argument('--save', default = 'surrogate.txt')
+    args = parser.parse_args()
+    args.hidden = [int(x) for x in args.hidden.split(',')]
+    return args
+
+
+if __name__ == '__main__':
+    args = read_args()
+    model = globals()[args.model](13, hidden = args.hidden)
+    model.load_state_dict(torch.load(args.load, map_location = 'cpu'))
+    export(model, args.save)